@@ -0,0 +1,126 @@
+// the cursor bitmap CCursorCapture diffs out of its two captures, against boxes with a known cursor painted in. Checks
+// the crop, hotspot and colors, a padded stride, xbgr, a cursor bigger than the cap and a box without one, then times
+// the diff at the box size of a 2x output.
+
+#include "../src/shared/CursorBitmap.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+constexpr static int ROUNDS = 2000;
+
+struct SBox {
+    uint32_t             w = 0, h = 0, stride = 0;
+    std::vector<uint8_t> with, without;
+
+    SBox(uint32_t w_, uint32_t h_, uint32_t stride_) : w(w_), h(h_), stride(stride_), with((size_t)stride_ * h_), without((size_t)stride_ * h_) {
+        // a background with some detail, and garbage in the padding and alpha that the diff has to ignore
+        for (size_t i = 0; i < without.size(); ++i) {
+            without[i] = (uint8_t)(i * 2654435761u >> 24);
+        }
+        with = without;
+        for (uint32_t y = 0; y < h; ++y) {
+            for (uint32_t x = 0; x < w; ++x) {
+                with[y * stride + x * 4 + 3] ^= 0x55;
+            }
+        }
+    }
+
+    uint32_t& px(uint32_t x, uint32_t y) {
+        return *(uint32_t*)(with.data() + y * stride + x * 4);
+    }
+
+    // a cursor of w * h at x, y, every pixel a different color
+    void paint(uint32_t x, uint32_t y, uint32_t cw, uint32_t ch) {
+        for (uint32_t j = 0; j < ch; ++j) {
+            for (uint32_t i = 0; i < cw; ++i) {
+                px(x + i, y + j) = 0xAA000000 | (((px(x + i, y + j) & 0xFFFFFF) + 1 + j * cw + i) & 0xFFFFFF);
+            }
+        }
+    }
+
+    SCursorBitmap diff(bool swapRB, int32_t hotspotX, int32_t hotspotY, uint32_t maxSize = 128) const {
+        return cursorBitmapFromDiff(with.data(), without.data(), w, h, stride, swapRB, hotspotX, hotspotY, maxSize);
+    }
+};
+
+static bool check(const char* name, bool ok) {
+    std::printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// the bitmap is the cursor painted at x, y in box, opaque and with r and b swapped if asked
+static bool matches(const SCursorBitmap& bitmap, SBox& box, uint32_t x, uint32_t y, bool swapRB) {
+    for (uint32_t j = 0; j < bitmap.h; ++j) {
+        for (uint32_t i = 0; i < bitmap.w; ++i) {
+            uint32_t expected = box.px(x + i, y + j) & 0xFFFFFF;
+            if (swapRB)
+                expected = (expected & 0x00FF00) | ((expected & 0xFF) << 16) | ((expected >> 16) & 0xFF);
+            if (bitmap.pixels[j * bitmap.w + i] != (0xFF000000 | expected))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+int main() {
+    bool ok = true;
+
+    {
+        SBox box(96, 96, 96 * 4);
+        box.paint(32, 32, 24, 24);
+        const auto BITMAP = box.diff(false, 33, 34);
+        ok &= check("cropped to the cursor", BITMAP.w == 24 && BITMAP.h == 24 && BITMAP.pixels.size() == 24 * 24);
+        ok &= check("hotspot relative to the crop", BITMAP.hotspotX == 1 && BITMAP.hotspotY == 2);
+        ok &= check("opaque, colors kept", matches(BITMAP, box, 32, 32, false));
+    }
+
+    {
+        SBox box(96, 96, 96 * 4 + 64);
+        box.paint(0, 70, 30, 26);
+        const auto BITMAP = box.diff(false, 0, 70);
+        ok &= check("padded stride, cursor on the edge", BITMAP.w == 30 && BITMAP.h == 26 && BITMAP.hotspotX == 0 && BITMAP.hotspotY == 0 && matches(BITMAP, box, 0, 70, false));
+    }
+
+    {
+        SBox box(96, 96, 96 * 4);
+        box.paint(10, 10, 16, 16);
+        const auto BITMAP = box.diff(true, 10, 10);
+        ok &= check("xbgr swapped to argb", BITMAP.w == 16 && matches(BITMAP, box, 10, 10, true));
+    }
+
+    {
+        SBox box(192, 192, 192 * 4);
+        box.paint(0, 0, 160, 150);
+        const auto BITMAP = box.diff(false, 64, 64, 128);
+        ok &= check("capped at the maximum size", BITMAP.w == 128 && BITMAP.h == 128 && BITMAP.pixels.size() == 128 * 128 && matches(BITMAP, box, 0, 0, false));
+    }
+
+    {
+        SBox       box(96, 96, 96 * 4);
+        const auto BITMAP = box.diff(false, 32, 32);
+        ok &= check("no cursor, empty bitmap", BITMAP.w == 0 && BITMAP.h == 0 && BITMAP.pixels.empty());
+    }
+
+    {
+        SBox box(192, 192, 192 * 4);
+        box.paint(64, 64, 48, 48);
+
+        const auto BEGIN = std::chrono::steady_clock::now();
+        size_t     total = 0;
+        for (int i = 0; i < ROUNDS; ++i) {
+            total += box.diff(false, 64, 64).pixels.size();
+        }
+        const double US = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - BEGIN).count() / ROUNDS;
+
+        std::printf("192x192 box, %d rounds: %.2fus/diff (%zu px)\n", ROUNDS, US, total / ROUNDS);
+    }
+
+    if (!ok)
+        std::printf("unexpected cursor bitmap\n");
+
+    return ok ? 0 : 1;
+}
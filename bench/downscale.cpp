@@ -0,0 +1,66 @@
+// throughput of CColorConverter on a 4K frame: box downscaling by 2 and 3, and rgb to NV12 / I420, each with the
+// whole frame damaged and with a typical partial damage (a window's worth, plus a cursor).
+
+#include "../src/shared/ColorConvert.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <libdrm/drm_fourcc.h>
+#include <vector>
+
+constexpr static uint32_t W = 3840, H = 2160, STRIDE = W * 4;
+constexpr static int      ROUNDS = 30;
+
+static void               measure(const char* name, uint64_t srcBytes, const std::function<void()>& fn) {
+    fn(); // warm up the workers and the destination
+
+    const auto BEGIN = std::chrono::steady_clock::now();
+    for (int i = 0; i < ROUNDS; ++i) {
+        fn();
+    }
+    const double MS = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - BEGIN).count() / ROUNDS;
+
+    std::printf("%-30s %7.3fms/frame  %8.1f MB/s of frame\n", name, MS, srcBytes / MS / 1000.0);
+}
+
+int main() {
+    CColorConverter      converter;
+    std::vector<uint8_t> src((size_t)STRIDE * H);
+    for (size_t i = 0; i < src.size(); ++i) {
+        src[i] = (uint8_t)(i * 2654435761u >> 24);
+    }
+
+    CRegion full, partial;
+    full.add({0, 0, W, H});
+    partial.add({600, 400, 1280, 720});
+    partial.add({2900, 1500, 64, 64});
+
+    std::printf("%ux%u xrgb8888, %d rounds\n", W, H, ROUNDS);
+
+    for (const uint32_t FACTOR : {2u, 3u}) {
+        const uint32_t       DW = W / FACTOR, DH = H / FACTOR;
+        std::vector<uint8_t> dst((size_t)DW * 4 * DH);
+        const SDownscaleJob  JOB = {.src = src.data(), .srcStride = STRIDE, .dst = dst.data(), .dstStride = DW * 4, .factor = FACTOR, .w = DW, .h = DH};
+
+        char                 name[64];
+        std::snprintf(name, sizeof(name), "downscale %u, full damage", FACTOR);
+        measure(name, (uint64_t)STRIDE * H, [&]() { converter.downscale(JOB, full); });
+        std::snprintf(name, sizeof(name), "downscale %u, partial damage", FACTOR);
+        measure(name, (uint64_t)STRIDE * H, [&]() { converter.downscale(JOB, partial); });
+    }
+
+    for (const bool NV12 : {true, false}) {
+        const auto           LAYOUT = yuvLayoutFor(NV12, W, H);
+        std::vector<uint8_t> dst(LAYOUT.total);
+        const SConvertJob    JOB = {.src = src.data(), .srcStride = STRIDE, .srcFourcc = DRM_FORMAT_XRGB8888, .dst = dst.data(), .layout = LAYOUT, .nv12 = NV12, .w = W, .h = H};
+
+        char                 name[64];
+        std::snprintf(name, sizeof(name), "%s, full damage", NV12 ? "nv12" : "i420");
+        measure(name, (uint64_t)STRIDE * H, [&]() { converter.convert(JOB, full); });
+        std::snprintf(name, sizeof(name), "%s, partial damage", NV12 ? "nv12" : "i420");
+        measure(name, (uint64_t)STRIDE * H, [&]() { converter.convert(JOB, partial); });
+    }
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+// copies the compositor is asked for with and without capture fan-out, against a mock compositor that counts them.
+// Sessions share a capture source when their output, cursor mode and region match, the same key
+// CScreencopyPortal::subscribeCaptureSource groups them by. Without fan-out every session captures on its own, with it
+// only the first session of a source does, and the others get the same storage.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+constexpr static uint32_t W = 3840, H = 2160, STRIDE = W * 4;
+constexpr static int      TICKS = 120;
+
+// stands in for wlr-screencopy: each copy is a full frame memcpy into the buffer the client bound
+class CMockCompositor {
+  public:
+    CMockCompositor() : m_vFramebuffer((size_t)STRIDE * H, 0x7f) {
+        ;
+    }
+
+    void copy(uint8_t* dst) {
+        std::memcpy(dst, m_vFramebuffer.data(), m_vFramebuffer.size());
+        m_iCopies++;
+    }
+
+    uint64_t copies() const {
+        return m_iCopies;
+    }
+
+  private:
+    std::vector<uint8_t> m_vFramebuffer;
+    uint64_t             m_iCopies = 0;
+};
+
+struct SMockSession {
+    std::string output;
+    uint32_t    cursorMode = 0;
+    uint32_t    x = 0, y = 0, w = 0, h = 0; // 0 for the whole output
+};
+
+struct SMockSource {
+    const SMockSession*  key = nullptr;
+    std::vector<size_t>  sessions;
+    std::vector<uint8_t> storage;
+};
+
+static bool sameSource(const SMockSession& a, const SMockSession& b) {
+    return a.output == b.output && a.cursorMode == b.cursorMode && a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+}
+
+// returns the copies per tick
+static uint64_t run(const char* name, const std::vector<SMockSession>& sessions, bool fanOut) {
+    CMockCompositor          compositor;
+    std::vector<SMockSource> sources;
+
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        auto it = fanOut ? std::find_if(sources.begin(), sources.end(), [&](const auto& src) { return sameSource(*src.key, sessions[i]); }) : sources.end();
+        if (it == sources.end()) {
+            sources.push_back({.key = &sessions[i], .sessions = {}, .storage = std::vector<uint8_t>((size_t)STRIDE * H)});
+            it = sources.end() - 1;
+        }
+
+        it->sessions.push_back(i);
+    }
+
+    const auto BEGIN = std::chrono::steady_clock::now();
+
+    uint64_t   delivered = 0;
+    for (int tick = 0; tick < TICKS; ++tick) {
+        for (auto& src : sources) {
+            compositor.copy(src.storage.data());
+            delivered += src.sessions.size();
+        }
+    }
+
+    const double MS = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - BEGIN).count();
+
+    std::printf("%-34s %zu sources  %5.2f copies/tick  %6.1f frames delivered/tick  %7.3fms/tick\n", name, sources.size(), (double)compositor.copies() / TICKS,
+                (double)delivered / TICKS, MS / TICKS);
+
+    return compositor.copies() / TICKS;
+}
+
+int main() {
+    // OBS and a browser call on the same output, plus a region of it. Without screencopy:region_crop that's a capture of its own.
+    const std::vector<SMockSession> SHARED = {{.output = "DP-1"}, {.output = "DP-1"}, {.output = "DP-1", .x = 0, .y = 0, .w = 1920, .h = 1080}};
+    // a browser that wants the cursor embedded needs a capture of its own, and so does another output
+    const std::vector<SMockSession> MIXED  = {{.output = "DP-1"}, {.output = "DP-1", .cursorMode = 2}, {.output = "DP-2"}};
+
+    std::printf("%dx%d frames, %d ticks\n", W, H, TICKS);
+
+    const bool OK = run("shared output, own captures", SHARED, false) == 3 && run("shared output, fanned out", SHARED, true) == 2 &&
+        run("different cursor modes, fanned out", MIXED, true) == 3;
+
+    if (!OK)
+        std::printf("unexpected number of copies\n");
+
+    return OK ? 0 : 1;
+}
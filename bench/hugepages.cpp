@@ -0,0 +1,87 @@
+// copy throughput into and out of shm buffers from anonymous_shm_alloc, backed by 4K pages, transparent huge pages
+// and hugetlb. Into stands in for the compositor's copy, out of for a consumer reading the frame.
+// Whether huge pages were actually used depends on the system: transparent ones need
+// /sys/kernel/mm/transparent_hugepage/shmem_enabled at advise or within_size, hugetlb ones vm.nr_hugepages reserved.
+
+#include "../src/shared/SHMAllocation.hpp"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+constexpr static size_t FRAME  = (size_t)7680 * 4320 * 4;
+constexpr static int    ROUNDS = 20;
+
+// how much of the mapping is backed by 2M pages, from /proc/self/smaps
+static uint64_t hugeKB(const uint8_t* map) {
+    std::ifstream file("/proc/self/smaps");
+    std::string   line;
+    bool          inMapping = false;
+    uint64_t      kb        = 0;
+
+    while (std::getline(file, line)) {
+        uintptr_t begin = 0, end = 0;
+        if (std::sscanf(line.c_str(), "%" SCNxPTR "-%" SCNxPTR " ", &begin, &end) == 2) {
+            inMapping = begin == (uintptr_t)map;
+            continue;
+        }
+
+        uint64_t value = 0;
+        if (inMapping && (std::sscanf(line.c_str(), "ShmemPmdMapped: %" SCNu64, &value) == 1 || std::sscanf(line.c_str(), "FilePmdMapped: %" SCNu64, &value) == 1))
+            kb += value;
+        else if (inMapping && std::sscanf(line.c_str(), "KernelPageSize: %" SCNu64, &value) == 1 && value == 2048)
+            return FRAME / 1024;
+    }
+
+    return kb;
+}
+
+static double gbps(const std::chrono::steady_clock::time_point& begin) {
+    const double S = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return (double)FRAME * ROUNDS / S / 1e9;
+}
+
+int main() {
+    std::vector<uint8_t> frame(FRAME, 0x5a), readback(FRAME);
+
+    std::printf("%zu MB frames (8K xrgb8888), %d rounds\n", FRAME >> 20, ROUNDS);
+
+    for (const auto MODE : {SHM_HUGEPAGES_NONE, SHM_HUGEPAGES_TRANSPARENT, SHM_HUGEPAGES_HUGETLB}) {
+        const char* NAME = MODE == SHM_HUGEPAGES_NONE ? "4K pages" : MODE == SHM_HUGEPAGES_TRANSPARENT ? "transparent hugepages" : "hugetlb";
+
+        const auto  BEGIN   = std::chrono::steady_clock::now();
+        const auto  ALLOC   = anonymous_shm_alloc(FRAME, MODE);
+        const auto  ALLOCMS = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - BEGIN).count();
+
+        if (!ALLOC.map) {
+            std::printf("%-22s allocation failed\n", NAME);
+            continue;
+        }
+
+        const auto INTO = std::chrono::steady_clock::now();
+        for (int i = 0; i < ROUNDS; ++i) {
+            std::memcpy(ALLOC.map, frame.data(), FRAME);
+        }
+        const double INTOGBPS = gbps(INTO);
+
+        const auto   OUTOF = std::chrono::steady_clock::now();
+        for (int i = 0; i < ROUNDS; ++i) {
+            std::memcpy(readback.data(), ALLOC.map, FRAME);
+        }
+        const double OUTOFGBPS = gbps(OUTOF);
+
+        std::printf("%-22s alloc + fault %7.2fms  into %6.2f GB/s  out of %6.2f GB/s  %5" PRIu64 " MB in 2M pages\n", NAME, ALLOCMS, INTOGBPS, OUTOFGBPS,
+                    hugeKB(ALLOC.map) >> 10);
+
+        munmap(ALLOC.map, ALLOC.capacity);
+        close(ALLOC.fd);
+    }
+
+    return 0;
+}
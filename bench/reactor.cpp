@@ -0,0 +1,208 @@
+// wakeup-to-dispatch latency of the event loop, before and after the epoll reactor.
+// fd: a writer thread makes an eventfd readable and stamps the time, the loop stamps when it gets to dispatch it.
+// timer: a timer is due at a known time, the loop stamps when its callback runs.
+// "before" is the old shape of CPortalManager::startEventLoop, a poll thread and a timer thread handing off to the
+// main thread through condition variables. "after" is one thread on epoll and a timerfd, with the real CTimerQueue.
+
+#include "../src/helpers/Timer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+constexpr static int SAMPLES = 2000;
+constexpr static int TIMERS  = 500;
+
+using Clock = std::chrono::steady_clock;
+
+static void report(const char* name, std::vector<double>& us) {
+    if (us.empty())
+        return;
+
+    std::ranges::sort(us);
+    std::printf("%-26s median %8.2fus   p99 %8.2fus   max %8.2fus\n", name, us[us.size() / 2], us[us.size() * 99 / 100], us.back());
+}
+
+// pokes fd every 200us, stamping when it did
+static std::thread startWriter(int fd, std::atomic<int64_t>& stamp, std::atomic<bool>& done) {
+    return std::thread([fd, &stamp, &done]() {
+        for (int i = 0; i < SAMPLES && !done; ++i) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+            const uint64_t ONE = 1;
+            stamp              = Clock::now().time_since_epoch().count();
+            write(fd, &ONE, sizeof(ONE));
+        }
+    });
+}
+
+static void benchFdBefore() {
+    const int               FD    = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    std::atomic<int64_t>    stamp = 0;
+    std::atomic<bool>       done  = false;
+    std::mutex              mutex;
+    std::condition_variable signal;
+    bool                    shouldProcess = false;
+    std::vector<double>     us;
+
+    std::thread             pollThr([&]() {
+        pollfd pfd = {.fd = FD, .events = POLLIN, .revents = 0};
+        while (!done) {
+            if (poll(&pfd, 1, 100) <= 0)
+                continue;
+
+            std::lock_guard lg(mutex);
+            shouldProcess = true;
+            signal.notify_all();
+        }
+    });
+
+    auto                    writerThr = startWriter(FD, stamp, done);
+
+    while ((int)us.size() < SAMPLES) {
+        std::unique_lock lk(mutex);
+        if (!signal.wait_for(lk, std::chrono::seconds(1), [&] { return shouldProcess; }))
+            break;
+
+        shouldProcess  = false;
+        uint64_t count = 0;
+        if (read(FD, &count, sizeof(count)) > 0)
+            us.push_back((Clock::now().time_since_epoch().count() - stamp) / 1000.0);
+    }
+
+    done = true;
+    writerThr.join();
+    pollThr.join();
+    close(FD);
+
+    report("fd, threads + condvar", us);
+}
+
+static void benchFdAfter() {
+    const int            FD    = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    const int            EPOLL = epoll_create1(EPOLL_CLOEXEC);
+    std::atomic<int64_t> stamp = 0;
+    std::atomic<bool>    done  = false;
+    std::vector<double>  us;
+
+    epoll_event          ev = {.events = EPOLLIN, .data = {.u64 = 0}};
+    epoll_ctl(EPOLL, EPOLL_CTL_ADD, FD, &ev);
+
+    auto writerThr = startWriter(FD, stamp, done);
+
+    while ((int)us.size() < SAMPLES) {
+        epoll_event events[4];
+        if (epoll_wait(EPOLL, events, 4, 1000) <= 0)
+            break;
+
+        uint64_t count = 0;
+        if (read(FD, &count, sizeof(count)) > 0)
+            us.push_back((Clock::now().time_since_epoch().count() - stamp) / 1000.0);
+    }
+
+    done = true;
+    writerThr.join();
+    close(EPOLL);
+    close(FD);
+
+    report("fd, epoll reactor", us);
+}
+
+static void benchTimerBefore() {
+    std::mutex              mutex;
+    std::condition_variable signal;
+    std::vector<double>     us;
+
+    for (int i = 0; i < TIMERS; ++i) {
+        const auto  DEADLINE = Clock::now() + std::chrono::microseconds(1500);
+        bool        fire     = false;
+
+        // the timer thread slept whole milliseconds towards the nearest timer, then woke the main thread
+        std::thread timerThr([&]() {
+            std::mutex              timerMutex;
+            std::condition_variable timerSignal;
+            while (Clock::now() < DEADLINE) {
+                std::unique_lock lk(timerMutex);
+                const float      NEAREST = std::chrono::duration<float, std::milli>(DEADLINE - Clock::now()).count();
+                timerSignal.wait_for(lk, std::chrono::milliseconds((int)NEAREST));
+            }
+
+            std::lock_guard lg(mutex);
+            fire = true;
+            signal.notify_all();
+        });
+
+        {
+            std::unique_lock lk(mutex);
+            signal.wait(lk, [&] { return fire; });
+            us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - DEADLINE).count());
+        }
+
+        timerThr.join();
+    }
+
+    report("timer, threads + condvar", us);
+}
+
+static void benchTimerAfter() {
+    const int           TIMERFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    const int           EPOLL   = epoll_create1(EPOLL_CLOEXEC);
+    CTimerQueue         queue;
+    std::vector<double> us;
+
+    epoll_event         ev = {.events = EPOLLIN, .data = {.u64 = 0}};
+    epoll_ctl(EPOLL, EPOLL_CTL_ADD, TIMERFD, &ev);
+
+    for (int i = 0; i < TIMERS; ++i) {
+        const auto DEADLINE = Clock::now() + std::chrono::microseconds(1500);
+        bool       fired    = false;
+
+        queue.add(CTimer{DEADLINE, [&]() {
+                             us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - DEADLINE).count());
+                             fired = true;
+                         }});
+
+        while (!fired) {
+            // armed like CPortalManager::armTimerFD
+            itimerspec     spec   = {};
+            const uint64_t NS     = std::chrono::duration_cast<std::chrono::nanoseconds>(queue.nextDeadline()->time_since_epoch()).count();
+            spec.it_value.tv_sec  = NS / 1000000000ULL;
+            spec.it_value.tv_nsec = NS % 1000000000ULL;
+            timerfd_settime(TIMERFD, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+            epoll_event events[4];
+            if (epoll_wait(EPOLL, events, 4, 1000) > 0) {
+                uint64_t expirations = 0;
+                read(TIMERFD, &expirations, sizeof(expirations));
+            }
+
+            queue.dispatch();
+        }
+    }
+
+    close(EPOLL);
+    close(TIMERFD);
+
+    report("timer, epoll + timerfd", us);
+}
+
+int main() {
+    std::printf("%d fd wakeups, %d timers 1.5ms out\n", SAMPLES, TIMERS);
+
+    benchFdBefore();
+    benchFdAfter();
+    benchTimerBefore();
+    benchTimerAfter();
+
+    return 0;
+}
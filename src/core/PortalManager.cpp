@@ -3,13 +3,11 @@
 #include "../helpers/MiscFunctions.hpp"
 
 #include <pipewire/pipewire.h>
-#include <poll.h>
-#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 #include <unistd.h>
 
-#include <thread>
-
 SOutput::SOutput(SP<CCWlOutput> output_) : output(output_) {
     output->setName([this](CCWlOutput* o, const char* name_) {
         if (!name_)
@@ -20,7 +18,12 @@ SOutput::SOutput(SP<CCWlOutput> output_) : output(output_) {
         Debug::log(LOG, "Found output name {}", name);
     });
     output->setMode([this](CCWlOutput* r, uint32_t flags, int32_t width, int32_t height, int32_t refresh) { //
-        refreshRate = refresh;
+        // outputs can list modes they aren't in. refresh is in mHz.
+        if (!(flags & WL_OUTPUT_MODE_CURRENT))
+            return;
+
+        refreshRate            = refresh / 1000.F;
+        presentation.refreshNs = refresh > 0 ? 1000000000000ULL / refresh : 0;
     });
     output->setGeometry([this](CCWlOutput* r, int32_t x, int32_t y, int32_t physical_width, int32_t physical_height, int32_t subpixel, const char* make, const char* model,
                                int32_t transform_) { //
@@ -45,6 +48,20 @@ CPortalManager::CPortalManager() {
     m_sConfig.config->addConfigValue("screencopy:allow_token_by_default", Hyprlang::INT{0L});
     m_sConfig.config->addConfigValue("screencopy:custom_picker_binary", Hyprlang::STRING{""});
     m_sConfig.config->addConfigValue("screencopy:force_shm", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:frames_in_flight", Hyprlang::INT{1L});
+    m_sConfig.config->addConfigValue("screencopy:phase_offset_us", Hyprlang::INT{1000L});
+    m_sConfig.config->addConfigValue("screencopy:idle_min_fps", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:capture_clock", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:mailbox", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:region_crop", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:shm_convert", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:shm_convert_matrix", Hyprlang::INT{709L});
+    m_sConfig.config->addConfigValue("screencopy:shm_convert_full_range", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:downscale_height", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:shm_hugepages", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:buffer_budget_mb", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:adaptive_buffers", Hyprlang::INT{0L});
+    m_sConfig.config->addConfigValue("screencopy:window_headroom", Hyprlang::INT{0L});
 
     m_sConfig.config->commence();
     m_sConfig.config->parse();
@@ -88,116 +105,77 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
             makeShared<CCZwpLinuxDmabufV1>((wl_proxy*)wl_registry_bind((wl_registry*)m_sWaylandConnection.registry->resource(), name, &zwp_linux_dmabuf_v1_interface, version));
         m_sWaylandConnection.linuxDmabufFeedback = makeShared<CCZwpLinuxDmabufFeedbackV1>(m_sWaylandConnection.linuxDmabuf->sendGetDefaultFeedback());
 
+        // the compositor resends the whole feedback whenever it changes, e.g. when it moves to another gpu
         m_sWaylandConnection.linuxDmabufFeedback->setMainDevice([this](CCZwpLinuxDmabufFeedbackV1* r, wl_array* device_arr) {
             Debug::log(LOG, "[core] dmabufFeedbackMainDevice");
 
-            if (m_sWaylandConnection.dma.done)
-                return;
-
-            RASSERT(!m_sWaylandConnection.gbm, "double dmabuf feedback");
-
             dev_t device;
             assert(device_arr->size == sizeof(device));
             memcpy(&device, device_arr->data, sizeof(device));
 
-            drmDevice* drmDev;
-            if (drmGetDeviceFromDevId(device, /* flags */ 0, &drmDev) != 0) {
-                Debug::log(WARN, "[dmabuf] unable to open main device?");
-                exit(1);
-            }
+            const bool SAMEDEVICE = m_sWaylandConnection.gbmDevice && device == m_pDMABUFFeedback->getMainDevice();
 
-            m_sWaylandConnection.gbmDevice = createGBMDevice(drmDev);
-        });
-        m_sWaylandConnection.linuxDmabufFeedback->setFormatTable([this](CCZwpLinuxDmabufFeedbackV1* r, int fd, uint32_t size) {
-            Debug::log(TRACE, "[core] dmabufFeedbackFormatTable");
+            m_pDMABUFFeedback->mainDevice(device);
 
-            if (m_sWaylandConnection.dma.done)
+            if (SAMEDEVICE)
                 return;
 
-            m_vDMABUFMods.clear();
-
-            m_sWaylandConnection.dma.formatTable = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            const auto PDEVICE = gbmDeviceFor(device);
 
-            if (m_sWaylandConnection.dma.formatTable == MAP_FAILED) {
-                Debug::log(ERR, "[core] format table failed to mmap");
-                m_sWaylandConnection.dma.formatTable     = nullptr;
-                m_sWaylandConnection.dma.formatTableSize = 0;
+            if (!PDEVICE) {
+                Debug::log(WARN, "[dmabuf] unable to open main device?");
+                if (!m_sWaylandConnection.gbmDevice)
+                    exit(1);
                 return;
             }
 
-            m_sWaylandConnection.dma.formatTableSize = size;
+            if (m_sWaylandConnection.gbmDevice)
+                Debug::log(LOG, "[dmabuf] main device changed, allocating on the new one from now on");
+
+            m_sWaylandConnection.gbmDevice = PDEVICE;
+        });
+        m_sWaylandConnection.linuxDmabufFeedback->setFormatTable([this](CCZwpLinuxDmabufFeedbackV1* r, int fd, uint32_t size) {
+            Debug::log(TRACE, "[core] dmabufFeedbackFormatTable");
+
+            m_pDMABUFFeedback->formatTable(fd, size);
         });
         m_sWaylandConnection.linuxDmabufFeedback->setDone([this](CCZwpLinuxDmabufFeedbackV1* r) {
             Debug::log(TRACE, "[core] dmabufFeedbackDone");
 
-            if (m_sWaylandConnection.dma.done)
-                return;
+            const auto CHANGED = m_pDMABUFFeedback->done([this](dev_t device) { return gbmDeviceFor(device); });
 
-            if (m_sWaylandConnection.dma.formatTable)
-                munmap(m_sWaylandConnection.dma.formatTable, m_sWaylandConnection.dma.formatTableSize);
+            // streams negotiated against the old feedback renegotiate, the first one has nothing to update
+            if (m_sWaylandConnection.dma.done && !CHANGED.empty() && m_sPortals.screencopy && m_sPortals.screencopy->m_pPipewire)
+                m_sPortals.screencopy->m_pPipewire->onDMABUFFeedbackChanged(CHANGED);
 
-            m_sWaylandConnection.dma.formatTable     = nullptr;
-            m_sWaylandConnection.dma.formatTableSize = 0;
-            m_sWaylandConnection.dma.done            = true;
+            m_sWaylandConnection.dma.done = true;
         });
         m_sWaylandConnection.linuxDmabufFeedback->setTrancheTargetDevice([this](CCZwpLinuxDmabufFeedbackV1* r, wl_array* device_arr) {
             Debug::log(TRACE, "[core] dmabufFeedbackTrancheTargetDevice");
 
-            if (m_sWaylandConnection.dma.done)
-                return;
-
             dev_t device;
             assert(device_arr->size == sizeof(device));
             memcpy(&device, device_arr->data, sizeof(device));
 
-            drmDevice* drmDev;
-            if (drmGetDeviceFromDevId(device, /* flags */ 0, &drmDev) != 0)
-                return;
+            // any device we can open is usable, streams pick the one whose tranche suits them best
+            const bool usable = gbmDeviceFor(device);
 
-            if (m_sWaylandConnection.gbmDevice) {
-                drmDevice* drmDevRenderer = NULL;
-                drmGetDevice2(gbm_device_get_fd(m_sWaylandConnection.gbmDevice), /* flags */ 0, &drmDevRenderer);
-                m_sWaylandConnection.dma.deviceUsed = drmDevicesEqual(drmDevRenderer, drmDev);
-            } else {
-                m_sWaylandConnection.gbmDevice      = createGBMDevice(drmDev);
-                m_sWaylandConnection.dma.deviceUsed = m_sWaylandConnection.gbm;
-            }
+            m_pDMABUFFeedback->trancheTargetDevice(device, usable);
+        });
+        m_sWaylandConnection.linuxDmabufFeedback->setTrancheFlags([this](CCZwpLinuxDmabufFeedbackV1* r, zwpLinuxDmabufFeedbackV1TrancheFlags flags) {
+            Debug::log(TRACE, "[core] dmabufFeedbackTrancheFlags");
+
+            m_pDMABUFFeedback->trancheFlags(flags);
         });
         m_sWaylandConnection.linuxDmabufFeedback->setTrancheFormats([this](CCZwpLinuxDmabufFeedbackV1* r, wl_array* indices) {
             Debug::log(TRACE, "[core] dmabufFeedbackTrancheFormats");
 
-            if (m_sWaylandConnection.dma.done)
-                return;
-
-            if (!m_sWaylandConnection.dma.deviceUsed || !m_sWaylandConnection.dma.formatTable)
-                return;
-
-            struct fm_entry {
-                uint32_t format;
-                uint32_t padding;
-                uint64_t modifier;
-            };
-            // An entry in the table has to be 16 bytes long
-            assert(sizeof(struct fm_entry) == 16);
-
-            uint32_t  n_modifiers = m_sWaylandConnection.dma.formatTableSize / sizeof(struct fm_entry);
-            fm_entry* fm_entry    = (struct fm_entry*)m_sWaylandConnection.dma.formatTable;
-            uint16_t* idx;
-
-            for (idx = (uint16_t*)indices->data; (const char*)idx < (const char*)indices->data + indices->size; idx++) {
-                if (*idx >= n_modifiers)
-                    continue;
-
-                m_vDMABUFMods.push_back({(fm_entry + *idx)->format, (fm_entry + *idx)->modifier});
-            }
+            m_pDMABUFFeedback->trancheFormats(indices);
         });
         m_sWaylandConnection.linuxDmabufFeedback->setTrancheDone([this](CCZwpLinuxDmabufFeedbackV1* r) {
             Debug::log(TRACE, "[core] dmabufFeedbackTrancheDone");
 
-            if (m_sWaylandConnection.dma.done)
-                return;
-
-            m_sWaylandConnection.dma.deviceUsed = false;
+            m_pDMABUFFeedback->trancheDone();
         });
 
     }
@@ -205,6 +183,15 @@ void CPortalManager::onGlobal(uint32_t name, const char* interface, uint32_t ver
     else if (INTERFACE == wl_shm_interface.name)
         m_sWaylandConnection.shm = makeShared<CCWlShm>((wl_proxy*)wl_registry_bind((wl_registry*)m_sWaylandConnection.registry->resource(), name, &wl_shm_interface, version));
 
+    else if (INTERFACE == wp_presentation_interface.name) {
+        m_sWaylandConnection.presentation =
+            makeShared<CCWpPresentation>((wl_proxy*)wl_registry_bind((wl_registry*)m_sWaylandConnection.registry->resource(), name, &wp_presentation_interface, 1));
+        m_sWaylandConnection.presentation->setClockId([this](CCWpPresentation* r, uint32_t clockID) {
+            Debug::log(LOG, "[core] presentation clock id {}", clockID);
+            m_sWaylandConnection.presentationClock = (clockid_t)clockID;
+        });
+    }
+
     else if (INTERFACE == zwlr_foreign_toplevel_manager_v1_interface.name) {
         m_sHelpers.toplevel = std::make_unique<CToplevelManager>(name, version);
 
@@ -293,112 +280,80 @@ void CPortalManager::init() {
     startEventLoop();
 }
 
-void CPortalManager::startEventLoop() {
+// tags the epoll data of fds from addFD, the sources below are their index
+constexpr static uint64_t EXTRA_FD = 1ULL << 32;
 
-    pollfd pollfds[] = {
-        {
-            .fd     = m_pConnection->getEventLoopPollData().fd,
-            .events = POLLIN,
-        },
-        {
-            .fd     = wl_display_get_fd(m_sWaylandConnection.display),
-            .events = POLLIN,
-        },
-        {
-            .fd     = pw_loop_get_fd(m_sPipewire.loop),
-            .events = POLLIN,
-        },
+void CPortalManager::startEventLoop() {
+    enum eEventSource : uint32_t {
+        SOURCE_DBUS = 0,
+        SOURCE_WL,
+        SOURCE_PW,
+        SOURCE_TIMER,
+        SOURCE_COUNT,
     };
 
-    std::thread pollThr([this, &pollfds]() {
-        while (1) {
-            int ret = poll(pollfds, 3, 5000 /* 5 seconds, reasonable. It's because we might need to terminate */);
-            if (ret < 0) {
-                Debug::log(CRIT, "[core] Polling fds failed with {}", strerror(errno));
-                g_pPortalManager->terminate();
-            }
+    const int FDS[SOURCE_COUNT] = {
+        m_pConnection->getEventLoopPollData().fd,
+        wl_display_get_fd(m_sWaylandConnection.display),
+        pw_loop_get_fd(m_sPipewire.loop),
+        m_sEventLoopInternals.timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK),
+    };
 
-            for (size_t i = 0; i < 3; ++i) {
-                if (pollfds[i].revents & POLLHUP) {
-                    Debug::log(CRIT, "[core] Disconnected from pollfd id {}", i);
-                    g_pPortalManager->terminate();
-                }
-            }
+    m_sEventLoopInternals.epollFD = epoll_create1(EPOLL_CLOEXEC);
 
-            if (m_bTerminate)
-                break;
+    if (m_sEventLoopInternals.epollFD < 0 || m_sEventLoopInternals.timerFD < 0) {
+        Debug::log(CRIT, "[core] Failed to create the event loop: {}", strerror(errno));
+        return;
+    }
 
-            if (ret != 0) {
-                Debug::log(TRACE, "[core] got poll event");
-                std::lock_guard<std::mutex> lg(m_sEventLoopInternals.loopRequestMutex);
-                m_sEventLoopInternals.shouldProcess = true;
-                m_sEventLoopInternals.loopSignal.notify_all();
-            }
+    for (uint32_t i = 0; i < SOURCE_COUNT; ++i) {
+        epoll_event ev = {.events = EPOLLIN, .data = {.u64 = i}};
+        if (epoll_ctl(m_sEventLoopInternals.epollFD, EPOLL_CTL_ADD, FDS[i], &ev) < 0) {
+            Debug::log(CRIT, "[core] Failed to add fd {} to epoll: {}", FDS[i], strerror(errno));
+            return;
         }
-    });
+    }
 
-    m_sTimersThread.thread = std::make_unique<std::thread>([this] {
-        while (1) {
-            std::unique_lock lk(m_sTimersThread.loopMutex);
-
-            // find nearest timer ms
-            m_mEventLock.lock();
-            float nearest = 60000; /* reasonable timeout */
-            for (auto& t : m_sTimersThread.timers) {
-                float until = t->duration() - t->passedMs();
-                if (until < nearest)
-                    nearest = until;
-            }
-            m_mEventLock.unlock();
-
-            m_sTimersThread.loopSignal.wait_for(lk, std::chrono::milliseconds((int)nearest), [this] { return m_sTimersThread.shouldProcess; });
-            m_sTimersThread.shouldProcess = false;
-
-            if (m_bTerminate)
-                break;
-
-            // awakened. Check if any timers passed
-            m_mEventLock.lock();
-            bool notify = false;
-            for (auto& t : m_sTimersThread.timers) {
-                if (t->passed()) {
-                    Debug::log(TRACE, "[core] got timer event");
-                    notify = true;
-                    break;
-                }
-            }
-            m_mEventLock.unlock();
+    while (!m_bTerminate) {
+        armTimerFD();
 
-            if (notify) {
-                std::lock_guard<std::mutex> lg(m_sEventLoopInternals.loopRequestMutex);
-                m_sEventLoopInternals.shouldProcess = true;
-                m_sEventLoopInternals.loopSignal.notify_all();
-            }
+        epoll_event events[16];
+        int         nevents = epoll_wait(m_sEventLoopInternals.epollFD, events, 16, 5000 /* 5 seconds, reasonable. It's because we might need to terminate */);
+        if (nevents < 0) {
+            if (errno == EINTR)
+                continue;
+
+            Debug::log(CRIT, "[core] Polling fds failed with {}", strerror(errno));
+            terminate();
+            break;
         }
-    });
 
-    while (1) { // dbus events
-        // wait for being awakened
-        std::unique_lock lk(m_sEventLoopInternals.loopMutex);
-        if (m_sEventLoopInternals.shouldProcess == false) // avoid a lock if a thread managed to request something already since we .unlock()ed
-            m_sEventLoopInternals.loopSignal.wait_for(lk, std::chrono::seconds(5), [this] { return m_sEventLoopInternals.shouldProcess == true; }); // wait for events
+        bool readable[SOURCE_COUNT] = {false};
+        for (int i = 0; i < nevents; ++i) {
+            // from addFD, hanging up is how those say they're done
+            if (events[i].data.u64 & EXTRA_FD)
+                continue;
 
-        std::lock_guard<std::mutex> lg(m_sEventLoopInternals.loopRequestMutex);
+            if (events[i].events & EPOLLHUP) {
+                Debug::log(CRIT, "[core] Disconnected from pollfd id {}", (uint32_t)events[i].data.u64);
+                terminate();
+            }
+
+            readable[events[i].data.u64] = events[i].events & EPOLLIN;
+        }
 
         if (m_bTerminate)
             break;
 
-        m_sEventLoopInternals.shouldProcess = false;
+        Debug::log(TRACE, "[core] got poll event");
 
-        m_mEventLock.lock();
-
-        if (pollfds[0].revents & POLLIN /* dbus */) {
+        if (readable[SOURCE_DBUS]) {
             while (m_pConnection->processPendingEvent()) {
                 ;
             }
         }
 
-        if (pollfds[1].revents & POLLIN /* wl */) {
+        if (readable[SOURCE_WL]) {
             wl_display_flush(m_sWaylandConnection.display);
             if (wl_display_prepare_read(m_sWaylandConnection.display) == 0) {
                 wl_display_read_events(m_sWaylandConnection.display);
@@ -408,19 +363,32 @@ void CPortalManager::startEventLoop() {
             }
         }
 
-        if (pollfds[2].revents & POLLIN /* pw */) {
+        if (readable[SOURCE_PW]) {
             while (pw_loop_iterate(m_sPipewire.loop, 0) != 0) {
                 ;
             }
         }
 
-        std::vector<CTimer*> toRemove;
-        for (auto& t : m_sTimersThread.timers) {
-            if (t->passed()) {
-                t->m_fnCallback();
-                toRemove.emplace_back(t.get());
-                Debug::log(TRACE, "[core] calling timer {}", (void*)t.get());
-            }
+        if (readable[SOURCE_TIMER]) {
+            uint64_t expirations = 0;
+            read(m_sEventLoopInternals.timerFD, &expirations, sizeof(expirations));
+        }
+
+        // timers are checked every iteration, the timerfd only guarantees we wake up for them. They go before the fds from
+        // addFD: a capture timer is aimed at a vblank, while those are replies nobody is waiting on to the microsecond.
+        m_sTimers.queue.dispatch();
+
+        for (int i = 0; i < nevents; ++i) {
+            if (!(events[i].data.u64 & EXTRA_FD))
+                continue;
+
+            // an earlier callback or a timer may have removed it. The copy is because a callback may remove itself.
+            const auto IT = m_sEventLoopInternals.fds.find((int)(uint32_t)events[i].data.u64);
+            if (IT == m_sEventLoopInternals.fds.end())
+                continue;
+
+            const auto CALLBACK = IT->second;
+            CALLBACK();
         }
 
         int ret = 0;
@@ -428,12 +396,6 @@ void CPortalManager::startEventLoop() {
             ret = wl_display_dispatch_pending(m_sWaylandConnection.display);
             wl_display_flush(m_sWaylandConnection.display);
         } while (ret > 0);
-
-        if (!toRemove.empty())
-            std::erase_if(m_sTimersThread.timers,
-                          [&](const auto& t) { return std::find_if(toRemove.begin(), toRemove.end(), [&](const auto& other) { return other == t.get(); }) != toRemove.end(); });
-
-        m_mEventLock.unlock();
     }
 
     Debug::log(ERR, "[core] Terminated");
@@ -447,8 +409,22 @@ void CPortalManager::startEventLoop() {
     pw_loop_destroy(m_sPipewire.loop);
     wl_display_disconnect(m_sWaylandConnection.display);
 
-    m_sTimersThread.thread.release();
-    pollThr.join(); // wait for poll to exit
+    close(m_sEventLoopInternals.timerFD);
+    close(m_sEventLoopInternals.epollFD);
+}
+
+void CPortalManager::armTimerFD() {
+    itimerspec spec = {};
+
+    // deadlines are absolute on CLOCK_MONOTONIC, same as steady_clock, so there's no rounding to ms anywhere.
+    // A zeroed it_value disarms the timer, which an already expired deadline must not do.
+    if (const auto NEXT = m_sTimers.queue.nextDeadline(); NEXT.has_value()) {
+        const uint64_t NS     = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(NEXT->time_since_epoch()).count());
+        spec.it_value.tv_sec  = NS / 1000000000ULL;
+        spec.it_value.tv_nsec = NS % 1000000000ULL;
+    }
+
+    timerfd_settime(m_sEventLoopInternals.timerFD, TFD_TIMER_ABSTIME, &spec, nullptr);
 }
 
 sdbus::IConnection* CPortalManager::getConnection() {
@@ -505,11 +481,70 @@ gbm_device* CPortalManager::createGBMDevice(drmDevice* dev) {
     return gbm_create_device(fd);
 }
 
-void CPortalManager::addTimer(const CTimer& timer) {
-    Debug::log(TRACE, "[core] adding timer for {}ms", timer.duration());
-    m_sTimersThread.timers.emplace_back(std::make_unique<CTimer>(timer));
-    m_sTimersThread.shouldProcess = true;
-    m_sTimersThread.loopSignal.notify_all();
+gbm_device* CPortalManager::gbmDeviceFor(dev_t device) {
+    const auto IT = m_sWaylandConnection.gbmDevices.find(device);
+
+    if (IT != m_sWaylandConnection.gbmDevices.end())
+        return IT->second;
+
+    drmDevice* drmDev = nullptr;
+    if (drmGetDeviceFromDevId(device, /* flags */ 0, &drmDev) != 0) {
+        Debug::log(WARN, "[core] gbmDeviceFor: no drm device for {:x}", (uint64_t)device);
+        m_sWaylandConnection.gbmDevices[device] = nullptr;
+        return nullptr;
+    }
+
+    // the primary and render node of one gpu have different dev_ts, don't open it twice
+    gbm_device* gbmDevice = nullptr;
+    for (const auto& [dev, gbm] : m_sWaylandConnection.gbmDevices) {
+        if (!gbm)
+            continue;
+
+        drmDevice* drmDevOther = nullptr;
+        if (drmGetDevice2(gbm_device_get_fd(gbm), /* flags */ 0, &drmDevOther) != 0)
+            continue;
+
+        const bool EQUAL = drmDevicesEqual(drmDev, drmDevOther);
+        drmFreeDevice(&drmDevOther);
+
+        if (EQUAL) {
+            gbmDevice = gbm;
+            break;
+        }
+    }
+
+    if (!gbmDevice)
+        gbmDevice = createGBMDevice(drmDev);
+
+    drmFreeDevice(&drmDev);
+
+    // failures are remembered too, the feedback names the same devices over and over
+    m_sWaylandConnection.gbmDevices[device] = gbmDevice;
+
+    return gbmDevice;
+}
+
+bool CPortalManager::addFD(int fd, std::function<void()> onReadable) {
+    epoll_event ev = {.events = EPOLLIN, .data = {.u64 = EXTRA_FD | (uint32_t)fd}};
+    if (epoll_ctl(m_sEventLoopInternals.epollFD, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        Debug::log(ERR, "[core] Failed to add fd {} to epoll: {}", fd, strerror(errno));
+        return false;
+    }
+
+    m_sEventLoopInternals.fds[fd] = std::move(onReadable);
+    return true;
+}
+
+void CPortalManager::removeFD(int fd) {
+    if (!m_sEventLoopInternals.fds.erase(fd))
+        return;
+
+    epoll_ctl(m_sEventLoopInternals.epollFD, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+SP<CTimer> CPortalManager::addTimer(const CTimer& timer) {
+    Debug::log(TRACE, "[core] adding timer for {:.3f}ms", timer.duration());
+    return m_sTimers.queue.add(timer);
 }
 
 void CPortalManager::terminate() {
@@ -519,12 +554,4 @@ void CPortalManager::terminate() {
     // and I doubt anyone will make 4.2M PIDs within 5s.
     if (fork() == 0)
         execl("/bin/sh", "/bin/sh", "-c", std::format("sleep 5 && kill -9 {}", m_iPID).c_str(), nullptr);
-
-    {
-        m_sEventLoopInternals.shouldProcess = true;
-        m_sEventLoopInternals.loopSignal.notify_all();
-    }
-
-    m_sTimersThread.shouldProcess = true;
-    m_sTimersThread.loopSignal.notify_all();
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <unordered_map>
 #include <sdbus-c++/sdbus-c++.h>
 #include <hyprlang.hpp>
 
@@ -11,19 +12,21 @@
 #include "../helpers/Timer.hpp"
 #include "../shared/ToplevelManager.hpp"
 #include "../shared/ToplevelMappingManager.hpp"
+#include "../shared/DMABUFFeedback.hpp"
 #include <gbm.h>
 #include <xf86drm.h>
 
 #include "hyprland-toplevel-export-v1.hpp"
 #include "hyprland-global-shortcuts-v1.hpp"
 #include "linux-dmabuf-v1.hpp"
+#include "presentation-time.hpp"
 #include "wlr-foreign-toplevel-management-unstable-v1.hpp"
 #include "wlr-screencopy-unstable-v1.hpp"
 
 #include "../includes.hpp"
 #include "../dbusDefines.hpp"
 
-#include <mutex>
+#include <ctime>
 
 struct pw_loop;
 
@@ -32,13 +35,14 @@ struct SOutput {
     std::string         name;
     SP<CCWlOutput>      output      = nullptr;
     uint32_t            id          = 0;
-    float               refreshRate = 60.0;
+    float               refreshRate = 60.0; // Hz
     wl_output_transform transform   = WL_OUTPUT_TRANSFORM_NORMAL;
-};
 
-struct SDMABUFModifier {
-    uint32_t fourcc = 0;
-    uint64_t mod    = 0;
+    // presentation timing, in the wp_presentation clock domain. Anchored on the timestamps of captured frames.
+    struct {
+        uint64_t lastPresentedNs = 0;
+        uint64_t refreshNs       = 0;
+    } presentation;
 };
 
 class CPortalManager {
@@ -69,19 +73,19 @@ class CPortalManager {
     } m_sHelpers;
 
     struct {
-        wl_display*                           display = nullptr;
-        SP<CCWlRegistry>                      registry;
-        SP<CCHyprlandToplevelExportManagerV1> hyprlandToplevelMgr;
-        SP<CCZwpLinuxDmabufV1>                linuxDmabuf;
-        SP<CCZwpLinuxDmabufFeedbackV1>        linuxDmabufFeedback;
-        SP<CCWlShm>                           shm;
-        gbm_bo*                               gbm       = nullptr;
-        gbm_device*                           gbmDevice = nullptr;
+        wl_display*                            display = nullptr;
+        SP<CCWlRegistry>                       registry;
+        SP<CCHyprlandToplevelExportManagerV1>  hyprlandToplevelMgr;
+        SP<CCZwpLinuxDmabufV1>                 linuxDmabuf;
+        SP<CCZwpLinuxDmabufFeedbackV1>         linuxDmabufFeedback;
+        SP<CCWlShm>                            shm;
+        SP<CCWpPresentation>                   presentation;
+        clockid_t                              presentationClock = CLOCK_MONOTONIC;
+        gbm_bo*                                gbm               = nullptr;
+        gbm_device*                            gbmDevice         = nullptr; // of the main device
+        std::unordered_map<dev_t, gbm_device*> gbmDevices; // every device we opened. Never closed, buffers may outlive the feedback naming them
         struct {
-            void*  formatTable     = nullptr;
-            size_t formatTableSize = 0;
-            bool   deviceUsed      = false;
-            bool   done            = false;
+            bool done = false; // got the first feedback, later ones are updates
         } dma;
     } m_sWaylandConnection;
 
@@ -89,40 +93,42 @@ class CPortalManager {
         std::unique_ptr<Hyprlang::CConfig> config;
     } m_sConfig;
 
-    std::vector<SDMABUFModifier> m_vDMABUFMods;
+    std::unique_ptr<CDMABUFFeedback> m_pDMABUFFeedback = std::make_unique<CDMABUFFeedback>();
 
-    void                         addTimer(const CTimer& timer);
+    // the returned handle can be used to cancel the timer before it fires
+    SP<CTimer>                       addTimer(const CTimer& timer);
 
-    gbm_device*                  createGBMDevice(drmDevice* dev);
+    // watches an fd on the event loop, the callback runs when it's readable or hung up. Remove it before closing it.
+    bool                             addFD(int fd, std::function<void()> onReadable);
+    void                             removeFD(int fd);
+
+    gbm_device*                      createGBMDevice(drmDevice* dev);
+    // opens the device on first use, nullptr if it can't be
+    gbm_device*                      gbmDeviceFor(dev_t device);
 
     // terminate after the event loop has been created. Before we can exit()
     void terminate();
 
   private:
     void  startEventLoop();
+    void  armTimerFD();
 
     bool  m_bTerminate = false;
     pid_t m_iPID       = 0;
 
+    // everything runs on one thread: dbus, wayland, pipewire and the timerfd share a single epoll set.
     struct {
-        std::condition_variable loopSignal;
-        std::mutex              loopMutex;
-        std::atomic<bool>       shouldProcess = false;
-        std::mutex              loopRequestMutex;
+        int                                            epollFD = -1;
+        int                                            timerFD = -1;
+        std::unordered_map<int, std::function<void()>> fds; // from addFD
     } m_sEventLoopInternals;
 
     struct {
-        std::condition_variable              loopSignal;
-        std::mutex                           loopMutex;
-        bool                                 shouldProcess = false;
-        std::vector<std::unique_ptr<CTimer>> timers;
-        std::unique_ptr<std::thread>         thread;
-    } m_sTimersThread;
+        CTimerQueue queue;
+    } m_sTimers;
 
     std::unique_ptr<sdbus::IConnection>   m_pConnection;
     std::vector<std::unique_ptr<SOutput>> m_vOutputs;
-
-    std::mutex                            m_mEventLock;
 };
 
 inline std::unique_ptr<CPortalManager> g_pPortalManager;
@@ -3,10 +3,13 @@
 #include <unistd.h>
 #include <filesystem>
 #include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <string>
 #include <algorithm>
 #include <format>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <hyprutils/os/Process.hpp>
 using namespace Hyprutils::OS;
@@ -54,3 +57,45 @@ bool inShellPath(const std::string& exec) {
 
     return std::ranges::any_of(paths, [&exec](std::string& path) { return access((path + "/" + exec).c_str(), X_OK) == 0; });
 }
+
+const std::string& hyprlandSocketPath() {
+    static const std::string PATH = []() -> std::string {
+        const char* SIGNATURE = getenv("HYPRLAND_INSTANCE_SIGNATURE");
+        const char* RUNTIME   = getenv("XDG_RUNTIME_DIR");
+
+        if (!SIGNATURE)
+            return "";
+
+        // older Hyprlands keep it in /tmp
+        const std::string RUNTIMEDIR = RUNTIME ? RUNTIME : std::format("/run/user/{}", getuid());
+        const std::string CURRENT    = std::format("{}/hypr/{}/.socket.sock", RUNTIMEDIR, SIGNATURE);
+        if (std::filesystem::exists(CURRENT))
+            return CURRENT;
+
+        return std::format("/tmp/hypr/{}/.socket.sock", SIGNATURE);
+    }();
+
+    return PATH;
+}
+
+int hyprlandRequestAsync(const std::string& request) {
+    const auto& PATH = hyprlandSocketPath();
+
+    sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (PATH.empty() || PATH.size() >= sizeof(addr.sun_path))
+        return -1;
+    strncpy(addr.sun_path, PATH.c_str(), sizeof(addr.sun_path) - 1);
+
+    const int FD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (FD < 0)
+        return -1;
+
+    // a local connect either goes through right away or fails with EAGAIN when Hyprland is behind on accepting, and the
+    // request fits the socket buffer. Neither waits.
+    if (connect(FD, (sockaddr*)&addr, SUN_LEN(&addr)) < 0 || write(FD, request.c_str(), request.size()) != (ssize_t)request.size()) {
+        close(FD);
+        return -1;
+    }
+
+    return FD;
+}
@@ -5,4 +5,9 @@
 std::string execAndGet(const char* cmd);
 void        addHyprlandNotification(const std::string& icon, float timeMs, const std::string& color, const std::string& message);
 bool        inShellPath(const std::string& exec);
-void        sendEmptyDbusMethodReply(sdbus::MethodCall& call, u_int32_t responseCode);
\ No newline at end of file
+void        sendEmptyDbusMethodReply(sdbus::MethodCall& call, u_int32_t responseCode);
+// Hyprland's socket, looked up once. Empty outside of Hyprland.
+const std::string& hyprlandSocketPath();
+// sends a request over Hyprland's socket, like hyprctl would, without waiting for the reply. It's read off the returned
+// non-blocking fd until EOF, and the caller closes it. -1 if Hyprland can't be reached.
+int hyprlandRequestAsync(const std::string& request);
\ No newline at end of file
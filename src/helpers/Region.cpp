@@ -0,0 +1,138 @@
+#include "Region.hpp"
+
+#include <algorithm>
+#include <limits>
+
+bool SRect::empty() const {
+    return w == 0 || h == 0;
+}
+
+uint64_t SRect::area() const {
+    return (uint64_t)w * h;
+}
+
+SRect SRect::boundingBox(const SRect& other) const {
+    if (empty())
+        return other;
+    if (other.empty())
+        return *this;
+
+    const uint32_t X1 = std::min(x, other.x), Y1 = std::min(y, other.y);
+    const uint32_t X2 = std::max(x + w, other.x + other.w), Y2 = std::max(y + h, other.y + other.h);
+    return {X1, Y1, X2 - X1, Y2 - Y1};
+}
+
+SRect SRect::intersection(const SRect& other) const {
+    const uint32_t X1 = std::max(x, other.x), Y1 = std::max(y, other.y);
+    const uint32_t X2 = std::min(x + w, other.x + other.w), Y2 = std::min(y + h, other.y + other.h);
+
+    if (X2 <= X1 || Y2 <= Y1)
+        return {};
+
+    return {X1, Y1, X2 - X1, Y2 - Y1};
+}
+
+bool SRect::contains(const SRect& other) const {
+    return other.x >= x && other.y >= y && other.x + other.w <= x + w && other.y + other.h <= y + h;
+}
+
+// how much area merging a and b into their bounding box damages on top of what they already cover
+static uint64_t mergeCost(const SRect& a, const SRect& b) {
+    const uint64_t COVERED = a.area() + b.area() - a.intersection(b).area();
+    return a.boundingBox(b).area() - COVERED;
+}
+
+void CRegion::add(const SRect& rect) {
+    if (rect.empty())
+        return;
+
+    SRect toAdd = rect;
+
+    // merging can make the new rect swallow others, so keep going until nothing changes
+    bool  merged = true;
+    while (merged) {
+        merged = false;
+        for (auto it = m_vRects.begin(); it != m_vRects.end(); ++it) {
+            if (it->contains(toAdd))
+                return;
+
+            if (toAdd.contains(*it) || mergeCost(*it, toAdd) == 0) {
+                toAdd = toAdd.boundingBox(*it);
+                m_vRects.erase(it);
+                merged = true;
+                break;
+            }
+        }
+    }
+
+    m_vRects.emplace_back(toAdd);
+
+    if (m_vRects.size() > MAX_RECTS)
+        reduceTo(MAX_RECTS);
+}
+
+void CRegion::add(const CRegion& other) {
+    for (auto& r : other.m_vRects) {
+        add(r);
+    }
+}
+
+void CRegion::clear() {
+    m_vRects.clear();
+}
+
+bool CRegion::empty() const {
+    return m_vRects.empty();
+}
+
+void CRegion::clip(uint32_t w, uint32_t h) {
+    const SRect BOUNDS = {0, 0, w, h};
+
+    for (auto& r : m_vRects) {
+        r = r.intersection(BOUNDS);
+    }
+
+    std::erase_if(m_vRects, [](const auto& r) { return r.empty(); });
+}
+
+CRegion CRegion::scaledDown(uint32_t factor) const {
+    CRegion scaled;
+
+    for (const auto& r : m_vRects) {
+        scaled.add(SRect{
+            .x = r.x / factor,
+            .y = r.y / factor,
+            .w = (r.x + r.w + factor - 1) / factor - r.x / factor,
+            .h = (r.y + r.h + factor - 1) / factor - r.y / factor,
+        });
+    }
+
+    return scaled;
+}
+
+void CRegion::reduceTo(size_t n) {
+    n = std::max<size_t>(n, 1);
+
+    while (m_vRects.size() > n) {
+        size_t   bestA = 0, bestB = 1;
+        uint64_t bestCost = std::numeric_limits<uint64_t>::max();
+
+        for (size_t a = 0; a < m_vRects.size() && bestCost > 0; ++a) {
+            for (size_t b = a + 1; b < m_vRects.size(); ++b) {
+                const auto COST = mergeCost(m_vRects[a], m_vRects[b]);
+                if (COST < bestCost) {
+                    bestCost = COST;
+                    bestA    = a;
+                    bestB    = b;
+                }
+            }
+        }
+
+        m_vRects[bestA] = m_vRects[bestA].boundingBox(m_vRects[bestB]);
+        m_vRects.erase(m_vRects.begin() + bestB);
+    }
+}
+
+const std::vector<SRect>& CRegion::rects() const {
+    return m_vRects;
+}
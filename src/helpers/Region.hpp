@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct SRect {
+    uint32_t x = 0, y = 0, w = 0, h = 0;
+
+    bool     empty() const;
+    uint64_t area() const;
+    SRect    boundingBox(const SRect& other) const;
+    SRect    intersection(const SRect& other) const;
+    bool     contains(const SRect& other) const;
+};
+
+// a damage region: a small set of possibly overlapping rectangles.
+// Rects that can be coalesced without growing the damaged area are merged on insertion, and the region
+// can be cut down to n rects by repeatedly merging the pair whose bounding box adds the least area.
+class CRegion {
+  public:
+    void                      add(const SRect& rect);
+    void                      add(const CRegion& other);
+    void                      clear();
+    bool                      empty() const;
+
+    // clip every rect to (0, 0, w, h)
+    void                      clip(uint32_t w, uint32_t h);
+    // onto an image factor times smaller, rounding outwards
+    CRegion                   scaledDown(uint32_t factor) const;
+    void                      reduceTo(size_t n);
+
+    const std::vector<SRect>& rects() const;
+
+  private:
+    // beyond this, merging on every insert is cheaper than carrying the rects around
+    static constexpr size_t MAX_RECTS = 32;
+
+    std::vector<SRect>      m_vRects;
+};
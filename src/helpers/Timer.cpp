@@ -1,19 +1,106 @@
 #include "Timer.hpp"
 
+#include <algorithm>
+
 CTimer::CTimer(float ms, std::function<void()> callback) {
-    m_fDuration  = ms;
-    m_tStart     = std::chrono::high_resolution_clock::now();
+    m_tStart     = std::chrono::steady_clock::now();
+    m_tDeadline  = m_tStart + std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<float, std::milli>(ms));
+    m_fnCallback = callback;
+}
+
+CTimer::CTimer(std::chrono::steady_clock::time_point deadline, std::function<void()> callback) {
+    m_tStart     = std::chrono::steady_clock::now();
+    m_tDeadline  = deadline;
     m_fnCallback = callback;
 }
 
 bool CTimer::passed() const {
-    return std::chrono::high_resolution_clock::now() > (m_tStart + std::chrono::milliseconds((uint64_t)m_fDuration));
+    return std::chrono::steady_clock::now() >= m_tDeadline;
 }
 
 float CTimer::passedMs() const {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - m_tStart).count();
+    return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - m_tStart).count();
 }
 
 float CTimer::duration() const {
-    return m_fDuration;
-}
\ No newline at end of file
+    return std::chrono::duration<float, std::milli>(m_tDeadline - m_tStart).count();
+}
+
+std::chrono::steady_clock::time_point CTimer::deadline() const {
+    return m_tDeadline;
+}
+
+void CTimer::cancel() {
+    m_bCancelled = true;
+}
+
+bool CTimer::cancelled() const {
+    return m_bCancelled;
+}
+
+bool CTimerQueue::laterThan(const SEntry& a, const SEntry& b) {
+    // equal deadlines fire in insertion order
+    if (a.deadline != b.deadline)
+        return a.deadline > b.deadline;
+    return a.seq > b.seq;
+}
+
+SP<CTimer> CTimerQueue::add(const CTimer& timer) {
+    const auto PTIMER = makeShared<CTimer>(timer);
+
+    m_vHeap.emplace_back(SEntry{PTIMER->deadline(), m_iNextSeq++, PTIMER});
+    std::push_heap(m_vHeap.begin(), m_vHeap.end(), laterThan);
+
+    return PTIMER;
+}
+
+void CTimerQueue::dropCancelled() {
+    while (!m_vHeap.empty() && m_vHeap.front().timer->cancelled()) {
+        std::pop_heap(m_vHeap.begin(), m_vHeap.end(), laterThan);
+        m_vHeap.pop_back();
+    }
+}
+
+std::optional<std::chrono::steady_clock::time_point> CTimerQueue::nextDeadline() {
+    dropCancelled();
+
+    if (m_vHeap.empty())
+        return std::nullopt;
+
+    return m_vHeap.front().deadline;
+}
+
+void CTimerQueue::dispatch() {
+    const auto          NOW     = std::chrono::steady_clock::now();
+    const auto          LASTSEQ = m_iNextSeq;
+
+    // a timer a callback added can be due already and sort ahead of older ones that are, so it's set aside rather
+    // than stopped at
+    std::vector<SEntry> deferred;
+
+    while (!m_vHeap.empty() && m_vHeap.front().deadline <= NOW) {
+        std::pop_heap(m_vHeap.begin(), m_vHeap.end(), laterThan);
+        auto entry = std::move(m_vHeap.back());
+        m_vHeap.pop_back();
+
+        if (entry.timer->cancelled())
+            continue;
+
+        if (entry.seq >= LASTSEQ) {
+            deferred.emplace_back(std::move(entry));
+            continue;
+        }
+
+        entry.timer->m_fnCallback();
+    }
+
+    for (auto& entry : deferred) {
+        m_vHeap.emplace_back(std::move(entry));
+        std::push_heap(m_vHeap.begin(), m_vHeap.end(), laterThan);
+    }
+}
+
+bool CTimerQueue::empty() {
+    dropCancelled();
+    return m_vHeap.empty();
+}
@@ -2,18 +2,57 @@
 
 #include <functional>
 #include <chrono>
+#include <optional>
+#include <vector>
+#include "../includes.hpp"
 
+// all timing is on the monotonic steady_clock, in ns. On linux, that's CLOCK_MONOTONIC.
 class CTimer {
   public:
     CTimer(float ms, std::function<void()> callback);
+    CTimer(std::chrono::steady_clock::time_point deadline, std::function<void()> callback);
 
-    bool                  passed() const;
-    float                 passedMs() const;
-    float                 duration() const;
+    bool                                  passed() const;
+    float                                 passedMs() const;
+    float                                 duration() const;
+    std::chrono::steady_clock::time_point deadline() const;
+
+    // a cancelled timer stays queued, but will never fire
+    void                  cancel();
+    bool                  cancelled() const;
 
     std::function<void()> m_fnCallback;
 
   private:
-    std::chrono::high_resolution_clock::time_point m_tStart;
-    float                                          m_fDuration;
-};
\ No newline at end of file
+    std::chrono::steady_clock::time_point m_tStart;
+    std::chrono::steady_clock::time_point m_tDeadline;
+    bool                                  m_bCancelled = false;
+};
+
+// min-heap of timers ordered by deadline. O(log n) add, O(1) peek.
+// Cancellation is lazy: cancelled timers are dropped once they reach the top.
+class CTimerQueue {
+  public:
+    SP<CTimer>                                           add(const CTimer& timer);
+
+    // deadline of the nearest pending timer, nullopt if there is none
+    std::optional<std::chrono::steady_clock::time_point> nextDeadline();
+
+    // fires every timer that expired before this call. Timers added by the callbacks wait for the next one.
+    void                                                 dispatch();
+
+    bool                                                 empty();
+
+  private:
+    struct SEntry {
+        std::chrono::steady_clock::time_point deadline;
+        uint64_t                              seq = 0;
+        SP<CTimer>                            timer;
+    };
+
+    static bool         laterThan(const SEntry& a, const SEntry& b);
+    void                dropCancelled();
+
+    std::vector<SEntry> m_vHeap;
+    uint64_t            m_iNextSeq = 0;
+};
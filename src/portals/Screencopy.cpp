@@ -5,14 +5,74 @@
 
 #include <cerrno>
 #include <cstdlib>
+#include <fcntl.h>
 #include <libdrm/drm_fourcc.h>
+#include <map>
 #include <pipewire/pipewire.h>
 #include "linux-dmabuf-v1.hpp"
+#include <sys/mman.h>
 #include <unistd.h>
+#include <unordered_set>
 
 constexpr static int MAX_RETRIES        = 10;
 constexpr static int MAX_DMABUF_RETRIES = 2;
 
+// a builder per pod for buildFormatsFor. A pod that outgrows its stack buffer moves to the heap, and would take the
+// pods built before it along if they shared a builder. The heap goes away with this, so it has to outlive the params.
+struct SFormatBuilders {
+    SFormatBuilders() {
+        for (size_t i = 0; i < 6; ++i) {
+            spa_pod_dynamic_builder_init(&dynBuilder[i], buffer[i], sizeof(buffer[i]), 2048);
+            b[i] = &dynBuilder[i].b;
+        }
+    }
+
+    ~SFormatBuilders() {
+        for (auto& d : dynBuilder) {
+            spa_pod_dynamic_builder_clean(&d);
+        }
+    }
+
+    uint8_t                 buffer[6][1024];
+    spa_pod_dynamic_builder dynBuilder[6];
+    spa_pod_builder*        b[6];
+};
+
+// the factor screencopy:downscale_height asks for on a capture this tall, 1 for none
+static uint32_t downscaleFactorFor(uint32_t h) {
+    static auto* const* PHEIGHT = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:downscale_height")->getDataStaticPtr();
+
+    if (**PHEIGHT <= 0 || h <= **PHEIGHT)
+        return 1;
+
+    return std::min<uint32_t>((h + **PHEIGHT - 1) / **PHEIGHT, XDPH_DOWNSCALE_MAX);
+}
+
+// what backs shm memfds, see screencopy:shm_hugepages
+static eSHMHugepages shmHugepages() {
+    static auto* const* PHUGEPAGES = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:shm_hugepages")->getDataStaticPtr();
+
+    return (eSHMHugepages)std::clamp<Hyprlang::INT>(**PHUGEPAGES, SHM_HUGEPAGES_NONE, SHM_HUGEPAGES_HUGETLB);
+}
+
+// the bucket a window stream this big is negotiated at, see screencopy:window_headroom
+static uint32_t windowBucketFor(uint32_t size) {
+    return (size + size / 4 + XDPH_WINDOW_BUCKET - 1) / XDPH_WINDOW_BUCKET * XDPH_WINDOW_BUCKET;
+}
+
+// a cursor meta with room for a bitmap this big
+static constexpr int32_t cursorMetaSize(uint32_t w, uint32_t h) {
+    return sizeof(spa_meta_cursor) + sizeof(spa_meta_bitmap) + w * h * 4;
+}
+
+// whether what pw negotiated still fits the capture, as is or converted to yuv
+static bool pwFormatMatches(CPipewireConnection::SPWStream* pStream, uint32_t fourcc) {
+    if (pStream->convertFormat != SPA_VIDEO_FORMAT_UNKNOWN)
+        return pStream->pwVideoInfo.format == pStream->convertFormat && CColorConverter::canConvert(fourcc);
+
+    return pStream->pwVideoInfo.format == pwFromDrmFourcc(fourcc) || pStream->pwVideoInfo.format == pwStripAlpha(pwFromDrmFourcc(fourcc));
+}
+
 //
 static sdbus::Struct<std::string, uint32_t, sdbus::Variant> getFullRestoreStruct(const SSelectionData& data, uint32_t cursor) {
     std::unordered_map<std::string, sdbus::Variant> mapData;
@@ -53,6 +113,18 @@ dbUasv CScreencopyPortal::onCreateSession(sdbus::ObjectPath requestHandle, sdbus
     // create objects
     PSESSION->session            = createDBusSession(sessionHandle);
     PSESSION->session->onDestroy = [PSESSION, this]() {
+        if (PSESSION->sharingData.nextFrameTimer) {
+            PSESSION->sharingData.nextFrameTimer->cancel();
+            PSESSION->sharingData.nextFrameTimer.reset();
+        }
+
+        if (PSESSION->sharingData.cursor.pollTimer) {
+            PSESSION->sharingData.cursor.pollTimer->cancel();
+            PSESSION->sharingData.cursor.pollTimer.reset();
+        }
+
+        unsubscribeCaptureSource(PSESSION.get());
+
         if (PSESSION->sharingData.active) {
             m_pPipewire->destroyStream(PSESSION.get());
             Debug::log(LOG, "[screencopy] Stream destroyed");
@@ -88,7 +160,7 @@ dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus
         bool        exists = false;
         std::string token, output;
         uint64_t    windowHandle;
-        bool        withCursor;
+        uint32_t    cursorMode = HIDDEN;
         uint64_t    timeIssued;
         std::string windowClass;
         struct {
@@ -136,10 +208,10 @@ dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus
                 restoreData.token        = susbt.get<0>();
                 restoreData.windowHandle = susbt.get<1>();
                 restoreData.output       = susbt.get<2>();
-                restoreData.withCursor   = susbt.get<3>();
+                restoreData.cursorMode   = susbt.get<3>() ? EMBEDDED : HIDDEN;
                 restoreData.timeIssued   = susbt.get<4>();
 
-                Debug::log(LOG, "[screencopy] Restore token v2 {} with data: {} {} {} {}", restoreData.token, restoreData.windowHandle, restoreData.output, restoreData.withCursor,
+                Debug::log(LOG, "[screencopy] Restore token v2 {} with data: {} {} {} {}", restoreData.token, restoreData.windowHandle, restoreData.output, restoreData.cursorMode,
                            restoreData.timeIssued);
             } else {
                 // ver 3
@@ -154,9 +226,10 @@ dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus
                         restoreData.windowHandle = tkval.get<uint64_t>();
                     else if (tkkey == "windowClass")
                         restoreData.windowClass = tkval.get<std::string>();
-                    else if (tkkey == "withCursor")
-                        restoreData.withCursor = tkval.get<uint32_t>() == EMBEDDED;
-                    else if (tkkey == "timeIssued")
+                    else if (tkkey == "withCursor") {
+                        const auto MODE        = tkval.get<uint32_t>();
+                        restoreData.cursorMode = MODE == EMBEDDED || MODE == METADATA ? MODE : (uint32_t)HIDDEN;
+                    } else if (tkkey == "timeIssued")
                         restoreData.timeIssued = tkval.get<uint64_t>();
                     else if (tkkey == "token")
                         restoreData.token = tkval.get<std::string>();
@@ -171,7 +244,7 @@ dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus
                 }
 
                 Debug::log(LOG, "[screencopy] Restore token v3 {} with data: {} {} {} {} {}", restoreData.token, restoreData.windowHandle, restoreData.windowClass,
-                           restoreData.output, restoreData.withCursor, restoreData.timeIssued);
+                           restoreData.output, restoreData.cursorMode, restoreData.timeIssued);
             }
 
         } else if (key == "persist_mode") {
@@ -203,7 +276,7 @@ dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus
         SHAREDATA.windowHandle = WINDOW ? (HANDLEMATCH ? HANDLEMATCH->handle : g_pPortalManager->m_sHelpers.toplevel->handleFromClass(restoreData.windowClass)->handle) : nullptr;
         SHAREDATA.windowClass  = restoreData.windowClass;
         SHAREDATA.allowToken   = true; // user allowed token before
-        PSESSION->cursorMode   = restoreData.withCursor ? EMBEDDED : HIDDEN;
+        PSESSION->cursorMode   = restoreData.cursorMode;
 
         if (GEOMETRY) {
             SHAREDATA.x = restoreData.geometry.x;
@@ -229,9 +302,9 @@ dbUasv CScreencopyPortal::onSelectSources(sdbus::ObjectPath requestHandle, sdbus
             static auto* const* PFPS = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:max_fps")->getDataStaticPtr();
 
             if (**PFPS <= 0)
-                PSESSION->sharingData.framerate = POUTPUT->refreshRate;
+                PSESSION->sharingData.framerate = std::round(POUTPUT->refreshRate);
             else
-                PSESSION->sharingData.framerate = std::clamp(POUTPUT->refreshRate, 1.F, (float)**PFPS);
+                PSESSION->sharingData.framerate = std::round(std::clamp(POUTPUT->refreshRate, 1.F, (float)**PFPS));
         }
     }
 
@@ -282,7 +355,9 @@ dbUasv CScreencopyPortal::onStart(sdbus::ObjectPath requestHandle, sdbus::Object
 
     std::unordered_map<std::string, sdbus::Variant>                                       streamData;
     streamData["position"]    = sdbus::Variant{sdbus::Struct<int32_t, int32_t>{0, 0}};
-    streamData["size"]        = sdbus::Variant{sdbus::Struct<int32_t, int32_t>{PSESSION->sharingData.frameInfoSHM.w, PSESSION->sharingData.frameInfoSHM.h}};
+    streamData["size"]        = PSESSION->sharingData.crop.enabled ?
+               sdbus::Variant{sdbus::Struct<int32_t, int32_t>{PSESSION->sharingData.crop.w, PSESSION->sharingData.crop.h}} :
+               sdbus::Variant{sdbus::Struct<int32_t, int32_t>{PSESSION->sharingData.frameInfoSHM.w, PSESSION->sharingData.frameInfoSHM.h}};
     streamData["source_type"] = sdbus::Variant{uint32_t{type}};
 
     if (PSESSION->selection.type == TYPE_OUTPUT && !PSESSION->selection.output.empty())
@@ -299,18 +374,57 @@ dbUasv CScreencopyPortal::onStart(sdbus::ObjectPath requestHandle, sdbus::Object
 }
 
 void CScreencopyPortal::startSharing(CScreencopyPortal::SSession* pSession) {
-    pSession->sharingData.active = true;
+    static auto* const* PREGIONCROP = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:region_crop")->getDataStaticPtr();
+    static auto* const* PHEADROOM   = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:window_headroom")->getDataStaticPtr();
+
+    pSession->sharingData.active           = true;
+    pSession->sharingData.headroom.enabled = **PHEADROOM && pSession->selection.type == TYPE_WINDOW;
 
     startFrameCopy(pSession);
 
     wl_display_dispatch(g_pPortalManager->m_sWaylandConnection.display);
     wl_display_roundtrip(g_pPortalManager->m_sWaylandConnection.display);
 
+    // serve the region as a crop of the whole output, so it can share one capture with everything else on that output.
+    // The region capture above tells us its size in buffer pixels, and with that the output's scale.
+    const auto POUTPUT = pSession->selection.type == TYPE_GEOMETRY ? g_pPortalManager->getOutputFromName(pSession->selection.output) : nullptr;
+    if (**PREGIONCROP && POUTPUT && POUTPUT->transform == WL_OUTPUT_TRANSFORM_NORMAL && pSession->selection.w > 0 && pSession->sharingData.frameInfoSHM.w > 0) {
+        const double SCALE = (double)pSession->sharingData.frameInfoSHM.w / pSession->selection.w;
+        auto&        crop  = pSession->sharingData.crop;
+
+        crop.x       = std::lround(pSession->selection.x * SCALE);
+        crop.y       = std::lround(pSession->selection.y * SCALE);
+        crop.w       = pSession->sharingData.frameInfoSHM.w;
+        crop.h       = pSession->sharingData.frameInfoSHM.h;
+        crop.enabled = true;
+
+        startFrameCopy(pSession);
+
+        wl_display_dispatch(g_pPortalManager->m_sWaylandConnection.display);
+        wl_display_roundtrip(g_pPortalManager->m_sWaylandConnection.display);
+
+        // rounding can push the region past the edge of the output
+        crop.x = std::min(crop.x, pSession->sharingData.frameInfoSHM.w - std::min(crop.w, pSession->sharingData.frameInfoSHM.w));
+        crop.y = std::min(crop.y, pSession->sharingData.frameInfoSHM.h - std::min(crop.h, pSession->sharingData.frameInfoSHM.h));
+        crop.w = std::min(crop.w, pSession->sharingData.frameInfoSHM.w);
+        crop.h = std::min(crop.h, pSession->sharingData.frameInfoSHM.h);
+
+        Debug::log(LOG, "[screencopy] Serving region as crop {} {} {} {} of {}", crop.x, crop.y, crop.w, crop.h, pSession->selection.output);
+    }
+
+    subscribeCaptureSource(pSession);
+
     if (pSession->sharingData.frameInfoDMA.fmt == DRM_FORMAT_INVALID) {
         Debug::log(ERR, "[screencopy] Couldn't obtain a format from dma"); // todo: blocks shm
         return;
     }
 
+    pSession->initCursorCapture();
+
+    // the first frame had no stream to go into, but the stream has to start out at the bucket size
+    if (pSession->sharingData.headroom.enabled)
+        pSession->applyWindowHeadroom(nullptr);
+
     m_pPipewire->createStream(pSession);
 
     while (pSession->sharingData.nodeID == SPA_ID_INVALID) {
@@ -325,6 +439,9 @@ void CScreencopyPortal::startSharing(CScreencopyPortal::SSession* pSession) {
 
     g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(pSession);
 
+    if (pSession->sharingData.cursor.capture)
+        pSession->pollCursor();
+
     Debug::log(TRACE, "[sc] queued frame in {}ms", 1000.0 / pSession->sharingData.framerate);
 }
 
@@ -336,7 +453,13 @@ void CScreencopyPortal::startFrameCopy(CScreencopyPortal::SSession* pSession) {
 
 void CScreencopyPortal::SSession::startCopy() {
     const auto     POUTPUT       = g_pPortalManager->getOutputFromName(selection.output);
-    const uint32_t OVERLAYCURSOR = cursorMode == EMBEDDED ? 1 : 0;
+    const uint32_t OVERLAYCURSOR = cursorMode == EMBEDDED || (cursorMode == METADATA && selection.type == TYPE_WINDOW) ? 1 : 0;
+    const auto     PSTREAM       = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this);
+
+    // one of the stream's buffers stays with the consumer, however many it ended up negotiating
+    static auto* const* PFRAMESINFLIGHT = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:frames_in_flight")->getDataStaticPtr();
+    const size_t        BUFFERS         = PSTREAM ? PSTREAM->buffers.size() : 0;
+    const size_t        MAXINFLIGHT     = std::min<size_t>(std::max<Hyprlang::INT>(**PFRAMESINFLIGHT, 1), std::max<size_t>(BUFFERS, 2) - 1);
 
     if (!sharingData.active) {
         Debug::log(TRACE, "[sc] startFrameCopy: not copying, inactive session");
@@ -348,17 +471,27 @@ void CScreencopyPortal::SSession::startCopy() {
         return;
     }
 
-    if ((sharingData.frameCallback && (selection.type == TYPE_GEOMETRY || selection.type == TYPE_OUTPUT)) || (sharingData.windowFrameCallback && selection.type == TYPE_WINDOW)) {
-        Debug::log(ERR, "[screencopy] tried scheduling on already scheduled cb (type {})", (int)selection.type);
+    if (followsCaptureSource()) {
+        Debug::log(TRACE, "[sc] startFrameCopy: session follows a shared capture, not copying");
         return;
     }
 
-    if (selection.type == TYPE_GEOMETRY) {
-        sharingData.frameCallback = makeShared<CCZwlrScreencopyFrameV1>(g_pPortalManager->m_sPortals.screencopy->m_sState.screencopy->sendCaptureOutputRegion(
+    if (sharingData.frames.size() >= MAXINFLIGHT) {
+        Debug::log(TRACE, "[sc] startFrameCopy: {} frames already in flight (type {})", sharingData.frames.size(), (int)selection.type);
+        return;
+    }
+
+    // captures are the only clock we have in timer mode, check whether the consumer caught up
+    flushMailbox();
+
+    const auto PFRAME = makeShared<SCaptureFrame>();
+
+    if (selection.type == TYPE_GEOMETRY && !sharingData.crop.enabled) {
+        PFRAME->frameCallback = makeShared<CCZwlrScreencopyFrameV1>(g_pPortalManager->m_sPortals.screencopy->m_sState.screencopy->sendCaptureOutputRegion(
             OVERLAYCURSOR, POUTPUT->output->resource(), selection.x, selection.y, selection.w, selection.h));
-        sharingData.transform     = POUTPUT->transform;
-    } else if (selection.type == TYPE_OUTPUT) {
-        sharingData.frameCallback =
+        sharingData.transform = POUTPUT->transform;
+    } else if (selection.type == TYPE_OUTPUT || selection.type == TYPE_GEOMETRY) {
+        PFRAME->frameCallback =
             makeShared<CCZwlrScreencopyFrameV1>(g_pPortalManager->m_sPortals.screencopy->m_sState.screencopy->sendCaptureOutput(OVERLAYCURSOR, POUTPUT->output->resource()));
         sharingData.transform = POUTPUT->transform;
     } else if (selection.type == TYPE_WINDOW) {
@@ -366,7 +499,7 @@ void CScreencopyPortal::SSession::startCopy() {
             Debug::log(ERR, "[screencopy] selected invalid window?");
             return;
         }
-        sharingData.windowFrameCallback = makeShared<CCHyprlandToplevelExportFrameV1>(
+        PFRAME->windowFrameCallback = makeShared<CCHyprlandToplevelExportFrameV1>(
             g_pPortalManager->m_sPortals.screencopy->m_sState.toplevel->sendCaptureToplevelWithWlrToplevelHandle(OVERLAYCURSOR, selection.windowHandle->resource()));
         sharingData.transform = WL_OUTPUT_TRANSFORM_NORMAL;
     } else {
@@ -374,14 +507,89 @@ void CScreencopyPortal::SSession::startCopy() {
         return;
     }
 
-    sharingData.status = FRAME_QUEUED;
+    if (const auto PSOURCE = captureSource.lock())
+        PSOURCE->captures++;
+
+    PFRAME->status                        = FRAME_QUEUED;
+    PFRAME->targetPresentationNs          = sharingData.presentation.nextTargetNs;
+    sharingData.presentation.nextTargetNs = 0;
+    sharingData.begunFrame                = std::chrono::steady_clock::now();
+    sharingData.frames.emplace_back(PFRAME);
+
+    initCallbacks(PFRAME);
+
+    // pipelined: keep the capture clock running while this frame is in flight, as long as we have room for another one.
+    if (sharingData.frames.size() < MAXINFLIGHT && PSTREAM)
+        g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
+}
+
+void CScreencopyPortal::SSession::applyWindowHeadroom(SCaptureFrame* pFrame) {
+    auto&          headroom = sharingData.headroom;
+    auto&          shm      = sharingData.frameInfoSHM;
+    const uint32_t W        = shm.w;
+    const uint32_t H        = shm.h;
+
+    if (W == 0 || H == 0)
+        return;
+
+    // grow as soon as the window doesn't fit, shrink only once it'd fit in half the bucket
+    const auto FITS = [](uint32_t size, uint32_t bucket) { return size <= bucket && windowBucketFor(size) * 2 > bucket; };
+    if (!FITS(W, headroom.w) || !FITS(H, headroom.h)) {
+        headroom.w = windowBucketFor(W);
+        headroom.h = windowBucketFor(H);
+        Debug::log(LOG, "[screencopy] Window is {}x{}, streaming it in a {}x{} bucket", W, H, headroom.w, headroom.h);
+    }
+
+    if (pFrame) {
+        pFrame->contentW      = W;
+        pFrame->contentH      = H;
+        pFrame->contentStride = shm.stride;
+    }
+
+    // from here on everything negotiates and allocates for the bucket. The stride can be padded, so not stride / W.
+    const uint32_t BPP         = drmFourccBytesPerPixel(shm.fmt);
+    shm.w                      = headroom.w;
+    shm.h                      = headroom.h;
+    shm.stride                 = headroom.w * BPP;
+    shm.size                   = shm.stride * headroom.h;
+    sharingData.frameInfoDMA.w = headroom.w;
+    sharingData.frameInfoDMA.h = headroom.h;
+
+    sharingData.crop = {.enabled = true, .x = 0, .y = 0, .w = W, .h = H};
+}
+
+void CScreencopyPortal::SSession::initCursorCapture() {
+    // metadata mode sends the cursor next to the frames. Windows have no position to give it, they get it embedded instead.
+    if (cursorMode != METADATA || selection.type == TYPE_WINDOW)
+        return;
+
+    const bool REGION = selection.type == TYPE_GEOMETRY && !sharingData.crop.enabled;
+
+    // the pointer moving doesn't damage anything in metadata mode, nothing else would get it to the consumer
+    sharingData.cursor.capture = std::make_unique<CCursorCapture>(g_pPortalManager->m_sPortals.screencopy->m_sState.screencopy, selection.output, REGION ? selection.x : 0,
+                                                                  REGION ? selection.y : 0, REGION ? selection.w : 0, REGION ? selection.h : 0,
+                                                                  [this]() { g_pPortalManager->m_sPortals.screencopy->m_pPipewire->enqueueCursor(this); });
+}
+
+void CScreencopyPortal::SSession::pollCursor() {
+    sharingData.cursor.pollTimer.reset();
+
+    if (!sharingData.active || !sharingData.cursor.capture)
+        return;
 
-    initCallbacks();
+    // the answer comes in through the event loop and gets enqueued from there
+    sharingData.cursor.capture->poll();
+
+    // once a frame while the pointer moves, but a resting one isn't worth a round trip to Hyprland every frame
+    const float FRAMEMS = 1000.F / std::max<uint32_t>(1, sharingData.framerate);
+    const float POLLMS  = sharingData.cursor.capture->idle() ? std::max<float>(FRAMEMS, XDPH_CURSOR_IDLE_POLL_MS) : FRAMEMS;
+
+    sharingData.cursor.pollTimer = g_pPortalManager->addTimer({POLLMS, [this]() { pollCursor(); }});
 }
 
-void CScreencopyPortal::SSession::initCallbacks() {
-    if (sharingData.frameCallback) {
-        sharingData.frameCallback->setBuffer([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+void CScreencopyPortal::SSession::initCallbacks(SP<SCaptureFrame> frame) {
+    if (frame->frameCallback) {
+        frame->frameCallback->setBuffer([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
             Debug::log(TRACE, "[sc] wlrOnBuffer for {}", (void*)self.get());
             if (!self)
                 return;
@@ -394,47 +602,56 @@ void CScreencopyPortal::SSession::initCallbacks() {
 
             // todo: done if ver < 3
         });
-        sharingData.frameCallback->setReady([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+        frame->frameCallback->setReady([this, self = self, frame = WP<SCaptureFrame>{frame}](CCZwlrScreencopyFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
             Debug::log(TRACE, "[sc] wlrOnReady for {}", (void*)self.get());
-            if (!self)
+            if (!self || !frame)
                 return;
 
-            sharingData.status = FRAME_READY;
+            const auto PFRAME = frame.lock();
+
+            PFRAME->status = FRAME_READY;
 
-            sharingData.tvSec         = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
-            sharingData.tvNsec        = tv_nsec;
-            sharingData.tvTimestampNs = sharingData.tvSec * SPA_NSEC_PER_SEC + sharingData.tvNsec;
+            PFRAME->tvSec         = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
+            PFRAME->tvNsec        = tv_nsec;
+            PFRAME->tvTimestampNs = PFRAME->tvSec * SPA_NSEC_PER_SEC + PFRAME->tvNsec;
 
-            Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", sharingData.tvSec, sharingData.tvNsec, sharingData.tvTimestampNs);
+            Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", PFRAME->tvSec, PFRAME->tvNsec, PFRAME->tvTimestampNs);
 
-            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->enqueue(this);
+            trackPresentation(PFRAME.get());
+
+            fanOutFrame(PFRAME.get());
+
+            enqueueReadyFrames();
 
             if (g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this))
                 g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
-
-            sharingData.frameCallback.reset();
         });
-        sharingData.frameCallback->setFailed([this, self = self](CCZwlrScreencopyFrameV1* r) {
+        frame->frameCallback->setFailed([this, self = self, frame = WP<SCaptureFrame>{frame}](CCZwlrScreencopyFrameV1* r) {
             Debug::log(TRACE, "[sc] wlrOnFailed for {}", (void*)self.get());
-            if (!self)
+            if (!self || !frame)
                 return;
-            sharingData.status = FRAME_FAILED;
+
+            const auto PFRAME = frame.lock();
+
+            PFRAME->status = FRAME_FAILED;
+
+            fanOutFrame(PFRAME.get());
+
+            enqueueReadyFrames();
+
+            if (g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this))
+                g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
         });
-        sharingData.frameCallback->setDamage([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+        frame->frameCallback->setDamage([this, self = self, frame = WP<SCaptureFrame>{frame}](CCZwlrScreencopyFrameV1* r, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
             Debug::log(TRACE, "[sc] wlrOnDamage for {}", (void*)self.get());
-            if (!self)
+            if (!self || !frame)
                 return;
 
-            if (sharingData.damageCount > 3) {
-                sharingData.damage[0] = {0, 0, sharingData.frameInfoDMA.w, sharingData.frameInfoDMA.h};
-                return;
-            }
-
-            sharingData.damage[sharingData.damageCount++] = {x, y, width, height};
+            frame->damage.add({x, y, width, height});
 
             Debug::log(TRACE, "[sc] wlr damage: {} {} {} {}", x, y, width, height);
         });
-        sharingData.frameCallback->setLinuxDmabuf([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height) {
+        frame->frameCallback->setLinuxDmabuf([this, self = self](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height) {
             Debug::log(TRACE, "[sc] wlrOnDmabuf for {}", (void*)self.get());
             if (!self)
                 return;
@@ -443,17 +660,17 @@ void CScreencopyPortal::SSession::initCallbacks() {
             sharingData.frameInfoDMA.h   = height;
             sharingData.frameInfoDMA.fmt = format;
         });
-        sharingData.frameCallback->setBufferDone([this, self = self](CCZwlrScreencopyFrameV1* r) {
+        frame->frameCallback->setBufferDone([this, self = self, frame = WP<SCaptureFrame>{frame}](CCZwlrScreencopyFrameV1* r) {
             Debug::log(TRACE, "[sc] wlrOnBufferDone for {}", (void*)self.get());
-            if (!self)
+            if (!self || !frame)
                 return;
 
+            const auto PFRAME  = frame.lock();
             const auto PSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this);
 
             if (!PSTREAM) {
                 Debug::log(TRACE, "[sc] wlrOnBufferDone: no stream");
-                sharingData.status = FRAME_NONE;
-                sharingData.frameCallback.reset();
+                dropFrame(PFRAME.get());
                 return;
             }
 
@@ -462,41 +679,47 @@ void CScreencopyPortal::SSession::initCallbacks() {
             Debug::log(TRACE, "[sc] wlr format dma {} size {}x{}", (int)sharingData.frameInfoDMA.fmt, sharingData.frameInfoDMA.w, sharingData.frameInfoDMA.h);
 
             const auto FMT = PSTREAM->isDMA ? sharingData.frameInfoDMA.fmt : sharingData.frameInfoSHM.fmt;
-            if ((PSTREAM->pwVideoInfo.format != pwFromDrmFourcc(FMT) && PSTREAM->pwVideoInfo.format != pwStripAlpha(pwFromDrmFourcc(FMT))) ||
-                (PSTREAM->pwVideoInfo.size.width != sharingData.frameInfoDMA.w || PSTREAM->pwVideoInfo.size.height != sharingData.frameInfoDMA.h)) {
+            if (!pwFormatMatches(PSTREAM, FMT) ||
+                (PSTREAM->pwVideoInfo.size.width != sharingData.frameInfoDMA.w / PSTREAM->scale || PSTREAM->pwVideoInfo.size.height != sharingData.frameInfoDMA.h / PSTREAM->scale)) {
                 Debug::log(LOG, "[sc] Incompatible formats, renegotiate stream");
-                sharingData.status = FRAME_RENEG;
+                PFRAME->status = FRAME_RENEG;
+                dropFrame(PFRAME.get());
                 g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
                 g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
-                sharingData.status = FRAME_NONE;
-                sharingData.frameCallback.reset();
                 return;
             }
 
-            if (!PSTREAM->currentPWBuffer) {
+            if (!PFRAME->buffer) {
                 Debug::log(TRACE, "[sc] wlrOnBufferDone: dequeue, no current buffer");
-                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->dequeue(this);
+                PFRAME->buffer = bindBuffer(PFRAME);
             }
 
-            if (!PSTREAM->currentPWBuffer) {
+            if (!PFRAME->buffer) {
+                dropFrame(PFRAME.get());
+
+                // other frames still hold buffers, the consumer just hasn't returned one yet. Skip this one.
+                // A slow consumer never renegotiates in mailbox mode, nor does a slow follower on a shared capture.
+                if (!sharingData.frames.empty() || PSTREAM->mailbox || !captureFollowers().empty()) {
+                    Debug::log(TRACE, "[sc] wlrOnBufferDone: no free buffer, {} frames in flight, skipping", sharingData.frames.size());
+                    return;
+                }
+
                 Debug::log(LOG, "[screencopy/pipewire] Out of buffers");
-                sharingData.status = FRAME_NONE;
                 if (sharingData.copyRetries++ < MAX_RETRIES) {
                     Debug::log(LOG, "[sc] Retrying screencopy ({}/{})", sharingData.copyRetries, MAX_RETRIES);
                     g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
                     g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
                 }
-                sharingData.frameCallback.reset();
                 return;
             }
 
-            sharingData.frameCallback->sendCopyWithDamage(PSTREAM->currentPWBuffer->wlBuffer->resource());
+            PFRAME->frameCallback->sendCopyWithDamage(PFRAME->buffer->storage->wlBuffer->resource());
             sharingData.copyRetries = 0;
 
             Debug::log(TRACE, "[sc] wlr frame copied");
         });
-    } else if (sharingData.windowFrameCallback) {
-        sharingData.windowFrameCallback->setBuffer([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    } else if (frame->windowFrameCallback) {
+        frame->windowFrameCallback->setBuffer([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
             Debug::log(TRACE, "[sc] hlOnBuffer for {}", (void*)self.get());
             if (!self)
                 return;
@@ -509,47 +732,52 @@ void CScreencopyPortal::SSession::initCallbacks() {
 
             // todo: done if ver < 3
         });
-        sharingData.windowFrameCallback->setReady([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
-            Debug::log(TRACE, "[sc] hlOnReady for {}", (void*)self.get());
-            if (!self)
-                return;
+        frame->windowFrameCallback->setReady(
+            [this, self = self, frame = WP<SCaptureFrame>{frame}](CCHyprlandToplevelExportFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+                Debug::log(TRACE, "[sc] hlOnReady for {}", (void*)self.get());
+                if (!self || !frame)
+                    return;
 
-            sharingData.status = FRAME_READY;
+                const auto PFRAME = frame.lock();
 
-            sharingData.tvSec         = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
-            sharingData.tvNsec        = tv_nsec;
-            sharingData.tvTimestampNs = sharingData.tvSec * SPA_NSEC_PER_SEC + sharingData.tvNsec;
+                PFRAME->status = FRAME_READY;
 
-            Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", sharingData.tvSec, sharingData.tvNsec, sharingData.tvTimestampNs);
+                PFRAME->tvSec         = ((((uint64_t)tv_sec_hi) << 32) + (uint64_t)tv_sec_lo);
+                PFRAME->tvNsec        = tv_nsec;
+                PFRAME->tvTimestampNs = PFRAME->tvSec * SPA_NSEC_PER_SEC + PFRAME->tvNsec;
 
-            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->enqueue(this);
+                Debug::log(TRACE, "[sc] frame timestamp sec: {} nsec: {} combined: {}ns", PFRAME->tvSec, PFRAME->tvNsec, PFRAME->tvTimestampNs);
 
-            if (g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this))
-                g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
+                enqueueReadyFrames();
 
-            sharingData.windowFrameCallback.reset();
-        });
-        sharingData.windowFrameCallback->setFailed([this, self = self](CCHyprlandToplevelExportFrameV1* r) {
+                if (g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this))
+                    g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
+            });
+        frame->windowFrameCallback->setFailed([this, self = self, frame = WP<SCaptureFrame>{frame}](CCHyprlandToplevelExportFrameV1* r) {
             Debug::log(TRACE, "[sc] hlOnFailed for {}", (void*)self.get());
-            if (!self)
-                return;
-            sharingData.status = FRAME_FAILED;
-        });
-        sharingData.windowFrameCallback->setDamage([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
-            Debug::log(TRACE, "[sc] hlOnDamage for {}", (void*)self.get());
-            if (!self)
+            if (!self || !frame)
                 return;
 
-            if (sharingData.damageCount > 3) {
-                sharingData.damage[0] = {0, 0, sharingData.frameInfoDMA.w, sharingData.frameInfoDMA.h};
-                return;
-            }
+            const auto PFRAME = frame.lock();
+
+            PFRAME->status = FRAME_FAILED;
 
-            sharingData.damage[sharingData.damageCount++] = {x, y, width, height};
+            enqueueReadyFrames();
 
-            Debug::log(TRACE, "[sc] hl damage: {} {} {} {}", x, y, width, height);
+            if (g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this))
+                g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
         });
-        sharingData.windowFrameCallback->setLinuxDmabuf([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t format, uint32_t width, uint32_t height) {
+        frame->windowFrameCallback->setDamage(
+            [this, self = self, frame = WP<SCaptureFrame>{frame}](CCHyprlandToplevelExportFrameV1* r, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+                Debug::log(TRACE, "[sc] hlOnDamage for {}", (void*)self.get());
+                if (!self || !frame)
+                    return;
+
+                frame->damage.add({x, y, width, height});
+
+                Debug::log(TRACE, "[sc] hl damage: {} {} {} {}", x, y, width, height);
+            });
+        frame->windowFrameCallback->setLinuxDmabuf([this, self = self](CCHyprlandToplevelExportFrameV1* r, uint32_t format, uint32_t width, uint32_t height) {
             Debug::log(TRACE, "[sc] hlOnDmabuf for {}", (void*)self.get());
             if (!self)
                 return;
@@ -558,54 +786,73 @@ void CScreencopyPortal::SSession::initCallbacks() {
             sharingData.frameInfoDMA.h   = height;
             sharingData.frameInfoDMA.fmt = format;
         });
-        sharingData.windowFrameCallback->setBufferDone([this, self = self](CCHyprlandToplevelExportFrameV1* r) {
+        frame->windowFrameCallback->setBufferDone([this, self = self, frame = WP<SCaptureFrame>{frame}](CCHyprlandToplevelExportFrameV1* r) {
             Debug::log(TRACE, "[sc] hlOnBufferDone for {}", (void*)self.get());
-            if (!self)
+            if (!self || !frame)
                 return;
 
+            const auto PFRAME  = frame.lock();
             const auto PSTREAM = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->streamFromSession(this);
 
             if (!PSTREAM) {
                 Debug::log(TRACE, "[sc] hlOnBufferDone: no stream");
-                sharingData.status = FRAME_NONE;
-                sharingData.windowFrameCallback.reset();
+                dropFrame(PFRAME.get());
                 return;
             }
 
+            if (sharingData.headroom.enabled)
+                applyWindowHeadroom(PFRAME.get());
+
             Debug::log(TRACE, "[sc] pw format {} size {}x{}", (int)PSTREAM->pwVideoInfo.format, PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
             Debug::log(TRACE, "[sc] hl format {} size {}x{}", (int)sharingData.frameInfoSHM.fmt, sharingData.frameInfoSHM.w, sharingData.frameInfoSHM.h);
             Debug::log(TRACE, "[sc] hl format dma {} size {}x{}", (int)sharingData.frameInfoDMA.fmt, sharingData.frameInfoDMA.w, sharingData.frameInfoDMA.h);
 
             const auto FMT = PSTREAM->isDMA ? sharingData.frameInfoDMA.fmt : sharingData.frameInfoSHM.fmt;
-            if ((PSTREAM->pwVideoInfo.format != pwFromDrmFourcc(FMT) && PSTREAM->pwVideoInfo.format != pwStripAlpha(pwFromDrmFourcc(FMT))) ||
-                (PSTREAM->pwVideoInfo.size.width != sharingData.frameInfoDMA.w || PSTREAM->pwVideoInfo.size.height != sharingData.frameInfoDMA.h)) {
+            if (!pwFormatMatches(PSTREAM, FMT) ||
+                (PSTREAM->pwVideoInfo.size.width != sharingData.frameInfoDMA.w / PSTREAM->scale || PSTREAM->pwVideoInfo.size.height != sharingData.frameInfoDMA.h / PSTREAM->scale)) {
                 Debug::log(LOG, "[sc] Incompatible formats, renegotiate stream");
-                sharingData.status = FRAME_RENEG;
+                PFRAME->status = FRAME_RENEG;
+                dropFrame(PFRAME.get());
                 g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
                 g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
-                sharingData.status = FRAME_NONE;
-                sharingData.windowFrameCallback.reset();
                 return;
             }
 
-            if (!PSTREAM->currentPWBuffer) {
+            if (!PFRAME->buffer) {
                 Debug::log(TRACE, "[sc] hlOnBufferDone: dequeue, no current buffer");
-                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->dequeue(this);
+                PFRAME->buffer = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->dequeue(this);
             }
 
-            if (!PSTREAM->currentPWBuffer) {
+            if (!PFRAME->buffer) {
+                dropFrame(PFRAME.get());
+
+                // other frames still hold buffers, the consumer just hasn't returned one yet. Skip this one.
+                // A slow consumer never renegotiates in mailbox mode either.
+                if (!sharingData.frames.empty() || PSTREAM->mailbox) {
+                    Debug::log(TRACE, "[sc] hlOnBufferDone: no free buffer, {} frames in flight, skipping", sharingData.frames.size());
+                    return;
+                }
+
                 Debug::log(LOG, "[screencopy/pipewire] Out of buffers");
-                sharingData.status = FRAME_NONE;
                 if (sharingData.copyRetries++ < MAX_RETRIES) {
                     Debug::log(LOG, "[sc] Retrying screencopy ({}/{})", sharingData.copyRetries, MAX_RETRIES);
                     g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
                     g_pPortalManager->m_sPortals.screencopy->queueNextShareFrame(this);
                 }
-                sharingData.windowFrameCallback.reset();
                 return;
             }
 
-            sharingData.windowFrameCallback->sendCopy(PSTREAM->currentPWBuffer->wlBuffer->resource(), false);
+            // the compositor only copies into a buffer of the window's size
+            const auto PWLBUFFER = PFRAME->contentW ?
+                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->contentBufferFor(PFRAME->buffer->storage, PFRAME->contentW, PFRAME->contentH, PFRAME->contentStride) :
+                PFRAME->buffer->storage->wlBuffer;
+
+            if (!PWLBUFFER) {
+                dropFrame(PFRAME.get());
+                return;
+            }
+
+            PFRAME->windowFrameCallback->sendCopy(PWLBUFFER->resource(), false);
             sharingData.copyRetries = 0;
 
             Debug::log(TRACE, "[sc] hl frame copied");
@@ -613,342 +860,955 @@ void CScreencopyPortal::SSession::initCallbacks() {
     }
 }
 
-void CScreencopyPortal::queueNextShareFrame(CScreencopyPortal::SSession* pSession) {
-    const auto PSTREAM = m_pPipewire->streamFromSession(pSession);
+void CScreencopyPortal::SSession::enqueueReadyFrames() {
+    // frames can complete out of order when several are in flight. Only hand them to pw oldest-first,
+    // so the consumer never sees timestamps go backwards.
+    while (!sharingData.frames.empty()) {
+        const auto PFRAME = sharingData.frames.front();
 
-    if (PSTREAM && !PSTREAM->streamState)
-        return;
+        if (PFRAME->status != FRAME_READY && PFRAME->status != FRAME_FAILED)
+            break;
 
-    // calculate frame delta and queue next frame
-    const auto FRAMETOOKMS           = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - pSession->sharingData.begunFrame).count() / 1000.0;
-    const auto MSTILNEXTREFRESH      = 1000.0 / (pSession->sharingData.framerate) - FRAMETOOKMS;
-    pSession->sharingData.begunFrame = std::chrono::system_clock::now();
+        if (PFRAME->status == FRAME_READY && PFRAME->tvTimestampNs < sharingData.lastTimestampNs) {
+            Debug::log(TRACE, "[sc] frame {} older than the last enqueued one, dropping", (void*)PFRAME.get());
+            PFRAME->status = FRAME_FAILED;
+        }
 
-    Debug::log(TRACE, "[screencopy] set fps {}, frame took {:.2f}ms, ms till next refresh {:.2f}, estimated actual fps: {:.2f}", pSession->sharingData.framerate, FRAMETOOKMS,
-               MSTILNEXTREFRESH, std::clamp(1000.0 / FRAMETOOKMS, 1.0, (double)pSession->sharingData.framerate));
+        if (PFRAME->status == FRAME_READY) {
+            const bool DAMAGED = !PFRAME->damage.empty();
 
-    g_pPortalManager->addTimer(
-        {std::clamp(MSTILNEXTREFRESH - 1.0 /* safezone */, 6.0, 1000.0), [pSession]() { g_pPortalManager->m_sPortals.screencopy->startFrameCopy(pSession); }});
-}
-bool CScreencopyPortal::hasToplevelCapabilities() {
-    return !!m_sState.toplevel;
-}
+            updateIdleState(DAMAGED);
 
-CScreencopyPortal::SSession* CScreencopyPortal::getSession(sdbus::ObjectPath& path) {
-    for (auto& s : m_vSessions) {
-        if (s->sessionHandle == path)
-            return s.get();
-    }
+            // nothing changed, the consumer already has this frame
+            if (!DAMAGED && sharingData.idle.idle && sharingData.lastTimestampNs != 0) {
+                Debug::log(TRACE, "[sc] frame {} has no damage, skipping", (void*)PFRAME.get());
+                sharingData.idle.skippedFrames++;
+                PFRAME->status = FRAME_FAILED;
+            }
+        }
 
-    return nullptr;
+        if (PFRAME->status == FRAME_READY && PFRAME->buffer) {
+            deliverFrame(PFRAME);
+            continue;
+        }
+
+        dropFrame(PFRAME.get());
+    }
 }
 
-CScreencopyPortal::CScreencopyPortal(SP<CCZwlrScreencopyManagerV1> mgr) {
-    m_pObject = sdbus::createObject(*g_pPortalManager->getConnection(), OBJECT_PATH);
+void CScreencopyPortal::SSession::deliverFrame(SP<SCaptureFrame> frame) {
+    const auto PPIPEWIRE = g_pPortalManager->m_sPortals.screencopy->m_pPipewire.get();
+    const auto PSTREAM   = PPIPEWIRE->streamFromSession(this);
 
-    m_pObject
-        ->addVTable(sdbus::registerMethod("CreateSession")
-                        .implementedAs([this](sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::unordered_map<std::string, sdbus::Variant> m1) {
-                            return onCreateSession(o1, o2, s1, m1);
-                        }),
-                    sdbus::registerMethod("SelectSources")
-                        .implementedAs([this](sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::unordered_map<std::string, sdbus::Variant> m1) {
-                            return onSelectSources(o1, o2, s1, m1);
-                        }),
-                    sdbus::registerMethod("Start").implementedAs([this](sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::string s2,
-                                                                        std::unordered_map<std::string, sdbus::Variant> m1) { return onStart(o1, o2, s1, s2, m1); }),
-                    sdbus::registerProperty("AvailableSourceTypes").withGetter([]() { return uint32_t{VIRTUAL | MONITOR | WINDOW}; }),
-                    sdbus::registerProperty("AvailableCursorModes").withGetter([]() { return uint32_t{HIDDEN | EMBEDDED}; }),
-                    sdbus::registerProperty("version").withGetter([]() { return uint32_t{6}; }))
-        .forInterface(INTERFACE_NAME);
+    std::erase_if(sharingData.frames, [&](const auto& other) { return other == frame; });
 
-    m_sState.screencopy = mgr;
-    m_pPipewire         = std::make_unique<CPipewireConnection>();
+    if (!PSTREAM || !PSTREAM->mailbox) {
+        PPIPEWIRE->enqueue(this, frame.get());
+        sharingData.lastTimestampNs = frame->tvTimestampNs;
+        dropFrame(frame.get());
+        return;
+    }
 
-    Debug::log(LOG, "[screencopy] init successful");
-}
+    // always keep one buffer back for the next capture. If handing this frame to pw would use up the last one,
+    // hold it instead. Either way, a frame that's still held is older than this one, so it's dropped.
+    PPIPEWIRE->reclaimBuffers(PSTREAM);
+    const bool SPARE = !PSTREAM->freeBuffers.empty();
 
-void CScreencopyPortal::appendToplevelExport(SP<CCHyprlandToplevelExportManagerV1> proto) {
-    m_sState.toplevel = proto;
+    if (sharingData.mailbox.held) {
+        Debug::log(TRACE, "[sc] mailbox: dropping held frame {}, superseded by {}", (void*)sharingData.mailbox.held.get(), (void*)frame.get());
+        sharingData.mailbox.droppedFrames++;
+        dropFrame(sharingData.mailbox.held.get());
+        sharingData.mailbox.held.reset();
+    }
 
-    Debug::log(LOG, "[screencopy] Registered for toplevel export");
-}
+    if (!SPARE) {
+        Debug::log(TRACE, "[sc] mailbox: no spare buffer, holding frame {} ({} dropped so far)", (void*)frame.get(), sharingData.mailbox.droppedFrames);
+        sharingData.mailbox.held = frame;
+        return;
+    }
 
-bool CPipewireConnection::good() {
-    return m_pContext && m_pCore;
+    PPIPEWIRE->enqueue(this, frame.get());
+    sharingData.lastTimestampNs = frame->tvTimestampNs;
+    dropFrame(frame.get());
 }
 
-CPipewireConnection::CPipewireConnection() {
-    m_pContext = pw_context_new(g_pPortalManager->m_sPipewire.loop, nullptr, 0);
+void CScreencopyPortal::SSession::flushMailbox() {
+    const auto PPIPEWIRE = g_pPortalManager->m_sPortals.screencopy->m_pPipewire.get();
+    const auto PSTREAM   = PPIPEWIRE->streamFromSession(this);
 
-    if (!m_pContext) {
-        Debug::log(ERR, "[pipewire] pw didn't allow for a context");
+    if (!PSTREAM || !sharingData.mailbox.held)
         return;
-    }
 
-    m_pCore = pw_context_connect(m_pContext, nullptr, 0);
+    PPIPEWIRE->reclaimBuffers(PSTREAM);
 
-    if (!m_pCore) {
-        Debug::log(ERR, "[pipewire] pw didn't allow for a context connection");
+    if (PSTREAM->freeBuffers.empty())
         return;
-    }
 
-    Debug::log(LOG, "[pipewire] connected");
+    Debug::log(TRACE, "[sc] mailbox: consumer returned a buffer, flushing held frame {}", (void*)sharingData.mailbox.held.get());
+
+    deliverHeldFrame();
 }
 
-void CPipewireConnection::removeSessionFrameCallbacks(CScreencopyPortal::SSession* pSession) {
-    Debug::log(TRACE, "[pipewire] removeSessionFrameCallbacks called");
+void CScreencopyPortal::SSession::deliverHeldFrame() {
+    const auto HELD = sharingData.mailbox.held;
 
-    pSession->sharingData.frameCallback.reset();
-    pSession->sharingData.windowFrameCallback.reset();
+    if (!HELD)
+        return;
 
-    pSession->sharingData.windowFrameCallback = nullptr;
-    pSession->sharingData.frameCallback       = nullptr;
+    sharingData.mailbox.held.reset();
 
-    pSession->sharingData.status = FRAME_NONE;
+    g_pPortalManager->m_sPortals.screencopy->m_pPipewire->enqueue(this, HELD.get());
+    sharingData.lastTimestampNs = HELD->tvTimestampNs;
+    dropFrame(HELD.get());
 }
 
-CPipewireConnection::~CPipewireConnection() {
-    if (m_pCore)
-        pw_core_disconnect(m_pCore);
-    if (m_pContext)
-        pw_context_destroy(m_pContext);
-}
+void CScreencopyPortal::subscribeCaptureSource(CScreencopyPortal::SSession* pSession) {
+    if (pSession->selection.type != TYPE_OUTPUT && pSession->selection.type != TYPE_GEOMETRY)
+        return;
 
-// --------------- Pipewire Stream Handlers --------------- //
+    // cropped regions are captured as the whole output
+    const auto& SEL   = pSession->selection;
+    const auto  TYPE  = pSession->sharingData.crop.enabled ? TYPE_OUTPUT : SEL.type;
+    const bool  WHOLE = TYPE == TYPE_OUTPUT;
+
+    const auto  IT = std::ranges::find_if(m_vCaptureSources, [&](const auto& src) {
+        return src->type == TYPE && src->output == SEL.output && src->cursorMode == pSession->cursorMode &&
+            (WHOLE || (src->x == SEL.x && src->y == SEL.y && src->w == SEL.w && src->h == SEL.h));
+    });
+
+    SP<SCaptureSource> source;
+    if (IT != m_vCaptureSources.end())
+        source = *IT;
+    else {
+        source             = m_vCaptureSources.emplace_back(makeShared<SCaptureSource>());
+        source->type       = TYPE;
+        source->output     = SEL.output;
+        source->cursorMode = pSession->cursorMode;
+        if (!WHOLE) {
+            source->x = SEL.x;
+            source->y = SEL.y;
+            source->w = SEL.w;
+            source->h = SEL.h;
+        }
+    }
 
-static uint64_t readObjectSerial(pw_stream* stream) {
-    const pw_properties* props = pw_stream_get_properties(stream);
-    if (!props)
-        return 0;
-    const char* serial_str = pw_properties_get(props, PW_KEY_OBJECT_SERIAL);
-    if (!serial_str)
-        return 0;
-    char*    end = nullptr;
-    errno        = 0;
-    uint64_t s   = std::strtoull(serial_str, &end, 10);
-    if (errno != 0 || end == serial_str)
-        return 0;
-    return s;
+    source->sessions.emplace_back(pSession);
+    pSession->captureSource = source;
+
+    Debug::log(LOG, "[screencopy] Session {} uses capture source {} on {}, {} session(s)", (void*)pSession, (void*)source.get(), SEL.output, source->sessions.size());
 }
 
-static void pwStreamStateChange(void* data, pw_stream_state old, pw_stream_state state, const char* error) {
-    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+void CScreencopyPortal::unsubscribeCaptureSource(CScreencopyPortal::SSession* pSession) {
+    const auto PSOURCE = pSession->captureSource.lock();
 
-    PSTREAM->pSession->sharingData.nodeID         = pw_stream_get_node_id(PSTREAM->stream);
-    PSTREAM->pSession->sharingData.pipewireSerial = readObjectSerial(PSTREAM->stream);
+    if (!PSOURCE)
+        return;
 
-    Debug::log(TRACE, "[pw] pwStreamStateChange on {} from {} to {}, node id {} serial {}", (void*)PSTREAM, pw_stream_state_as_string(old), pw_stream_state_as_string(state),
-               PSTREAM->pSession->sharingData.nodeID, PSTREAM->pSession->sharingData.pipewireSerial);
+    // release followers from anything this session was still capturing for them
+    for (auto& f : pSession->sharingData.frames) {
+        if (f->status != FRAME_QUEUED)
+            continue;
 
-    switch (state) {
-        case PW_STREAM_STATE_STREAMING:
-            PSTREAM->streamState = true;
-            if (PSTREAM->pSession->sharingData.status == FRAME_NONE)
-                g_pPortalManager->m_sPortals.screencopy->startFrameCopy(PSTREAM->pSession);
-            else {
-                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->removeSessionFrameCallbacks(PSTREAM->pSession);
-                g_pPortalManager->m_sPortals.screencopy->startFrameCopy(PSTREAM->pSession);
-            }
-            break;
-        default: {
-            PSTREAM->streamState = false;
-            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->removeSessionFrameCallbacks(PSTREAM->pSession);
-            break;
-        }
+        f->status = FRAME_FAILED;
+        pSession->fanOutFrame(f.get());
     }
 
-    if (state == PW_STREAM_STATE_UNCONNECTED) {
-        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->removeSessionFrameCallbacks(PSTREAM->pSession);
-        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->destroyStream(PSTREAM->pSession);
-    }
-}
+    const bool WASLEADER = PSOURCE->sessions.front() == pSession;
 
-static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param) {
-    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+    std::erase(PSOURCE->sessions, pSession);
+    pSession->captureSource = {};
 
-    Debug::log(TRACE, "[pw] pwStreamParamChanged on {}", (void*)PSTREAM);
+    Debug::log(LOG, "[screencopy] Session {} left capture source {}: {} capture(s), {} fanned out, {} missed", (void*)pSession, (void*)PSOURCE.get(), PSOURCE->captures,
+               PSOURCE->fannedOut, PSOURCE->missed);
 
-    if (id != SPA_PARAM_Format || !param) {
-        Debug::log(TRACE, "[pw] invalid call in pwStreamParamChanged");
+    if (PSOURCE->sessions.empty()) {
+        std::erase(m_vCaptureSources, PSOURCE);
         return;
     }
 
-    spa_pod_dynamic_builder dynBuilder[3];
-    const spa_pod*          params[4];
-    uint8_t                 params_buffer[3][1024];
+    // whoever is first now has to start capturing on its own
+    const auto PLEADER = PSOURCE->sessions.front();
+    if (WASLEADER && PLEADER->sharingData.active && m_pPipewire->streamFromSession(PLEADER))
+        queueNextShareFrame(PLEADER);
+}
 
-    spa_pod_dynamic_builder_init(&dynBuilder[0], params_buffer[0], sizeof(params_buffer[0]), 2048);
-    spa_pod_dynamic_builder_init(&dynBuilder[1], params_buffer[1], sizeof(params_buffer[1]), 2048);
-    spa_pod_dynamic_builder_init(&dynBuilder[2], params_buffer[2], sizeof(params_buffer[2]), 2048);
+void CScreencopyPortal::disableRegionCrop(CScreencopyPortal::SSession* pSession) {
+    if (!pSession->sharingData.crop.enabled)
+        return;
 
-    spa_format_video_raw_parse(param, &PSTREAM->pwVideoInfo);
-    Debug::log(TRACE, "[pw] Framerate: {}/{}", PSTREAM->pwVideoInfo.max_framerate.num, PSTREAM->pwVideoInfo.max_framerate.denom);
-    PSTREAM->pSession->sharingData.framerate = PSTREAM->pwVideoInfo.max_framerate.num / PSTREAM->pwVideoInfo.max_framerate.denom;
+    // without the crop the stream has to be the window's exact size again, the next frame renegotiates
+    if (pSession->sharingData.headroom.enabled) {
+        Debug::log(LOG, "[screencopy] Consumer doesn't support crop meta, dropping the window headroom");
+        pSession->sharingData.headroom.enabled = false;
+        pSession->sharingData.crop.enabled     = false;
+        return;
+    }
 
-    uint32_t                   data_type = 1 << SPA_DATA_MemFd;
+    // a plain region capture belongs to a different source
+    unsubscribeCaptureSource(pSession);
+    pSession->sharingData.crop.enabled = false;
+    subscribeCaptureSource(pSession);
 
-    const struct spa_pod_prop* prop_modifier;
-    if ((prop_modifier = spa_pod_find_prop(param, nullptr, SPA_FORMAT_VIDEO_modifier))) {
-        Debug::log(TRACE, "[pipewire] pw requested dmabuf");
-        PSTREAM->isDMA = true;
-        data_type      = 1 << SPA_DATA_DmaBuf;
+    // positions are relative to the region now
+    pSession->initCursorCapture();
+}
 
-        RASSERT(PSTREAM->pwVideoInfo.format == pwFromDrmFourcc(PSTREAM->pSession->sharingData.frameInfoDMA.fmt), "invalid format in dma pw param change");
+std::vector<CScreencopyPortal::SSession*> CScreencopyPortal::SSession::captureFollowers() {
+    std::vector<SSession*> followers;
 
-        if ((prop_modifier->flags & SPA_POD_PROP_FLAG_DONT_FIXATE) > 0) {
-            Debug::log(TRACE, "[pw] don't fixate");
+    const auto             PSOURCE = captureSource.lock();
 
-            if (++PSTREAM->dmaBufRetries > MAX_DMABUF_RETRIES) {
-                Debug::log(ERR, "[pw] DMA-BUF fixation failed after {} attempts, falling back to SHM", PSTREAM->dmaBufRetries - 1);
-                PSTREAM->dmaBufFailed = true;
-                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-                spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-                spa_pod_dynamic_builder_clean(&dynBuilder[1]);
-                spa_pod_dynamic_builder_clean(&dynBuilder[2]);
-                return;
-            }
+    if (!PSOURCE || PSOURCE->sessions.size() < 2 || PSOURCE->sessions.front() != this)
+        return followers;
 
-            const spa_pod* pod_modifier = &prop_modifier->value;
+    const auto PPIPEWIRE = g_pPortalManager->m_sPortals.screencopy->m_pPipewire.get();
+    const auto PSTREAM   = PPIPEWIRE->streamFromSession(this);
 
-            uint32_t       n_modifiers = SPA_POD_CHOICE_N_VALUES(pod_modifier) - 1;
-            uint64_t*      modifiers   = (uint64_t*)SPA_POD_CHOICE_VALUES(pod_modifier);
-            modifiers++;
-            uint32_t         flags = GBM_BO_USE_RENDERING;
-            uint64_t         modifier;
-            uint32_t         n_params;
-            spa_pod_builder* builder[2] = {&dynBuilder[0].b, &dynBuilder[1].b};
-
-            gbm_bo*          bo =
-                gbm_bo_create_with_modifiers2(g_pPortalManager->m_sWaylandConnection.gbmDevice, PSTREAM->pSession->sharingData.frameInfoDMA.w,
-                                              PSTREAM->pSession->sharingData.frameInfoDMA.h, PSTREAM->pSession->sharingData.frameInfoDMA.fmt, modifiers, n_modifiers, flags);
-            if (bo) {
-                modifier = gbm_bo_get_modifier(bo);
-                gbm_bo_destroy(bo);
-                goto fixate_format;
+    if (!sharingData.active || !PSTREAM || !PSTREAM->streamState)
+        return followers;
+
+    for (auto& s : PSOURCE->sessions) {
+        if (s == this || !s->sharingData.active)
+            continue;
+
+        const auto OTHER = PPIPEWIRE->streamFromSession(s);
+
+        // buffers can only be shared if both streams agree on what they hold. The rest capture on their own.
+        if (!OTHER || !OTHER->streamState || OTHER->isDMA != PSTREAM->isDMA || OTHER->pwVideoInfo.format != PSTREAM->pwVideoInfo.format ||
+            OTHER->pwVideoInfo.size.width != PSTREAM->pwVideoInfo.size.width || OTHER->pwVideoInfo.size.height != PSTREAM->pwVideoInfo.size.height ||
+            (PSTREAM->isDMA && OTHER->pwVideoInfo.modifier != PSTREAM->pwVideoInfo.modifier))
+            continue;
+
+        followers.emplace_back(s);
+    }
+
+    return followers;
+}
+
+bool CScreencopyPortal::SSession::followsCaptureSource() {
+    const auto PSOURCE = captureSource.lock();
+
+    if (!PSOURCE || PSOURCE->sessions.empty() || PSOURCE->sessions.front() == this)
+        return false;
+
+    return std::ranges::any_of(PSOURCE->sessions.front()->captureFollowers(), [this](SSession* s) { return s == this; });
+}
+
+SBuffer* CScreencopyPortal::SSession::bindBuffer(SP<SCaptureFrame> frame) {
+    const auto PPIPEWIRE = g_pPortalManager->m_sPortals.screencopy->m_pPipewire.get();
+    const auto FOLLOWERS = captureFollowers();
+
+    if (FOLLOWERS.empty())
+        return PPIPEWIRE->dequeue(this);
+
+    const auto PSOURCE = captureSource.lock();
+    const auto PSTREAM = PPIPEWIRE->streamFromSession(this);
+
+    PPIPEWIRE->reclaimBuffers(PSTREAM);
+
+    std::vector<CPipewireConnection::SPWStream*> followerStreams;
+    for (auto& f : FOLLOWERS) {
+        followerStreams.emplace_back(PPIPEWIRE->streamFromSession(f));
+        PPIPEWIRE->reclaimBuffers(followerStreams.back());
+    }
+
+    // storage can only be written once every stream aliasing it is done with it
+    const auto IDLE = [&](const SP<SBufferStorage>& storage) {
+        for (auto& st : followerStreams) {
+            for (auto& b : st->buffers) {
+                if (b->storage == storage && std::ranges::find(st->freeBuffers, b.get()) == st->freeBuffers.end())
+                    return false;
             }
+        }
+        return true;
+    };
 
-            Debug::log(TRACE, "[pw] unable to allocate a dmabuf with modifiers. Falling back to the old api");
-            for (uint32_t i = 0; i < n_modifiers; i++) {
-                switch (modifiers[i]) {
-                    case DRM_FORMAT_MOD_INVALID:
-                        flags =
-                            GBM_BO_USE_RENDERING; // ;cast->ctx->state->config->screencast_conf.force_mod_linear ? GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR : GBM_BO_USE_RENDERING;
-                        break;
-                    case DRM_FORMAT_MOD_LINEAR: flags = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR; break;
-                    default: continue;
-                }
-                bo = gbm_bo_create(g_pPortalManager->m_sWaylandConnection.gbmDevice, PSTREAM->pSession->sharingData.frameInfoDMA.w, PSTREAM->pSession->sharingData.frameInfoDMA.h,
-                                   PSTREAM->pSession->sharingData.frameInfoDMA.fmt, flags);
-                if (bo) {
-                    modifier = gbm_bo_get_modifier(bo);
-                    gbm_bo_destroy(bo);
-                    goto fixate_format;
-                }
+    const auto IT = std::ranges::find_if(PSTREAM->freeBuffers, [&](SBuffer* b) { return IDLE(b->storage); });
+    if (IT == PSTREAM->freeBuffers.end()) {
+        Debug::log(TRACE, "[sc] bindBuffer: no storage idle across the capture source");
+        return nullptr;
+    }
+
+    const auto PBUFFER = *IT;
+    PSTREAM->freeBuffers.erase(IT);
+
+    // followers get their own frame on their alias of the storage, completed along with this one
+    for (size_t i = 0; i < FOLLOWERS.size(); ++i) {
+        auto&      freeBuffers = followerStreams[i]->freeBuffers;
+        const auto ALIAS       = std::ranges::find_if(freeBuffers, [&](SBuffer* b) { return b->storage == PBUFFER->storage; });
+
+        // this capture's damage never reaches the follower, and its damage is only known once the capture is done. None
+        // of the follower's buffers can go by their age anymore, the next one out carries everything.
+        if (ALIAS == freeBuffers.end()) {
+            for (auto& b : followerStreams[i]->buffers) {
+                b->damageSeq = 0;
             }
 
-            Debug::log(ERR, "[pw] failed to alloc dma");
-            PSTREAM->dmaBufFailed = true;
-            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
-            spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-            spa_pod_dynamic_builder_clean(&dynBuilder[1]);
-            spa_pod_dynamic_builder_clean(&dynBuilder[2]);
-            return;
+            PSOURCE->missed++;
+            continue;
+        }
 
-        fixate_format:
-            params[0] = fixate_format(&dynBuilder[2].b, pwFromDrmFourcc(PSTREAM->pSession->sharingData.frameInfoDMA.fmt), PSTREAM->pSession->sharingData.frameInfoDMA.w,
-                                      PSTREAM->pSession->sharingData.frameInfoDMA.h, PSTREAM->pSession->sharingData.framerate, &modifier);
+        const auto PCLONE = makeShared<SCaptureFrame>();
+        PCLONE->status    = FRAME_QUEUED;
+        PCLONE->buffer    = *ALIAS;
+        PCLONE->fanoutOf  = frame;
+        freeBuffers.erase(ALIAS);
 
-            n_params = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->buildFormatsFor(builder, &params[1], PSTREAM);
-            n_params++;
+        FOLLOWERS[i]->sharingData.frames.emplace_back(PCLONE);
+        PSOURCE->fannedOut++;
+    }
 
-            pw_stream_update_params(PSTREAM->stream, params, n_params);
-            spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-            spa_pod_dynamic_builder_clean(&dynBuilder[1]);
-            spa_pod_dynamic_builder_clean(&dynBuilder[2]);
+    return PBUFFER;
+}
 
-            Debug::log(TRACE, "[pw] Format fixated:");
-            Debug::log(TRACE, "[pw]  | buffer_type {}", "DMA (No fixate)");
-            Debug::log(TRACE, "[pw]  | format: {}", (int)PSTREAM->pwVideoInfo.format);
-            Debug::log(TRACE, "[pw]  | modifier: {}", PSTREAM->pwVideoInfo.modifier);
-            Debug::log(TRACE, "[pw]  | size: {}x{}", PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
-            Debug::log(TRACE, "[pw]  | framerate {}", PSTREAM->pSession->sharingData.framerate);
+void CScreencopyPortal::SSession::fanOutFrame(SCaptureFrame* pFrame) {
+    const auto PSOURCE = captureSource.lock();
 
-            return;
+    if (!PSOURCE)
+        return;
+
+    for (auto& s : PSOURCE->sessions) {
+        if (s == this)
+            continue;
+
+        bool completed = false;
+        for (auto& f : s->sharingData.frames) {
+            if (f->fanoutOf.get() != pFrame || f->status != FRAME_QUEUED)
+                continue;
+
+            f->status        = pFrame->status == FRAME_READY ? FRAME_READY : FRAME_FAILED;
+            f->tvSec         = pFrame->tvSec;
+            f->tvNsec        = pFrame->tvNsec;
+            f->tvTimestampNs = pFrame->tvTimestampNs;
+            f->damage        = pFrame->damage;
+            completed        = true;
         }
+
+        if (!completed)
+            continue;
+
+        s->sharingData.transform = sharingData.transform;
+        s->enqueueReadyFrames();
     }
+}
 
-    Debug::log(TRACE, "[pw] Format renegotiated:");
-    Debug::log(TRACE, "[pw]  | buffer_type {}", PSTREAM->isDMA ? "DMA" : "SHM");
-    Debug::log(TRACE, "[pw]  | format: {}", (int)PSTREAM->pwVideoInfo.format);
-    Debug::log(TRACE, "[pw]  | modifier: {}", PSTREAM->pwVideoInfo.modifier);
-    Debug::log(TRACE, "[pw]  | size: {}x{}", PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
-    Debug::log(TRACE, "[pw]  | framerate {}", PSTREAM->pSession->sharingData.framerate);
+void CScreencopyPortal::SSession::dropFrame(SCaptureFrame* pFrame) {
+    const auto PPIPEWIRE = g_pPortalManager->m_sPortals.screencopy->m_pPipewire.get();
+    const auto PSTREAM   = PPIPEWIRE->streamFromSession(this);
 
-    uint32_t blocks = 1;
+    // followers waiting on a frame that never completed would stall
+    fanOutFrame(pFrame);
 
-    params[0] = build_buffer(&dynBuilder[0].b, blocks, PSTREAM->pSession->sharingData.frameInfoSHM.size, PSTREAM->pSession->sharingData.frameInfoSHM.stride, data_type);
+    // the compositor reports damage relative to the previous capture, drop it and the next buffer we send would miss it.
+    // The buffer might have been written to already, so we don't know what's in it anymore either.
+    if (PSTREAM) {
+        PSTREAM->carriedDamage.add(pFrame->damage);
 
-    params[1] = (const spa_pod*)spa_pod_builder_add_object(&dynBuilder[1].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
-                                                           SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+        if (pFrame->buffer) {
+            pFrame->buffer->damageSeq = 0;
+            PPIPEWIRE->releaseBuffer(PSTREAM, pFrame->buffer);
+        }
+    }
 
-    params[2] = (const spa_pod*)spa_pod_builder_add_object(&dynBuilder[1].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoTransform),
-                                                           SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_videotransform)));
+    pFrame->buffer = nullptr;
 
-    params[3] = (const spa_pod*)spa_pod_builder_add_object(
-        &dynBuilder[2].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage), SPA_PARAM_META_size,
-        SPA_POD_CHOICE_RANGE_Int(sizeof(struct spa_meta_region) * 4, sizeof(struct spa_meta_region) * 1, sizeof(struct spa_meta_region) * 4));
+    std::erase_if(sharingData.frames, [&](const auto& other) { return other.get() == pFrame; });
+}
 
-    pw_stream_update_params(PSTREAM->stream, params, 4);
-    spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-    spa_pod_dynamic_builder_clean(&dynBuilder[1]);
-    spa_pod_dynamic_builder_clean(&dynBuilder[2]);
+void CScreencopyPortal::SSession::trackPresentation(SCaptureFrame* pFrame) {
+    const auto POUTPUT = g_pPortalManager->getOutputFromName(selection.output);
+
+    if (!POUTPUT || pFrame->tvTimestampNs == 0)
+        return;
+
+    // wlr-screencopy stamps frames with the presentation time of the output, which is the best vblank anchor we have
+    // without a surface of our own to request wp_presentation feedback for.
+    POUTPUT->presentation.lastPresentedNs = std::max(POUTPUT->presentation.lastPresentedNs, pFrame->tvTimestampNs);
+
+    const int64_t REFRESH = POUTPUT->presentation.refreshNs;
+
+    if (pFrame->targetPresentationNs == 0 || REFRESH <= 0)
+        return;
+
+    // how far from target + phase_offset_us the frame came back stamped, wrapped into [-refresh / 2, refresh / 2]:
+    // only the phase matters, not which vblank it landed on. Smoothed, and queueNextShareFrame schedules that much earlier.
+    static auto* const* PPHASEOFFSET = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:phase_offset_us")->getDataStaticPtr();
+
+    int64_t             error = ((int64_t)pFrame->tvTimestampNs - ((int64_t)pFrame->targetPresentationNs + **PPHASEOFFSET * 1000)) % REFRESH;
+    if (error > REFRESH / 2)
+        error -= REFRESH;
+    else if (error < -REFRESH / 2)
+        error += REFRESH;
+
+    sharingData.presentation.phaseErrorNs = (sharingData.presentation.phaseErrorNs * 7 + error) / 8;
+
+    Debug::log(TRACE, "[sc] frame presented {}ns off its phase, smoothed {}ns", error, sharingData.presentation.phaseErrorNs);
 }
 
-static void pwStreamAddBuffer(void* data, pw_buffer* buffer) {
-    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+void CScreencopyPortal::SSession::updateIdleState(bool damaged) {
+    static auto* const* PIDLEMINFPS = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:idle_min_fps")->getDataStaticPtr();
 
-    Debug::log(TRACE, "[pw] pwStreamAddBuffer with {} on {}", (void*)buffer, (void*)PSTREAM);
+    if (damaged) {
+        if (sharingData.idle.idle) {
+            sharingData.idle.activeTransitions++;
+            Debug::log(TRACE, "[sc] session {} active again after {} static frames ({} times)", (void*)this, sharingData.idle.staticFrames, sharingData.idle.activeTransitions);
+        }
 
-    spa_data*     spaData = buffer->buffer->datas;
-    spa_data_type type;
-    uint32_t      flags = SPA_DATA_FLAG_READABLE;
+        sharingData.idle.staticFrames = 0;
+        sharingData.idle.idle         = false;
+        return;
+    }
 
-    if ((spaData[0].type & (1u << SPA_DATA_MemFd)) > 0) {
-        type = SPA_DATA_MemFd;
-#ifdef SPA_DATA_FLAG_MAPPABLE
-        flags = flags | SPA_DATA_FLAG_MAPPABLE;
-#endif
-        Debug::log(WARN, "[pipewire] Asked for a wl_shm buffer which is legacy.");
-    } else if ((spaData[0].type & (1u << SPA_DATA_DmaBuf)) > 0) {
-        type = SPA_DATA_DmaBuf;
-    } else {
-        Debug::log(ERR, "[pipewire] wrong format in addbuffer");
+    sharingData.idle.staticFrames++;
+
+    if (**PIDLEMINFPS <= 0 || sharingData.idle.idle || sharingData.idle.staticFrames <= XDPH_IDLE_GRACE_FRAMES)
+        return;
+
+    sharingData.idle.idle = true;
+    sharingData.idle.idleTransitions++;
+    Debug::log(TRACE, "[sc] session {} went idle ({} times)", (void*)this, sharingData.idle.idleTransitions);
+}
+
+uint32_t CScreencopyPortal::SSession::captureFramerate() {
+    static auto* const* PIDLEMINFPS = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:idle_min_fps")->getDataStaticPtr();
+
+    if (!sharingData.idle.idle)
+        return sharingData.framerate;
+
+    // halve the rate for every static frame past the grace period, down to the floor. The first damaged frame snaps it back.
+    const uint32_t FLOOR = std::clamp<uint32_t>(**PIDLEMINFPS, 1, std::max<uint32_t>(1, sharingData.framerate));
+    const uint32_t SHIFT = std::min<uint32_t>(sharingData.idle.staticFrames - XDPH_IDLE_GRACE_FRAMES, 31);
+    return std::max(FLOOR, sharingData.framerate >> SHIFT);
+}
+
+static uint64_t presentationClockNs() {
+    timespec now;
+    clock_gettime(g_pPortalManager->m_sWaylandConnection.presentationClock, &now);
+    return (uint64_t)now.tv_sec * SPA_NSEC_PER_SEC + now.tv_nsec;
+}
+
+void CScreencopyPortal::requestFrame(CScreencopyPortal::SSession* pSession) {
+    const auto PSTREAM = m_pPipewire->streamFromSession(pSession);
+
+    // start a graph cycle, we'll capture from process once pw has a buffer for us
+    if (PSTREAM && PSTREAM->clock == CAPTURE_CLOCK_TRIGGER) {
+        pw_stream_trigger_process(PSTREAM->stream);
         return;
     }
 
-    const auto PBUFFER = PSTREAM->buffers.emplace_back(g_pPortalManager->m_sPortals.screencopy->m_pPipewire->createBuffer(PSTREAM, type == SPA_DATA_DmaBuf)).get();
+    startFrameCopy(pSession);
+}
 
-    PBUFFER->pwBuffer = buffer;
-    buffer->user_data = PBUFFER;
+void CScreencopyPortal::queueNextShareFrame(CScreencopyPortal::SSession* pSession) {
+    const auto PSTREAM = m_pPipewire->streamFromSession(pSession);
 
-    Debug::log(TRACE, "[pw] buffer datas {}", buffer->buffer->n_datas);
+    if (PSTREAM && !PSTREAM->streamState)
+        return;
 
-    for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
-        spaData[plane].type          = type;
-        spaData[plane].maxsize       = PBUFFER->size[plane];
-        spaData[plane].mapoffset     = 0;
-        spaData[plane].chunk->size   = PBUFFER->size[plane];
-        spaData[plane].chunk->stride = PBUFFER->stride[plane];
-        spaData[plane].chunk->offset = PBUFFER->offset[plane];
-        spaData[plane].flags         = flags;
-        spaData[plane].fd            = PBUFFER->fd[plane];
-        spaData[plane].data          = NULL;
-        // clients have implemented to check chunk->size if the buffer is valid instead
-        // of using the flags. Until they are patched we should use some arbitrary value.
-        if (PBUFFER->isDMABUF && spaData[plane].chunk->size == 0) {
-            spaData[plane].chunk->size = 9; // This was choosen by a fair d20.
+    // the graph's driver paces us through process
+    if (PSTREAM && PSTREAM->clock == CAPTURE_CLOCK_FOLLOW)
+        return;
+
+    // the capture source's first session paces everyone
+    if (pSession->followsCaptureSource())
+        return;
+
+    if (pSession->sharingData.nextFrameTimer)
+        return;
+
+    // backs off while the scene is static
+    const uint32_t FRAMERATE = pSession->captureFramerate();
+
+    const auto POUTPUT = pSession->selection.type == TYPE_WINDOW ? nullptr : g_pPortalManager->getOutputFromName(pSession->selection.output);
+
+    if (POUTPUT && POUTPUT->presentation.lastPresentedNs > 0 && POUTPUT->presentation.refreshNs > 0) {
+        // align captures to the output's vblank grid instead of free-running a timer, so that consecutive frames
+        // are sampled at a constant phase and we don't alternate between duplicated and skipped refreshes.
+        static auto* const* PPHASEOFFSET = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:phase_offset_us")->getDataStaticPtr();
+
+        const int64_t       REFRESH = POUTPUT->presentation.refreshNs;
+        const int64_t       NOW     = presentationClockNs();
+        const int64_t       OFFSET  = **PPHASEOFFSET * 1000 - pSession->sharingData.presentation.phaseErrorNs;
+        const int64_t       VBLANKS = std::max<int64_t>(1, std::lround(1000000000.0 / REFRESH / FRAMERATE));
+        const int64_t       ANCHOR  = POUTPUT->presentation.lastPresentedNs;
+
+        // the earliest vblank we can still make, and never sooner than the pacing interval after the previous target
+        int64_t earliest = NOW - OFFSET;
+        if (pSession->sharingData.presentation.lastTargetNs > 0)
+            earliest = std::max(earliest, (int64_t)pSession->sharingData.presentation.lastTargetNs + VBLANKS * REFRESH - REFRESH / 2);
+
+        int64_t target = ANCHOR;
+        if (target < earliest)
+            target += ((earliest - target + REFRESH - 1) / REFRESH) * REFRESH;
+
+        const auto NSTILCAPTURE = std::chrono::nanoseconds{std::max<int64_t>(0, target + OFFSET - NOW)};
+
+        Debug::log(TRACE, "[screencopy] set fps {}, capturing every {} vblank(s), next target in {:.3f}ms, capture in {:.3f}ms", FRAMERATE, VBLANKS,
+                   (target - NOW) / 1000000.0, NSTILCAPTURE.count() / 1000000.0);
+
+        pSession->sharingData.presentation.lastTargetNs = target;
+        pSession->sharingData.nextFrameTimer            = g_pPortalManager->addTimer({std::chrono::steady_clock::now() + NSTILCAPTURE, [pSession, target]() {
+            pSession->sharingData.nextFrameTimer.reset();
+            // trackPresentation compares the frame's timestamp with it
+            pSession->sharingData.presentation.nextTargetNs = target;
+            g_pPortalManager->m_sPortals.screencopy->requestFrame(pSession);
+        }});
+        return;
+    }
+
+    // calculate frame delta and queue next frame, one frame period after the last one begun
+    const auto NOW         = std::chrono::steady_clock::now();
+    const auto FRAMEPERIOD = std::chrono::nanoseconds{1000000000ULL / std::max<uint32_t>(1, FRAMERATE)};
+    const auto FRAMETOOKMS = std::chrono::duration<double, std::milli>(NOW - pSession->sharingData.begunFrame).count();
+    const auto NEXTFRAME   = std::clamp(pSession->sharingData.begunFrame + FRAMEPERIOD, NOW, NOW + std::chrono::seconds{1});
+
+    Debug::log(TRACE, "[screencopy] set fps {}, frame took {:.3f}ms, ms till next refresh {:.3f}, estimated actual fps: {:.2f}", FRAMERATE, FRAMETOOKMS,
+               std::chrono::duration<double, std::milli>(NEXTFRAME - NOW).count(), std::clamp(1000.0 / FRAMETOOKMS, 1.0, (double)FRAMERATE));
+
+    pSession->sharingData.nextFrameTimer = g_pPortalManager->addTimer({NEXTFRAME, [pSession]() {
+        pSession->sharingData.nextFrameTimer.reset();
+        g_pPortalManager->m_sPortals.screencopy->requestFrame(pSession);
+    }});
+}
+
+bool CScreencopyPortal::hasToplevelCapabilities() {
+    return !!m_sState.toplevel;
+}
+
+CScreencopyPortal::SSession* CScreencopyPortal::getSession(sdbus::ObjectPath& path) {
+    for (auto& s : m_vSessions) {
+        if (s->sessionHandle == path)
+            return s.get();
+    }
+
+    return nullptr;
+}
+
+CScreencopyPortal::CScreencopyPortal(SP<CCZwlrScreencopyManagerV1> mgr) {
+    m_pObject = sdbus::createObject(*g_pPortalManager->getConnection(), OBJECT_PATH);
+
+    m_pObject
+        ->addVTable(sdbus::registerMethod("CreateSession")
+                        .implementedAs([this](sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::unordered_map<std::string, sdbus::Variant> m1) {
+                            return onCreateSession(o1, o2, s1, m1);
+                        }),
+                    sdbus::registerMethod("SelectSources")
+                        .implementedAs([this](sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::unordered_map<std::string, sdbus::Variant> m1) {
+                            return onSelectSources(o1, o2, s1, m1);
+                        }),
+                    sdbus::registerMethod("Start").implementedAs([this](sdbus::ObjectPath o1, sdbus::ObjectPath o2, std::string s1, std::string s2,
+                                                                        std::unordered_map<std::string, sdbus::Variant> m1) { return onStart(o1, o2, s1, s2, m1); }),
+                    sdbus::registerProperty("AvailableSourceTypes").withGetter([]() { return uint32_t{VIRTUAL | MONITOR | WINDOW}; }),
+                    sdbus::registerProperty("AvailableCursorModes").withGetter([]() { return uint32_t{HIDDEN | EMBEDDED | METADATA}; }),
+                    sdbus::registerProperty("version").withGetter([]() { return uint32_t{6}; }))
+        .forInterface(INTERFACE_NAME);
+
+    // not part of the portal spec, for seeing what screen sharing costs. GetBufferUsage: bytes used and the budget
+    // (0 for none), then the bytes per device (0 being shm) and per session. GetDroppedFrames: frames each running
+    // session's mailbox replaced before the consumer got to them. GetPhaseError: how far each running session's
+    // vblank aligned frames come back stamped from their target + phase_offset_us, in ns, which their schedule is corrected by.
+    m_pObject
+        ->addVTable(sdbus::registerMethod("GetBufferUsage")
+                        .withOutputParamNames("used", "budget", "devices", "sessions")
+                        .implementedAs([this]() {
+                            static auto* const* PBUDGET =
+                                (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:buffer_budget_mb")->getDataStaticPtr();
+
+                            const auto                            USAGE = m_pPipewire->bufferUsage();
+                            std::map<uint64_t, uint64_t>          devices;
+                            std::map<sdbus::ObjectPath, uint64_t> sessions;
+
+                            for (const auto& [DEVICE, BYTES] : USAGE.byDevice) {
+                                devices[DEVICE] = BYTES;
+                            }
+
+                            for (const auto& [STREAM, BYTES] : USAGE.byStream) {
+                                sessions[STREAM->pSession->sessionHandle] += BYTES;
+                            }
+
+                            return std::make_tuple(USAGE.total, (uint64_t)std::max<Hyprlang::INT>(**PBUDGET, 0) * 1024 * 1024, devices, sessions);
+                        }),
+                    sdbus::registerMethod("GetDroppedFrames").withOutputParamNames("sessions").implementedAs([this]() {
+                        std::map<sdbus::ObjectPath, uint64_t> sessions;
+
+                        for (const auto& s : m_vSessions) {
+                            if (s->sharingData.active)
+                                sessions[s->sessionHandle] = s->sharingData.mailbox.droppedFrames;
+                        }
+
+                        return sessions;
+                    }),
+                    sdbus::registerMethod("GetPhaseError").withOutputParamNames("sessions").implementedAs([this]() {
+                        std::map<sdbus::ObjectPath, int64_t> sessions;
+
+                        for (const auto& s : m_vSessions) {
+                            if (s->sharingData.active)
+                                sessions[s->sessionHandle] = s->sharingData.presentation.phaseErrorNs;
+                        }
+
+                        return sessions;
+                    }))
+        .forInterface(BUFFERS_INTERFACE_NAME);
+
+    m_sState.screencopy = mgr;
+    m_pPipewire         = std::make_unique<CPipewireConnection>();
+
+    Debug::log(LOG, "[screencopy] init successful");
+}
+
+void CScreencopyPortal::appendToplevelExport(SP<CCHyprlandToplevelExportManagerV1> proto) {
+    m_sState.toplevel = proto;
+
+    Debug::log(LOG, "[screencopy] Registered for toplevel export");
+}
+
+bool CPipewireConnection::good() {
+    return m_pContext && m_pCore;
+}
+
+CPipewireConnection::CPipewireConnection() {
+    m_pContext = pw_context_new(g_pPortalManager->m_sPipewire.loop, nullptr, 0);
+
+    if (!m_pContext) {
+        Debug::log(ERR, "[pipewire] pw didn't allow for a context");
+        return;
+    }
+
+    m_pCore = pw_context_connect(m_pContext, nullptr, 0);
+
+    if (!m_pCore) {
+        Debug::log(ERR, "[pipewire] pw didn't allow for a context connection");
+        return;
+    }
+
+    Debug::log(LOG, "[pipewire] connected");
+
+    m_pProfiles = std::make_unique<CStreamProfiles>();
+}
+
+void CPipewireConnection::removeSessionFrameCallbacks(CScreencopyPortal::SSession* pSession) {
+    Debug::log(TRACE, "[pipewire] removeSessionFrameCallbacks called");
+
+    const auto PSTREAM = streamFromSession(pSession);
+
+    for (auto& f : pSession->sharingData.frames) {
+        if (f->status == FRAME_QUEUED) {
+            f->status = FRAME_FAILED;
+            pSession->fanOutFrame(f.get());
         }
+
+        if (f->buffer && PSTREAM)
+            releaseBuffer(PSTREAM, f->buffer);
+
+        f->buffer = nullptr;
+        f->frameCallback.reset();
+        f->windowFrameCallback.reset();
+    }
+
+    pSession->sharingData.frames.clear();
+
+    if (pSession->sharingData.mailbox.held)
+        pSession->dropFrame(pSession->sharingData.mailbox.held.get());
+
+    pSession->sharingData.mailbox.held.reset();
+}
+
+void CPipewireConnection::reclaimBuffers(SPWStream* pStream) {
+    // take back everything the consumer is done with
+    while (const auto PWBUF = pw_stream_dequeue_buffer(pStream->stream)) {
+        onBufferReturned(pStream, (SBuffer*)PWBUF->user_data);
+        releaseBuffer(pStream, (SBuffer*)PWBUF->user_data);
+    }
+}
+
+void CPipewireConnection::releaseBuffer(SPWStream* pStream, SBuffer* pBuffer) {
+    if (std::find(pStream->freeBuffers.begin(), pStream->freeBuffers.end(), pBuffer) == pStream->freeBuffers.end())
+        pStream->freeBuffers.emplace_back(pBuffer);
+}
+
+CPipewireConnection::~CPipewireConnection() {
+    if (m_pBudgetTimer)
+        m_pBudgetTimer->cancel();
+    if (m_pCore)
+        pw_core_disconnect(m_pCore);
+    if (m_pContext)
+        pw_context_destroy(m_pContext);
+}
+
+// --------------- Pipewire Stream Handlers --------------- //
+
+static uint64_t readObjectSerial(pw_stream* stream) {
+    const pw_properties* props = pw_stream_get_properties(stream);
+    if (!props)
+        return 0;
+    const char* serial_str = pw_properties_get(props, PW_KEY_OBJECT_SERIAL);
+    if (!serial_str)
+        return 0;
+    char*    end = nullptr;
+    errno        = 0;
+    uint64_t s   = std::strtoull(serial_str, &end, 10);
+    if (errno != 0 || end == serial_str)
+        return 0;
+    return s;
+}
+
+static void pwStreamStateChange(void* data, pw_stream_state old, pw_stream_state state, const char* error) {
+    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+
+    PSTREAM->pSession->sharingData.nodeID         = pw_stream_get_node_id(PSTREAM->stream);
+    PSTREAM->pSession->sharingData.pipewireSerial = readObjectSerial(PSTREAM->stream);
+
+    Debug::log(TRACE, "[pw] pwStreamStateChange on {} from {} to {}, node id {} serial {}", (void*)PSTREAM, pw_stream_state_as_string(old), pw_stream_state_as_string(state),
+               PSTREAM->pSession->sharingData.nodeID, PSTREAM->pSession->sharingData.pipewireSerial);
+
+    switch (state) {
+        case PW_STREAM_STATE_STREAMING:
+            PSTREAM->streamState = true;
+            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->storeProfile(PSTREAM);
+            if (PSTREAM->pSession->sharingData.frames.empty())
+                g_pPortalManager->m_sPortals.screencopy->startFrameCopy(PSTREAM->pSession);
+            else {
+                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->removeSessionFrameCallbacks(PSTREAM->pSession);
+                g_pPortalManager->m_sPortals.screencopy->startFrameCopy(PSTREAM->pSession);
+            }
+            break;
+        default: {
+            const auto FOLLOWERS = PSTREAM->pSession->captureFollowers();
+
+            PSTREAM->streamState = false;
+            g_pPortalManager->m_sPortals.screencopy->m_pPipewire->removeSessionFrameCallbacks(PSTREAM->pSession);
+
+            // nobody captures for them anymore
+            for (auto& f : FOLLOWERS) {
+                g_pPortalManager->m_sPortals.screencopy->startFrameCopy(f);
+            }
+            break;
+        }
+    }
+
+    if (state == PW_STREAM_STATE_UNCONNECTED) {
+        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->removeSessionFrameCallbacks(PSTREAM->pSession);
+        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->destroyStream(PSTREAM->pSession);
+    }
+}
+
+static void pwStreamParamChanged(void* data, uint32_t id, const spa_pod* param) {
+    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+
+    Debug::log(TRACE, "[pw] pwStreamParamChanged on {}", (void*)PSTREAM);
+
+    if (id != SPA_PARAM_Format || !param) {
+        Debug::log(TRACE, "[pw] invalid call in pwStreamParamChanged");
+        return;
+    }
+
+    spa_pod_dynamic_builder dynBuilder[3];
+    const spa_pod*          params[7];
+    uint8_t                 params_buffer[3][1024];
+
+    spa_pod_dynamic_builder_init(&dynBuilder[0], params_buffer[0], sizeof(params_buffer[0]), 2048);
+    spa_pod_dynamic_builder_init(&dynBuilder[1], params_buffer[1], sizeof(params_buffer[1]), 2048);
+    spa_pod_dynamic_builder_init(&dynBuilder[2], params_buffer[2], sizeof(params_buffer[2]), 2048);
+
+    spa_format_video_raw_parse(param, &PSTREAM->pwVideoInfo);
+    Debug::log(TRACE, "[pw] Framerate: {}/{}", PSTREAM->pwVideoInfo.max_framerate.num, PSTREAM->pwVideoInfo.max_framerate.denom);
+    PSTREAM->pSession->sharingData.framerate = PSTREAM->pwVideoInfo.max_framerate.num / PSTREAM->pwVideoInfo.max_framerate.denom;
+
+    uint32_t                   data_type = 1 << SPA_DATA_MemFd;
+
+    // a yuv format can only be one we convert to on shm, see build_yuv_format
+    const auto                 FORMAT = PSTREAM->pwVideoInfo.format;
+    PSTREAM->convertFormat            = FORMAT == SPA_VIDEO_FORMAT_NV12 || FORMAT == SPA_VIDEO_FORMAT_I420 ? FORMAT : SPA_VIDEO_FORMAT_UNKNOWN;
+
+    // and a size smaller than the capture one we downscale to, see screencopy:downscale_height
+    const auto&                SHMINFO = PSTREAM->pSession->sharingData.frameInfoSHM;
+    PSTREAM->scale                     = 1;
+    if (PSTREAM->pwVideoInfo.size.width > 0 && PSTREAM->pwVideoInfo.size.width < SHMINFO.w) {
+        const auto FACTOR = SHMINFO.w / PSTREAM->pwVideoInfo.size.width;
+        if (SHMINFO.w / FACTOR == PSTREAM->pwVideoInfo.size.width && SHMINFO.h / FACTOR == PSTREAM->pwVideoInfo.size.height)
+            PSTREAM->scale = FACTOR;
+    }
+
+    // a fallback to shm renegotiates without a modifier
+    const struct spa_pod_prop* prop_modifier = spa_pod_find_prop(param, nullptr, SPA_FORMAT_VIDEO_modifier);
+    PSTREAM->isDMA                           = prop_modifier;
+    if (prop_modifier) {
+        Debug::log(TRACE, "[pipewire] pw requested dmabuf");
+        data_type = 1 << SPA_DATA_DmaBuf;
+
+        RASSERT(PSTREAM->pwVideoInfo.format == pwFromDrmFourcc(PSTREAM->pSession->sharingData.frameInfoDMA.fmt), "invalid format in dma pw param change");
+
+        if ((prop_modifier->flags & SPA_POD_PROP_FLAG_DONT_FIXATE) > 0) {
+            Debug::log(TRACE, "[pw] don't fixate");
+
+            if (++PSTREAM->dmaBufRetries > MAX_DMABUF_RETRIES) {
+                Debug::log(ERR, "[pw] DMA-BUF fixation failed after {} attempts, falling back to SHM", PSTREAM->dmaBufRetries - 1);
+                PSTREAM->dmaBufFailed = true;
+                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
+                spa_pod_dynamic_builder_clean(&dynBuilder[0]);
+                spa_pod_dynamic_builder_clean(&dynBuilder[1]);
+                spa_pod_dynamic_builder_clean(&dynBuilder[2]);
+                return;
+            }
+
+            const spa_pod* pod_modifier = &prop_modifier->value;
+
+            uint32_t       n_modifiers = SPA_POD_CHOICE_N_VALUES(pod_modifier) - 1;
+            uint64_t*      modifiers   = (uint64_t*)SPA_POD_CHOICE_VALUES(pod_modifier);
+            modifiers++;
+            uint64_t        modifier;
+            uint32_t        n_params;
+            SFormatBuilders builders;
+
+            if (!g_pPortalManager->m_sPortals.screencopy->m_pPipewire->probeModifier(PSTREAM, modifiers, n_modifiers, &modifier)) {
+                Debug::log(ERR, "[pw] failed to alloc dma");
+                PSTREAM->dmaBufFailed = true;
+                g_pPortalManager->m_sPortals.screencopy->m_pPipewire->updateStreamParam(PSTREAM);
+                spa_pod_dynamic_builder_clean(&dynBuilder[0]);
+                spa_pod_dynamic_builder_clean(&dynBuilder[1]);
+                spa_pod_dynamic_builder_clean(&dynBuilder[2]);
+                return;
+            }
+
+            params[0] = fixate_format(&dynBuilder[2].b, pwFromDrmFourcc(PSTREAM->pSession->sharingData.frameInfoDMA.fmt), PSTREAM->pSession->sharingData.frameInfoDMA.w,
+                                      PSTREAM->pSession->sharingData.frameInfoDMA.h, PSTREAM->pSession->sharingData.framerate, &modifier);
+
+            n_params = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->buildFormatsFor(builders.b, &params[1], PSTREAM);
+            n_params++;
+
+            pw_stream_update_params(PSTREAM->stream, params, n_params);
+            spa_pod_dynamic_builder_clean(&dynBuilder[0]);
+            spa_pod_dynamic_builder_clean(&dynBuilder[1]);
+            spa_pod_dynamic_builder_clean(&dynBuilder[2]);
+
+            Debug::log(TRACE, "[pw] Format fixated:");
+            Debug::log(TRACE, "[pw]  | buffer_type {}", "DMA (No fixate)");
+            Debug::log(TRACE, "[pw]  | format: {}", (int)PSTREAM->pwVideoInfo.format);
+            Debug::log(TRACE, "[pw]  | modifier: {}", PSTREAM->pwVideoInfo.modifier);
+            Debug::log(TRACE, "[pw]  | device: {:x}", (uint64_t)PSTREAM->device);
+            Debug::log(TRACE, "[pw]  | size: {}x{}", PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
+            Debug::log(TRACE, "[pw]  | framerate {}", PSTREAM->pSession->sharingData.framerate);
+
+            return;
+        }
+    }
+
+    Debug::log(TRACE, "[pw] Format renegotiated:");
+    Debug::log(TRACE, "[pw]  | buffer_type {}", PSTREAM->isDMA ? "DMA" : "SHM");
+    Debug::log(TRACE, "[pw]  | format: {}", (int)PSTREAM->pwVideoInfo.format);
+    Debug::log(TRACE, "[pw]  | modifier: {}", PSTREAM->pwVideoInfo.modifier);
+    if (PSTREAM->isDMA)
+        Debug::log(TRACE, "[pw]  | device: {:x}", (uint64_t)PSTREAM->device);
+    Debug::log(TRACE, "[pw]  | size: {}x{}", PSTREAM->pwVideoInfo.size.width, PSTREAM->pwVideoInfo.size.height);
+    Debug::log(TRACE, "[pw]  | framerate {}", PSTREAM->pSession->sharingData.framerate);
+
+    uint32_t blocks = 1;
+
+    if (PSTREAM->scale > 1)
+        Debug::log(TRACE, "[pw]  | downscaling by {}", PSTREAM->scale);
+
+    if (PSTREAM->convertFormat != SPA_VIDEO_FORMAT_UNKNOWN) {
+        // one block per plane, all in the same memfd
+        const auto LAYOUT = yuvLayoutFor(PSTREAM->convertFormat == SPA_VIDEO_FORMAT_NV12, SHMINFO.w / PSTREAM->scale, SHMINFO.h / PSTREAM->scale);
+        Debug::log(TRACE, "[pw]  | converting to {}", PSTREAM->convertFormat == SPA_VIDEO_FORMAT_NV12 ? "NV12" : "I420");
+        params[0] = build_buffer(&dynBuilder[0].b, PSTREAM->sizing.wanted, PSTREAM->maxBuffers, LAYOUT.planes, LAYOUT.total, LAYOUT.stride[0], data_type);
+    } else if (PSTREAM->scale > 1) {
+        const uint32_t STRIDE = SHMINFO.w / PSTREAM->scale * 4;
+        params[0]             = build_buffer(&dynBuilder[0].b, PSTREAM->sizing.wanted, PSTREAM->maxBuffers, blocks, STRIDE * (SHMINFO.h / PSTREAM->scale), STRIDE, data_type);
+    } else
+        params[0] = build_buffer(&dynBuilder[0].b, PSTREAM->sizing.wanted, PSTREAM->maxBuffers, blocks, PSTREAM->pSession->sharingData.frameInfoSHM.size, PSTREAM->pSession->sharingData.frameInfoSHM.stride,
+                                 data_type);
+
+    params[1] = (const spa_pod*)spa_pod_builder_add_object(&dynBuilder[1].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+                                                           SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+
+    params[2] = (const spa_pod*)spa_pod_builder_add_object(&dynBuilder[1].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoTransform),
+                                                           SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_videotransform)));
+
+    params[3] = (const spa_pod*)spa_pod_builder_add_object(
+        &dynBuilder[2].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage), SPA_PARAM_META_size,
+        SPA_POD_CHOICE_RANGE_Int(sizeof(struct spa_meta_region) * XDPH_PWR_DAMAGE_RECTS, sizeof(struct spa_meta_region) * 1,
+                                 sizeof(struct spa_meta_region) * XDPH_PWR_DAMAGE_RECTS));
+
+    uint32_t paramCount = 4;
+    if (PSTREAM->pSession->sharingData.crop.enabled)
+        params[paramCount++] = (const spa_pod*)spa_pod_builder_add_object(&dynBuilder[1].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type,
+                                                                          SPA_POD_Id(SPA_META_VideoCrop), SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_region)));
+    if (PSTREAM->pSession->sharingData.cursor.capture)
+        params[paramCount++] = (const spa_pod*)spa_pod_builder_add_object(
+            &dynBuilder[1].b, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor), SPA_PARAM_META_size,
+            SPA_POD_CHOICE_RANGE_Int(cursorMetaSize(XDPH_CURSOR_BITMAP_MAX, XDPH_CURSOR_BITMAP_MAX), cursorMetaSize(1, 1), cursorMetaSize(XDPH_CURSOR_BITMAP_MAX, XDPH_CURSOR_BITMAP_MAX)));
+
+    pw_stream_update_params(PSTREAM->stream, params, paramCount);
+    spa_pod_dynamic_builder_clean(&dynBuilder[0]);
+    spa_pod_dynamic_builder_clean(&dynBuilder[1]);
+    spa_pod_dynamic_builder_clean(&dynBuilder[2]);
+}
+
+// what a filled buffer reports as its chunk size. Cursor-only buffers report 0 instead.
+static uint32_t chunkSizeFor(SBuffer* pBuffer, uint32_t plane) {
+    // clients have implemented to check chunk->size if the buffer is valid instead
+    // of using the flags. Until they are patched we should use some arbitrary value.
+    if (pBuffer->isDMABUF && pBuffer->size[plane] == 0)
+        return 9; // This was choosen by a fair d20.
+
+    return pBuffer->size[plane];
+}
+
+static void pwStreamAddBuffer(void* data, pw_buffer* buffer) {
+    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+
+    Debug::log(TRACE, "[pw] pwStreamAddBuffer with {} on {}", (void*)buffer, (void*)PSTREAM);
+
+    spa_data*     spaData = buffer->buffer->datas;
+    spa_data_type type;
+    uint32_t      flags = SPA_DATA_FLAG_READABLE;
+
+    if ((spaData[0].type & (1u << SPA_DATA_MemFd)) > 0) {
+        type = SPA_DATA_MemFd;
+#ifdef SPA_DATA_FLAG_MAPPABLE
+        flags = flags | SPA_DATA_FLAG_MAPPABLE;
+#endif
+        Debug::log(WARN, "[pipewire] Asked for a wl_shm buffer which is legacy.");
+    } else if ((spaData[0].type & (1u << SPA_DATA_DmaBuf)) > 0) {
+        type = SPA_DATA_DmaBuf;
+    } else {
+        Debug::log(ERR, "[pipewire] wrong format in addbuffer");
+        return;
+    }
+
+    auto buf = g_pPortalManager->m_sPortals.screencopy->m_pPipewire->createBuffer(PSTREAM, type == SPA_DATA_DmaBuf);
+    if (!buf) {
+        Debug::log(ERR, "[pipewire] failed to create a buffer in addbuffer");
+        return;
+    }
+
+    const auto PBUFFER = PSTREAM->buffers.emplace_back(std::move(buf)).get();
+
+    // the consumer didn't take the crop meta and would show the whole output. Go back to capturing just the region,
+    // the size change renegotiates the stream on the next frame.
+    if (PSTREAM->pSession->sharingData.crop.enabled && !spa_buffer_find_meta(buffer->buffer, SPA_META_VideoCrop)) {
+        Debug::log(LOG, "[pipewire] Consumer doesn't support crop meta, capturing the region instead");
+        g_pPortalManager->m_sPortals.screencopy->disableRegionCrop(PSTREAM->pSession);
+    }
+
+    PBUFFER->pwBuffer = buffer;
+    buffer->user_data = PBUFFER;
+
+    g_pPortalManager->m_sPortals.screencopy->m_pPipewire->scheduleBudgetCheck();
+
+    Debug::log(TRACE, "[pw] buffer datas {}", buffer->buffer->n_datas);
+
+    for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
+        spaData[plane].type          = type;
+        spaData[plane].maxsize       = PBUFFER->convertMap ? PBUFFER->convertSize : PBUFFER->size[plane];
+        spaData[plane].mapoffset     = 0;
+        spaData[plane].chunk->size   = chunkSizeFor(PBUFFER, plane);
+        spaData[plane].chunk->stride = PBUFFER->stride[plane];
+        spaData[plane].chunk->offset = PBUFFER->offset[plane];
+        spaData[plane].flags         = flags;
+        spaData[plane].fd            = PBUFFER->fd[plane];
+        spaData[plane].data          = NULL;
     }
 }
 
@@ -956,431 +1816,1366 @@ static void pwStreamRemoveBuffer(void* data, pw_buffer* buffer) {
     const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
     const auto PBUFFER = (SBuffer*)buffer->user_data;
 
-    Debug::log(TRACE, "[pw] pwStreamRemoveBuffer with {} on {}", (void*)buffer, (void*)PSTREAM);
+    Debug::log(TRACE, "[pw] pwStreamRemoveBuffer with {} on {}", (void*)buffer, (void*)PSTREAM);
+
+    if (!PBUFFER)
+        return;
+
+    std::erase(PSTREAM->freeBuffers, PBUFFER);
+
+    for (auto& f : PSTREAM->pSession->sharingData.frames) {
+        if (f->buffer == PBUFFER)
+            f->buffer = nullptr;
+    }
+
+    if (PSTREAM->pSession->sharingData.mailbox.held && PSTREAM->pSession->sharingData.mailbox.held->buffer == PBUFFER)
+        PSTREAM->pSession->sharingData.mailbox.held.reset();
+
+    // the storage goes away with its last alias, into the pool
+    if (PBUFFER->storage.strongRef() == 1)
+        g_pPortalManager->m_sPortals.screencopy->m_pPipewire->recycleStorage(PBUFFER->storage);
+    PBUFFER->storage.reset();
+    for (int plane = 0; plane < PBUFFER->planeCount; plane++) {
+        close(PBUFFER->fd[plane]);
+    }
+
+    for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
+        buffer->buffer->datas[plane].fd = -1;
+    }
+
+    std::erase_if(PSTREAM->buffers, [&](const auto& other) { return other.get() == PBUFFER; });
+
+    buffer->user_data = nullptr;
+}
+
+static void pwStreamProcess(void* data) {
+    const auto PSTREAM = (CPipewireConnection::SPWStream*)data;
+
+    if (PSTREAM->clock == CAPTURE_CLOCK_TIMER || !PSTREAM->streamState || !PSTREAM->pSession->sharingData.active)
+        return;
+
+    PSTREAM->pSession->flushMailbox();
+
+    // only do capture work if the consumer gave us a buffer back. Keep it around for the frame that'll need it.
+    const auto PPIPEWIRE = g_pPortalManager->m_sPortals.screencopy->m_pPipewire.get();
+    const auto PBUFFER   = PPIPEWIRE->dequeue(PSTREAM->pSession);
+
+    if (!PBUFFER) {
+        PSTREAM->starvedCycles++;
+        Debug::log(TRACE, "[pw] process on {}: no buffer available, skipping capture ({} so far)", (void*)PSTREAM, PSTREAM->starvedCycles);
+        return;
+    }
+
+    PPIPEWIRE->releaseBuffer(PSTREAM, PBUFFER);
+
+    Debug::log(TRACE, "[pw] process on {}", (void*)PSTREAM);
+
+    g_pPortalManager->m_sPortals.screencopy->startFrameCopy(PSTREAM->pSession);
+}
+
+static const pw_stream_events pwStreamEvents = {
+    .version       = PW_VERSION_STREAM_EVENTS,
+    .state_changed = pwStreamStateChange,
+    .param_changed = pwStreamParamChanged,
+    .add_buffer    = pwStreamAddBuffer,
+    .remove_buffer = pwStreamRemoveBuffer,
+    .process       = pwStreamProcess,
+};
+
+// ------------------------------------------------------- //
+
+// one profile per app and capture target. Regions of an output share one, their size doesn't matter for the format.
+// Host apps all come without an app id, they'd share profiles they have nothing in common with.
+static std::string profileKeyFor(CScreencopyPortal::SSession* pSession) {
+    const auto& SEL = pSession->selection;
+
+    if (pSession->appid.empty())
+        return "";
+
+    switch (SEL.type) {
+        case TYPE_OUTPUT:
+        case TYPE_GEOMETRY: return pSession->appid + " output:" + SEL.output;
+        case TYPE_WINDOW: return SEL.windowClass.empty() ? "" : pSession->appid + " window:" + SEL.windowClass;
+        default: return "";
+    }
+}
+
+void CPipewireConnection::createStream(CScreencopyPortal::SSession* pSession) {
+    const auto PSTREAM = m_vStreams.emplace_back(std::make_unique<SPWStream>(pSession)).get();
+
+    pw_loop_enter(g_pPortalManager->m_sPipewire.loop);
+
+    const std::string NAME = getRandName("xdph-streaming-");
+
+    PSTREAM->stream = pw_stream_new(m_pCore, NAME.c_str(), pw_properties_new(PW_KEY_MEDIA_CLASS, "Video/Source", nullptr));
+
+    Debug::log(TRACE, "[pw] New stream name {}", NAME);
+
+    if (!PSTREAM->stream) {
+        Debug::log(ERR, "[pipewire] refused to create stream");
+        g_pPortalManager->terminate();
+        return;
+    }
+
+    PSTREAM->profileKey = profileKeyFor(pSession);
+    PSTREAM->profile    = m_pProfiles->get(PSTREAM->profileKey, g_pPortalManager->m_pDMABUFFeedback->hash());
+
+    static auto* const* PCONVERT          = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:shm_convert")->getDataStaticPtr();
+    static auto* const* PCONVERTMATRIX    = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:shm_convert_matrix")->getDataStaticPtr();
+    static auto* const* PCONVERTFULLRANGE = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:shm_convert_full_range")->getDataStaticPtr();
+    PSTREAM->convert                      = **PCONVERT;
+    PSTREAM->convertMatrix                = **PCONVERTMATRIX == 601 ? YUV_MATRIX_BT601 : YUV_MATRIX_BT709;
+    PSTREAM->convertFullRange             = **PCONVERTFULLRANGE;
+
+    // the params live in these until the end of the function, pw_stream_connect reads them
+    SFormatBuilders builders;
+    const spa_pod*  params[6];
+    const auto      PARAMCOUNT = buildFormatsFor(builders.b, params, PSTREAM);
+
+    pw_stream_add_listener(PSTREAM->stream, &PSTREAM->streamListener, &pwStreamEvents, PSTREAM);
+
+    static auto* const* PCLOCK = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:capture_clock")->getDataStaticPtr();
+    PSTREAM->clock             = (eCaptureClock)std::clamp(**PCLOCK, (Hyprlang::INT)CAPTURE_CLOCK_TIMER, (Hyprlang::INT)CAPTURE_CLOCK_TRIGGER);
+
+    uint32_t flags = PW_STREAM_FLAG_ALLOC_BUFFERS;
+    if (PSTREAM->clock != CAPTURE_CLOCK_FOLLOW)
+        flags |= PW_STREAM_FLAG_DRIVER;
+
+    static auto* const* PMAILBOX = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:mailbox")->getDataStaticPtr();
+    PSTREAM->mailbox             = **PMAILBOX;
+
+    static auto* const* PADAPTIVE = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:adaptive_buffers")->getDataStaticPtr();
+    PSTREAM->sizing.enabled       = **PADAPTIVE;
+
+    Debug::log(TRACE, "[pw] Stream capture clock {}, mailbox {}", (int)PSTREAM->clock, PSTREAM->mailbox);
+
+    pw_stream_connect(PSTREAM->stream, PW_DIRECTION_OUTPUT, PW_ID_ANY, (pw_stream_flags)flags, params, PARAMCOUNT);
+
+    pSession->sharingData.nodeID         = pw_stream_get_node_id(PSTREAM->stream);
+    pSession->sharingData.pipewireSerial = readObjectSerial(PSTREAM->stream);
+
+    Debug::log(TRACE, "[pw] Stream got nodeid {} serial {}", pSession->sharingData.nodeID, pSession->sharingData.pipewireSerial);
+}
+
+void CPipewireConnection::destroyStream(CScreencopyPortal::SSession* pSession) {
+    // Disconnecting the stream can cause reentrance to this function.
+    if (pSession->sharingData.active == false)
+        return;
+    pSession->sharingData.active = false;
+
+    const auto PSTREAM = streamFromSession(pSession);
+
+    if (!PSTREAM || !PSTREAM->stream)
+        return;
+
+    if (!PSTREAM->buffers.empty()) {
+        std::vector<SBuffer*> bufs;
+
+        for (auto& b : PSTREAM->buffers) {
+            bufs.push_back(b.get());
+        }
+
+        for (auto& b : bufs) {
+            pwStreamRemoveBuffer(PSTREAM, b->pwBuffer);
+        }
+    }
+
+    Debug::log(LOG, "[pw] Stream {} done: {} on device {:x}, {} buffers, {} starved cycles, {} times out of buffers, {} frames dropped", (void*)PSTREAM,
+               PSTREAM->isDMA ? "dmabuf" : "shm", (uint64_t)PSTREAM->device, PSTREAM->buffers.size(), PSTREAM->starvedCycles, PSTREAM->outOfBuffers,
+               pSession->sharingData.mailbox.droppedFrames);
+
+    pw_stream_flush(PSTREAM->stream, false);
+    pw_stream_disconnect(PSTREAM->stream);
+    pw_stream_destroy(PSTREAM->stream);
+
+    std::erase_if(m_vStreams, [&](const auto& other) { return other.get() == PSTREAM; });
+
+    // what it held may let capped streams have their buffers back
+    scheduleBudgetCheck();
+}
+
+static bool build_modifierlist(CPipewireConnection::SPWStream* stream, uint32_t drm_format, uint64_t** modifiers, uint32_t* modifier_count) {
+    const auto& FEEDBACK = *g_pPortalManager->m_pDMABUFFeedback;
+
+    if (FEEDBACK.empty()) {
+        *modifiers      = NULL;
+        *modifier_count = 0;
+        return false;
+    }
+
+    // already filtered for what we can allocate, highest priority tranche first
+    const auto MODS = FEEDBACK.modifiersFor(drm_format, stream->device);
+    *modifier_count = MODS.size();
+
+    if (*modifier_count == 0) {
+        Debug::log(ERR, "[pw] build_modifierlist: no mods");
+        *modifiers = NULL;
+        return true;
+    }
+    *modifiers = (uint64_t*)calloc(*modifier_count, sizeof(uint64_t));
+    std::ranges::copy(MODS, *modifiers);
+    Debug::log(TRACE, "[pw] build_modifierlist: count {}", *modifier_count);
+    return true;
+}
+
+uint32_t CPipewireConnection::buildFormatsFor(spa_pod_builder* b[6], const spa_pod* params[6], CPipewireConnection::SPWStream* stream) {
+    uint32_t            paramCount = 0;
+    uint32_t            modCount   = 0;
+    uint64_t*           modifiers  = nullptr;
+
+    static auto* const* PFORCESHM = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:force_shm")->getDataStaticPtr();
+    const bool          forceSHM  = **PFORCESHM || stream->dmaBufFailed || (stream->profile && !stream->profile->dmabuf);
+
+    pickDevice(stream);
+
+    // converted yuv goes before the raw shm format, so consumers that can take it do
+    const auto& SHM      = stream->pSession->sharingData.frameInfoSHM;
+    const bool  CONVERT  = stream->convert && CColorConverter::canConvert(SHM.fmt);
+    const auto  BUILDYUV = [&](spa_pod_builder* builder, uint32_t factor) {
+        return build_yuv_format(builder, SHM.w / factor, SHM.h / factor, stream->pSession->sharingData.framerate,
+                                stream->convertMatrix == YUV_MATRIX_BT601 ? SPA_VIDEO_COLOR_MATRIX_BT601 : SPA_VIDEO_COLOR_MATRIX_BT709,
+                                stream->convertFullRange ? SPA_VIDEO_COLOR_RANGE_0_255 : SPA_VIDEO_COLOR_RANGE_16_235);
+    };
+
+    // downscaled shm goes before everything, whoever asked for it would rather encode less than copy less
+    const auto FACTOR = CColorConverter::canConvert(SHM.fmt) ? downscaleFactorFor(SHM.h) : 1;
+    if (FACTOR > 1) {
+        Debug::log(LOG, "[pw] Offering shm downscaled by {}: {}x{}", FACTOR, SHM.w / FACTOR, SHM.h / FACTOR);
+        if (CONVERT) {
+            params[paramCount] = BUILDYUV(b[paramCount], FACTOR);
+            paramCount++;
+        }
+        params[paramCount] = build_format(b[paramCount], pwFromDrmFourcc(SHM.fmt), SHM.w / FACTOR, SHM.h / FACTOR, stream->pSession->sharingData.framerate, NULL, 0);
+        paramCount++;
+    }
+
+    if (!forceSHM && build_modifierlist(stream, stream->pSession->sharingData.frameInfoDMA.fmt, &modifiers, &modCount) && modCount > 0) {
+        Debug::log(LOG, "[pw] Building modifiers for dma");
+
+        // what this app fixated on last time goes first, already fixated. If it takes it, we skip the whole probe.
+        const auto& PROFILE = stream->profile;
+        if (PROFILE && PROFILE->fourcc == stream->pSession->sharingData.frameInfoDMA.fmt && std::find(modifiers, modifiers + modCount, PROFILE->modifier) != modifiers + modCount) {
+            Debug::log(LOG, "[pw] Offering the stream profile first: modifier {}", PROFILE->modifier);
+            uint64_t modifier  = PROFILE->modifier;
+            params[paramCount] = fixate_format(b[paramCount], pwFromDrmFourcc(PROFILE->fourcc), stream->pSession->sharingData.frameInfoDMA.w,
+                                               stream->pSession->sharingData.frameInfoDMA.h, stream->pSession->sharingData.framerate, &modifier);
+            paramCount++;
+        }
+
+        params[paramCount] = build_format(b[paramCount], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoDMA.fmt), stream->pSession->sharingData.frameInfoDMA.w,
+                                          stream->pSession->sharingData.frameInfoDMA.h, stream->pSession->sharingData.framerate, modifiers, modCount);
+        assert(params[paramCount] != NULL);
+        paramCount++;
+        if (CONVERT) {
+            params[paramCount] = BUILDYUV(b[paramCount], 1);
+            paramCount++;
+        }
+        params[paramCount] = build_format(b[paramCount], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoSHM.fmt), stream->pSession->sharingData.frameInfoSHM.w,
+                                          stream->pSession->sharingData.frameInfoSHM.h, stream->pSession->sharingData.framerate, NULL, 0);
+        assert(params[paramCount] != NULL);
+        paramCount++;
+    } else {
+        if (stream->dmaBufFailed)
+            Debug::log(WARN, "[pw] DMA-BUF allocation failed, falling back to SHM");
+        else if (forceSHM)
+            Debug::log(LOG, "[pw] DMA-BUF disabled (force_shm), using SHM only");
+        else
+            Debug::log(LOG, "[pw] Building modifiers for shm");
+
+        if (CONVERT) {
+            params[paramCount] = BUILDYUV(b[paramCount], 1);
+            paramCount++;
+        }
+        params[paramCount] = build_format(b[paramCount], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoSHM.fmt), stream->pSession->sharingData.frameInfoSHM.w,
+                                          stream->pSession->sharingData.frameInfoSHM.h, stream->pSession->sharingData.framerate, NULL, 0);
+        paramCount++;
+    }
+
+    if (modifiers)
+        free(modifiers);
+
+    return paramCount;
+}
+
+void CPipewireConnection::pickDevice(CPipewireConnection::SPWStream* pStream) {
+    const auto& FEEDBACK = *g_pPortalManager->m_pDMABUFFeedback;
+    const auto  DEVICE   = FEEDBACK.deviceFor(pStream->pSession->sharingData.frameInfoDMA.fmt);
+    const auto  PGBM     = FEEDBACK.empty() ? nullptr : g_pPortalManager->gbmDeviceFor(DEVICE);
+
+    if (!PGBM) {
+        pStream->device = FEEDBACK.getMainDevice();
+        pStream->gbm    = g_pPortalManager->m_sWaylandConnection.gbmDevice;
+        return;
+    }
+
+    if (pStream->gbm != PGBM)
+        Debug::log(LOG, "[pw] Stream {} allocates on device {:x}{}", (void*)pStream, (uint64_t)DEVICE, DEVICE == FEEDBACK.getMainDevice() ? " (main)" : "");
+
+    pStream->device = DEVICE;
+    pStream->gbm    = PGBM;
+}
+
+void CPipewireConnection::onDMABUFFeedbackChanged(const std::vector<uint32_t>& formats) {
+    // pooled buffers from a device their format no longer goes to, and probes of formats that changed, are stale
+    std::erase_if(m_sBufferPool.idle, [](const auto& storage) {
+        return storage->isDMABUF && gbm_bo_get_device(storage->bo) != g_pPortalManager->gbmDeviceFor(g_pPortalManager->m_pDMABUFFeedback->deviceFor(storage->fmt));
+    });
+    std::erase_if(m_dModifierProbes, [&](const auto& probe) { return std::ranges::find(formats, probe.fourcc) != formats.end(); });
+
+    for (auto& stream : m_vStreams) {
+        if (std::ranges::find(formats, stream->pSession->sharingData.frameInfoDMA.fmt) == formats.end())
+            continue;
+
+        Debug::log(LOG, "[pw] dmabuf feedback changed for stream {}, renegotiating", (void*)stream.get());
+
+        // whatever made dmabuf fail may be gone, give it another go
+        stream->dmaBufFailed  = false;
+        stream->dmaBufRetries = 0;
+        stream->profile       = m_pProfiles->get(stream->profileKey, g_pPortalManager->m_pDMABUFFeedback->hash());
+
+        updateStreamParam(stream.get());
+    }
+}
+
+void CPipewireConnection::storeProfile(CPipewireConnection::SPWStream* pStream) {
+    if (pStream->profileKey.empty())
+        return;
+
+    // shm only saves time if dmabuf was tried and failed. A profile that kept dmabuf off the table stays until it
+    // expires, anything else is outdated: the consumer picked shm with dmabuf on offer.
+    if (!pStream->isDMA && !pStream->dmaBufFailed) {
+        if (!pStream->profile || pStream->profile->dmabuf)
+            m_pProfiles->remove(pStream->profileKey);
+        return;
+    }
+
+    const auto& INFO = pStream->pSession->sharingData;
+
+    m_pProfiles->store(pStream->profileKey,
+                       SStreamProfile{
+                           .fourcc       = pStream->isDMA ? INFO.frameInfoDMA.fmt : INFO.frameInfoSHM.fmt,
+                           .modifier     = pStream->isDMA ? pStream->pwVideoInfo.modifier : DRM_FORMAT_MOD_INVALID,
+                           .dmabuf       = pStream->isDMA,
+                           .feedbackHash = g_pPortalManager->m_pDMABUFFeedback->hash(),
+                       });
+}
+
+bool CPipewireConnection::buildModListFor(CPipewireConnection::SPWStream* stream, uint32_t drmFmt, uint64_t** mods, uint32_t* modCount) {
+    return true;
+}
+
+CPipewireConnection::SPWStream* CPipewireConnection::streamFromSession(CScreencopyPortal::SSession* pSession) {
+    for (auto& s : m_vStreams) {
+        if (s->pSession == pSession)
+            return s.get();
+    }
+    return nullptr;
+}
+
+void CPipewireConnection::enqueue(CScreencopyPortal::SSession* pSession, SCaptureFrame* pFrame) {
+    const auto PSTREAM = streamFromSession(pSession);
+
+    if (!PSTREAM) {
+        Debug::log(ERR, "[pw] Attempted enqueue on invalid session??");
+        return;
+    }
+
+    Debug::log(TRACE, "[pw] enqueue on {}", (void*)PSTREAM);
+
+    if (!pFrame->buffer) {
+        Debug::log(ERR, "[pipewire] no buffer in enqueue");
+        return;
+    }
+
+    spa_buffer* spaBuf  = pFrame->buffer->pwBuffer->buffer;
+    const bool  CORRUPT = pFrame->status != FRAME_READY;
+    if (CORRUPT)
+        Debug::log(TRACE, "[pw] buffer corrupt");
+
+    Debug::log(TRACE, "[pw] Enqueue data:");
+
+    spa_meta_header* header = (spa_meta_header*)spa_buffer_find_meta_data(spaBuf, SPA_META_Header, sizeof(*header));
+    if (header) {
+        header->pts        = pFrame->tvTimestampNs;
+        header->flags      = CORRUPT ? SPA_META_HEADER_FLAG_CORRUPTED : 0;
+        header->seq        = PSTREAM->seq++;
+        header->dts_offset = 0;
+        Debug::log(TRACE, "[pw]  | seq {}", header->seq);
+        Debug::log(TRACE, "[pw]  | pts {}", header->pts);
+    }
+
+    spa_meta_videotransform* vt = (spa_meta_videotransform*)spa_buffer_find_meta_data(spaBuf, SPA_META_VideoTransform, sizeof(*vt));
+    if (vt) {
+        vt->transform = pSession->sharingData.transform;
+        Debug::log(TRACE, "[pw]  | meta transform {}", vt->transform);
+    }
+
+    spa_meta_region* crop = (spa_meta_region*)spa_buffer_find_meta_data(spaBuf, SPA_META_VideoCrop, sizeof(*crop));
+    if (crop && pSession->sharingData.crop.enabled) {
+        // window frames each know their own size, the window may have been resized since
+        auto CROP = pSession->sharingData.crop;
+        if (pFrame->contentW) {
+            CROP.w = pFrame->contentW;
+            CROP.h = pFrame->contentH;
+        }
+
+        const auto S = PSTREAM->scale;
+        crop->region = SPA_REGION(CROP.x / S, CROP.y / S, CROP.w / S, CROP.h / S);
+        Debug::log(TRACE, "[pw]  | meta crop {} {} {} {}", CROP.x, CROP.y, CROP.w, CROP.h);
+    }
+
+    // record this capture's damage, and report the damage since this particular buffer was last filled
+    PSTREAM->damageSeq++;
+    pFrame->damage.add(PSTREAM->carriedDamage);
+    PSTREAM->carriedDamage.clear();
+    PSTREAM->damageHistory.push_front(std::move(pFrame->damage));
+    pFrame->damage.clear();
+    if (PSTREAM->damageHistory.size() > XDPH_PWR_BUFFERS_MAX)
+        PSTREAM->damageHistory.pop_back();
+
+    CRegion    region;
+    const auto AGE = PSTREAM->damageSeq - pFrame->buffer->damageSeq;
+    if (pFrame->buffer->damageSeq == 0 || AGE > PSTREAM->damageHistory.size())
+        region.add({0, 0, pFrame->buffer->storage->w, pFrame->buffer->storage->h});
+    else {
+        for (size_t i = 0; i < AGE; ++i) {
+            region.add(PSTREAM->damageHistory[i]);
+        }
+    }
+    pFrame->buffer->damageSeq = PSTREAM->damageSeq;
+
+    Debug::log(TRACE, "[pw]  | buffer age {}", AGE);
+
+    // downscaled and yuv frames only need what changed since this buffer was last processed. A corrupt
+    // capture isn't processed at all, so the next one has to redo the whole frame.
+    if (pFrame->buffer->scaleMap || pFrame->buffer->convertMap) {
+        if (CORRUPT)
+            pFrame->buffer->damageSeq = 0;
+        else
+            processFrame(PSTREAM, pFrame->buffer, region, pFrame->contentStride ? pFrame->contentStride : pFrame->buffer->storage->stride[0]);
+    }
+
+    // damage so far is in capture pixels
+    if (PSTREAM->scale > 1)
+        region = region.scaledDown(PSTREAM->scale);
+
+    spa_meta* damage = spa_buffer_find_meta(spaBuf, SPA_META_VideoDamage);
+    if (damage) {
+        Debug::log(TRACE, "[pw]  | meta has damage");
+
+        // cut the damage down to however many rects the consumer negotiated, merging the cheapest pairs first
+        region.clip(pFrame->buffer->w, pFrame->buffer->h);
+        region.reduceTo(damage->size / sizeof(spa_meta_region));
+
+        spa_region* damageRegion  = (spa_region*)spa_meta_first(damage);
+        uint32_t    damageCounter = 0;
+        do {
+            if (damageCounter >= region.rects().size()) {
+                *damageRegion = SPA_REGION(0, 0, 0, 0);
+                Debug::log(TRACE, "[pw]  | end damage @ {}: {} {} {} {}", damageCounter, damageRegion->position.x, damageRegion->position.y, damageRegion->size.width,
+                           damageRegion->size.height);
+                break;
+            }
+
+            const auto& RECT = region.rects()[damageCounter];
+            *damageRegion    = SPA_REGION(RECT.x, RECT.y, RECT.w, RECT.h);
+            Debug::log(TRACE, "[pw]  | damage @ {}: {} {} {} {}", damageCounter, damageRegion->position.x, damageRegion->position.y, damageRegion->size.width,
+                       damageRegion->size.height);
+            damageCounter++;
+        } while (spa_meta_check(damageRegion + 1, damage) && damageRegion++);
+    }
+
+    spa_data* datas = spaBuf->datas;
+
+    Debug::log(TRACE, "[pw]  | size {}x{}", PSTREAM->pSession->sharingData.frameInfoDMA.w, PSTREAM->pSession->sharingData.frameInfoDMA.h);
+
+    // shm windows are copied at the window's stride, not the bucket's. Processed frames are repacked anyway.
+    const bool CONTENTSTRIDE = pFrame->contentStride && !pFrame->buffer->isDMABUF && !pFrame->buffer->scaleMap && !pFrame->buffer->convertMap;
+
+    for (uint32_t plane = 0; plane < spaBuf->n_datas; plane++) {
+        datas[plane].chunk->flags  = CORRUPT ? SPA_CHUNK_FLAG_CORRUPTED : SPA_CHUNK_FLAG_NONE;
+        datas[plane].chunk->size   = chunkSizeFor(pFrame->buffer, plane);
+        datas[plane].chunk->stride = CONTENTSTRIDE ? pFrame->contentStride : pFrame->buffer->stride[plane];
+
+        Debug::log(TRACE, "[pw]  | plane {}", plane);
+        Debug::log(TRACE, "[pw]     | fd {}", datas[plane].fd);
+        Debug::log(TRACE, "[pw]     | maxsize {}", datas[plane].maxsize);
+        Debug::log(TRACE, "[pw]     | size {}", datas[plane].chunk->size);
+        Debug::log(TRACE, "[pw]     | stride {}", datas[plane].chunk->stride);
+        Debug::log(TRACE, "[pw]     | offset {}", datas[plane].chunk->offset);
+        Debug::log(TRACE, "[pw]     | flags {}", datas[plane].chunk->flags);
+    }
+
+    if (fillCursorMeta(PSTREAM, spaBuf))
+        Debug::log(TRACE, "[pw]  | meta cursor {} {}", PSTREAM->cursorSent.x, PSTREAM->cursorSent.y);
+
+    Debug::log(TRACE, "[pw] --------------------------------- End enqueue");
+
+    pFrame->buffer->queuedSeq = ++PSTREAM->sizing.queued;
+    pFrame->buffer->queuedAt  = std::chrono::steady_clock::now();
+    PSTREAM->lastQueued       = pFrame->buffer->queuedAt;
+
+    pw_stream_queue_buffer(PSTREAM->stream, pFrame->buffer->pwBuffer);
+
+    pFrame->buffer = nullptr;
+
+    if (PSTREAM->sizing.enabled)
+        adaptBufferCount(PSTREAM);
+}
+
+bool CPipewireConnection::fillCursorMeta(SPWStream* pStream, spa_buffer* spaBuf) {
+    const auto PCAPTURE = pStream->pSession->sharingData.cursor.capture.get();
+    spa_meta*  meta     = spa_buffer_find_meta(spaBuf, SPA_META_Cursor);
+
+    if (!PCAPTURE || !meta || meta->size < sizeof(spa_meta_cursor))
+        return false;
+
+    spa_meta_cursor* cursor = (spa_meta_cursor*)meta->data;
+    const auto&      STATE  = PCAPTURE->state();
+    auto&            sent   = pStream->cursorSent;
+
+    // off the captured area, or somewhere we can't place it
+    if (!STATE.visible) {
+        const bool CHANGED = sent.visible;
+        cursor->id         = 0;
+        sent.visible       = false;
+        return CHANGED;
+    }
+
+    // the bitmap stays in output pixels on downscaled streams, only the position follows the frame
+    const int32_t X       = STATE.x / (int32_t)pStream->scale;
+    const int32_t Y       = STATE.y / (int32_t)pStream->scale;
+    const bool    CHANGED = !sent.visible || X != sent.x || Y != sent.y || STATE.serial != sent.serial;
+
+    cursor->id            = 1;
+    cursor->flags         = 0;
+    cursor->position.x    = X;
+    cursor->position.y    = Y;
+    cursor->hotspot.x     = STATE.hotspotX;
+    cursor->hotspot.y     = STATE.hotspotY;
+    cursor->bitmap_offset = 0;
+
+    // the bitmap only goes out when it changed, consumers keep the last one. A hidden cursor is a single transparent pixel.
+    if (STATE.serial != sent.serial) {
+        const uint32_t W = std::max<uint32_t>(STATE.w, 1);
+        const uint32_t H = std::max<uint32_t>(STATE.h, 1);
+
+        if (meta->size >= (uint32_t)cursorMetaSize(W, H)) {
+            cursor->bitmap_offset = sizeof(spa_meta_cursor);
+
+            spa_meta_bitmap* bitmap = (spa_meta_bitmap*)((uint8_t*)cursor + cursor->bitmap_offset);
+            bitmap->format          = SPA_VIDEO_FORMAT_BGRA; // argb8888 in memory
+            bitmap->size.width      = W;
+            bitmap->size.height     = H;
+            bitmap->stride          = W * 4;
+            bitmap->offset          = sizeof(spa_meta_bitmap);
+
+            uint32_t* pixels = (uint32_t*)((uint8_t*)bitmap + bitmap->offset);
+            if (STATE.pixels.empty())
+                pixels[0] = 0;
+            else
+                memcpy(pixels, STATE.pixels.data(), STATE.pixels.size() * sizeof(uint32_t));
+        } else
+            Debug::log(TRACE, "[pw] cursor bitmap {}x{} doesn't fit the negotiated meta, skipping it", W, H);
+
+        sent.serial = STATE.serial;
+    }
+
+    sent.visible = true;
+    sent.x       = X;
+    sent.y       = Y;
+    return CHANGED;
+}
+
+void CPipewireConnection::enqueueCursor(CScreencopyPortal::SSession* pSession) {
+    const auto PSTREAM = streamFromSession(pSession);
+
+    if (!PSTREAM || !PSTREAM->streamState || pSession->sharingData.mailbox.held)
+        return;
+
+    // a frame carries the cursor anyway if one went out recently, or is about to
+    const auto NOW = std::chrono::steady_clock::now();
+    if (NOW - PSTREAM->lastQueued < std::chrono::nanoseconds{1000000000ULL / std::max<uint32_t>(1, pSession->sharingData.framerate)})
+        return;
+
+    // keep a buffer for the next capture
+    reclaimBuffers(PSTREAM);
+    if (PSTREAM->freeBuffers.size() < 2)
+        return;
+
+    const auto  PBUFFER = PSTREAM->freeBuffers.back();
+    spa_buffer* spaBuf  = PBUFFER->pwBuffer->buffer;
+
+    if (!fillCursorMeta(PSTREAM, spaBuf))
+        return;
+
+    PSTREAM->freeBuffers.pop_back();
+
+    Debug::log(TRACE, "[pw] enqueue cursor {} {} on {}", PSTREAM->cursorSent.x, PSTREAM->cursorSent.y, (void*)PSTREAM);
+
+    spa_meta_header* header = (spa_meta_header*)spa_buffer_find_meta_data(spaBuf, SPA_META_Header, sizeof(*header));
+    if (header) {
+        header->pts        = std::chrono::duration_cast<std::chrono::nanoseconds>(NOW.time_since_epoch()).count();
+        header->flags      = 0;
+        header->seq        = PSTREAM->seq++;
+        header->dts_offset = 0;
+    }
+
+    spa_meta* damage = spa_buffer_find_meta(spaBuf, SPA_META_VideoDamage);
+    if (damage)
+        *(spa_region*)spa_meta_first(damage) = SPA_REGION(0, 0, 0, 0);
+
+    // no video in this one. The contents are whatever was in it before, so its damage age stays.
+    for (uint32_t plane = 0; plane < spaBuf->n_datas; plane++) {
+        spaBuf->datas[plane].chunk->size  = 0;
+        spaBuf->datas[plane].chunk->flags = SPA_CHUNK_FLAG_NONE;
+    }
+
+    PBUFFER->queuedSeq  = ++PSTREAM->sizing.queued;
+    PBUFFER->queuedAt   = NOW;
+    PSTREAM->lastQueued = NOW;
+
+    pw_stream_queue_buffer(PSTREAM->stream, PBUFFER->pwBuffer);
+}
+
+void CPipewireConnection::onBufferReturned(CPipewireConnection::SPWStream* pStream, SBuffer* pBuffer) {
+    // fresh buffers were never queued
+    if (!pBuffer || pBuffer->queuedSeq == 0)
+        return;
+
+    pStream->sizing.peakHeld = std::max<uint32_t>(pStream->sizing.peakHeld, pStream->sizing.queued - pBuffer->queuedSeq);
+    pStream->sizing.holdMsSum += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - pBuffer->queuedAt).count();
+    pStream->sizing.returns++;
+
+    pBuffer->queuedSeq = 0;
+}
+
+void CPipewireConnection::adaptBufferCount(CPipewireConnection::SPWStream* pStream) {
+    auto&      sizing  = pStream->sizing;
+    const bool STARVED = pStream->outOfBuffers > sizing.outOfBuffers;
+
+    // running out can't wait for a whole window
+    if (++sizing.frames < XDPH_ADAPT_WINDOW_FRAMES && !(STARVED && sizing.frames >= XDPH_ADAPT_WINDOW_FRAMES / 4))
+        return;
+
+    // held counts frames queued while the consumer had a buffer, so idle time doesn't count. Each of those needs
+    // a buffer of its own, plus one for the capture that got the buffer back.
+    uint32_t needed = std::clamp<uint32_t>(sizing.peakHeld + 1, XDPH_PWR_BUFFERS_MIN, XDPH_PWR_BUFFERS_MAX);
+    if (STARVED)
+        needed = std::clamp<uint32_t>(std::max(needed, sizing.wanted + 1), XDPH_PWR_BUFFERS_MIN, XDPH_PWR_BUFFERS_MAX);
+
+    const float AVGHOLDMS = sizing.returns ? sizing.holdMsSum / sizing.returns : 0.F;
+
+    Debug::log(TRACE, "[pw] sizing for {}: held for up to {} frames, {:.1f}ms on average, {} times out of buffers, wants {} has {}", (void*)pStream, sizing.peakHeld,
+               AVGHOLDMS, pStream->outOfBuffers - sizing.outOfBuffers, needed, sizing.wanted);
+
+    sizing.frames       = 0;
+    sizing.peakHeld     = 0;
+    sizing.holdMsSum    = 0;
+    sizing.returns      = 0;
+    sizing.outOfBuffers = pStream->outOfBuffers;
+
+    uint32_t wanted = sizing.wanted;
+
+    if (needed > sizing.wanted) {
+        sizing.quietWindows = 0;
+        wanted              = needed;
+    } else if (needed < sizing.wanted) {
+        // one at a time, and only after a while of not needing it
+        if (++sizing.quietWindows < XDPH_ADAPT_SHRINK_WINDOWS)
+            return;
+
+        sizing.quietWindows = 0;
+        wanted              = sizing.wanted - 1;
+    } else {
+        sizing.quietWindows = 0;
+        return;
+    }
+
+    const bool CHANGES = std::min(wanted, pStream->maxBuffers) != std::min(sizing.wanted, pStream->maxBuffers);
+
+    Debug::log(LOG, "[pw] Stream {} goes from {} to {} buffers, consumer holds them for {:.1f}ms on average{}", (void*)pStream, sizing.wanted, wanted, AVGHOLDMS,
+               CHANGES ? "" : " (capped by the buffer budget)");
+
+    sizing.wanted = wanted;
+
+    if (!CHANGES)
+        return;
+
+    // this can run inside pw's process callback, renegotiate once that's done
+    g_pPortalManager->addTimer({0, [this, pStream]() {
+        if (std::ranges::any_of(m_vStreams, [pStream](const auto& other) { return other.get() == pStream; }))
+            updateStreamParam(pStream);
+    }});
+}
+
+SBuffer* CPipewireConnection::dequeue(CScreencopyPortal::SSession* pSession) {
+    const auto PSTREAM = streamFromSession(pSession);
+
+    if (!PSTREAM) {
+        Debug::log(ERR, "[pw] Attempted dequeue on invalid session??");
+        return nullptr;
+    }
+
+    Debug::log(TRACE, "[pw] dequeue on {}", (void*)PSTREAM);
+
+    // sizing needs to see buffers as soon as they're back, not whenever their turn comes
+    if (PSTREAM->sizing.enabled)
+        reclaimBuffers(PSTREAM);
+
+    // reuse buffers we dequeued before but never filled (failed / dropped frames) first
+    if (!PSTREAM->freeBuffers.empty()) {
+        const auto PBUF = PSTREAM->freeBuffers.back();
+        PSTREAM->freeBuffers.pop_back();
+        return PBUF;
+    }
+
+    const auto PWBUF = pw_stream_dequeue_buffer(PSTREAM->stream);
+
+    if (PWBUF) {
+        onBufferReturned(PSTREAM, (SBuffer*)PWBUF->user_data);
+        return (SBuffer*)PWBUF->user_data;
+    }
+
+    // the consumer is behind, and the frame it hasn't gotten to yet sits in the last buffer. That frame goes out rather
+    // than being recycled for a capture that may never complete, and this capture is the one skipped. Held frames are
+    // only dropped when a newer one replaces them, in deliverFrame.
+    if (const auto HELD = pSession->sharingData.mailbox.held; HELD && HELD->buffer) {
+        Debug::log(TRACE, "[pw] dequeue failed, delivering held frame {}", (void*)HELD.get());
+        pSession->deliverHeldFrame();
+    }
+
+    Debug::log(TRACE, "[pw] dequeue failed");
+    PSTREAM->outOfBuffers++;
+    return nullptr;
+}
+
+SBufferStorage::~SBufferStorage() {
+    contentBuffer.reset();
+    wlBuffer.reset();
+    shmPool.reset();
+
+    if (map)
+        munmap(map, capacity);
+
+    if (bo)
+        gbm_bo_destroy(bo);
+
+    for (int plane = 0; plane < planeCount; plane++) {
+        close(fd[plane]);
+    }
+}
+
+SBuffer::~SBuffer() {
+    if (scaleMap)
+        munmap(scaleMap, scaleSize);
+    if (convertMap)
+        munmap(convertMap, convertSize);
+}
+
+SP<CCWlBuffer> CPipewireConnection::contentBufferFor(SP<SBufferStorage> storage, uint32_t w, uint32_t h, uint32_t stride) {
+    if (w == storage->w && h == storage->h && (storage->isDMABUF || stride == storage->stride[0]))
+        return storage->wlBuffer;
+
+    if (storage->contentBuffer && storage->contentW == w && storage->contentH == h && storage->contentStride == stride)
+        return storage->contentBuffer;
+
+    storage->contentBuffer.reset();
+
+    if (w > storage->w || h > storage->h || (!storage->isDMABUF && (size_t)stride * h > storage->capacity)) {
+        Debug::log(ERR, "[pw] content {}x{} doesn't fit its {}x{} storage", w, h, storage->w, storage->h);
+        return nullptr;
+    }
+
+    // same memory, only the size the compositor sees differs. Rows keep the bo's stride on dmabufs.
+    if (storage->isDMABUF) {
+        auto params = makeShared<CCZwpLinuxBufferParamsV1>(g_pPortalManager->m_sWaylandConnection.linuxDmabuf->sendCreateParams());
+        if (!params) {
+            Debug::log(ERR, "[pw] zwp_linux_dmabuf_v1_create_params failed");
+            return nullptr;
+        }
+
+        const uint64_t MOD = gbm_bo_get_modifier(storage->bo);
+        for (int plane = 0; plane < storage->planeCount; plane++) {
+            params->sendAdd(storage->fd[plane], plane, storage->offset[plane], storage->stride[plane], MOD >> 32, MOD & 0xffffffff);
+        }
+
+        storage->contentBuffer = makeShared<CCWlBuffer>(params->sendCreateImmed(w, h, storage->fmt, /* flags */ (zwpLinuxBufferParamsV1Flags)0));
+    } else if (storage->shmPool)
+        storage->contentBuffer = makeShared<CCWlBuffer>(storage->shmPool->sendCreateBuffer(0, w, h, stride, wlSHMFromDrmFourcc(storage->fmt)));
+
+    if (!storage->contentBuffer) {
+        Debug::log(ERR, "[pw] couldn't create a {}x{} buffer over its storage", w, h);
+        return nullptr;
+    }
+
+    storage->contentW      = w;
+    storage->contentH      = h;
+    storage->contentStride = stride;
+
+    return storage->contentBuffer;
+}
+
+SP<SBufferStorage> CPipewireConnection::createStorage(CPipewireConnection::SPWStream* pStream, bool dmabuf) {
+    const auto PSTORAGE = makeShared<SBufferStorage>();
+
+    PSTORAGE->isDMABUF = dmabuf;
+
+    if (dmabuf) {
+        PSTORAGE->w        = pStream->pSession->sharingData.frameInfoDMA.w;
+        PSTORAGE->h        = pStream->pSession->sharingData.frameInfoDMA.h;
+        PSTORAGE->fmt      = pStream->pSession->sharingData.frameInfoDMA.fmt;
+        PSTORAGE->modifier = pStream->pwVideoInfo.modifier;
+
+        uint32_t flags = GBM_BO_USE_RENDERING;
+
+        if (pStream->pwVideoInfo.modifier != DRM_FORMAT_MOD_INVALID) {
+            uint64_t* mods = (uint64_t*)&pStream->pwVideoInfo.modifier;
+            PSTORAGE->bo   = gbm_bo_create_with_modifiers2(pStream->gbm, PSTORAGE->w, PSTORAGE->h, PSTORAGE->fmt, mods, 1, flags);
+        } else {
+            PSTORAGE->bo = gbm_bo_create(pStream->gbm, PSTORAGE->w, PSTORAGE->h, PSTORAGE->fmt, flags);
+        }
+
+        if (!PSTORAGE->bo) {
+            Debug::log(ERR, "[pw] Couldn't create a drm buffer");
+            // whatever the probe told us doesn't allocate anymore, probe again on the next negotiation
+            forgetModifier(pStream);
+            return nullptr;
+        }
+
+        const int PLANECOUNT = gbm_bo_get_plane_count(PSTORAGE->bo);
+
+        auto      params = makeShared<CCZwpLinuxBufferParamsV1>(g_pPortalManager->m_sWaylandConnection.linuxDmabuf->sendCreateParams());
+        if (!params) {
+            Debug::log(ERR, "[pw] zwp_linux_dmabuf_v1_create_params failed");
+            return nullptr;
+        }
+
+        // planeCount only counts the fds we got, so the destructor closes exactly those if we bail
+        for (size_t plane = 0; plane < (size_t)PLANECOUNT; plane++) {
+            PSTORAGE->size[plane]   = 0;
+            PSTORAGE->stride[plane] = gbm_bo_get_stride_for_plane(PSTORAGE->bo, plane);
+            PSTORAGE->offset[plane] = gbm_bo_get_offset(PSTORAGE->bo, plane);
+            uint64_t mod            = gbm_bo_get_modifier(PSTORAGE->bo);
+            PSTORAGE->fd[plane]     = gbm_bo_get_fd_for_plane(PSTORAGE->bo, plane);
+
+            if (PSTORAGE->fd[plane] < 0) {
+                Debug::log(ERR, "[pw] gbm_bo_get_fd_for_plane failed");
+                return nullptr;
+            }
+
+            PSTORAGE->planeCount = plane + 1;
+
+            params->sendAdd(PSTORAGE->fd[plane], plane, PSTORAGE->offset[plane], PSTORAGE->stride[plane], mod >> 32, mod & 0xffffffff);
+        }
+
+        PSTORAGE->wlBuffer = makeShared<CCWlBuffer>(params->sendCreateImmed(PSTORAGE->w, PSTORAGE->h, PSTORAGE->fmt, /* flags */ (zwpLinuxBufferParamsV1Flags)0));
+        params.reset();
+
+        if (!PSTORAGE->wlBuffer) {
+            Debug::log(ERR, "[pw] zwp_linux_buffer_params_v1_create_immed failed");
+            return nullptr;
+        }
+
+        // a dmabuf's size is what seeking to its end says, the planes' strides don't account for tiling or compression
+        const off_t SIZE = lseek(PSTORAGE->fd[0], 0, SEEK_END);
+        PSTORAGE->bytes  = SIZE > 0 ? SIZE : (uint64_t)PSTORAGE->stride[0] * PSTORAGE->h;
+        PSTORAGE->device = pStream->device;
+    } else {
+
+        PSTORAGE->w   = pStream->pSession->sharingData.frameInfoSHM.w;
+        PSTORAGE->h   = pStream->pSession->sharingData.frameInfoSHM.h;
+        PSTORAGE->fmt = pStream->pSession->sharingData.frameInfoSHM.fmt;
+
+        PSTORAGE->size[0]   = pStream->pSession->sharingData.frameInfoSHM.size;
+        PSTORAGE->stride[0] = pStream->pSession->sharingData.frameInfoSHM.stride;
+        PSTORAGE->offset[0] = 0;
+
+        const auto ALLOC = anonymous_shm_alloc(PSTORAGE->size[0], shmHugepages());
+
+        if (ALLOC.fd == -1) {
+            Debug::log(ERR, "[screencopy] anonymous_shm_alloc failed");
+            return nullptr;
+        }
+
+        PSTORAGE->fd[0]      = ALLOC.fd;
+        PSTORAGE->map        = ALLOC.map;
+        PSTORAGE->capacity   = ALLOC.capacity;
+        PSTORAGE->bytes      = ALLOC.capacity;
+        PSTORAGE->planeCount = 1;
+
+        // the pool spans the whole memfd, so a later negotiation to anything that fits can reuse it
+        PSTORAGE->shmPool = import_wl_shm_pool(PSTORAGE->fd[0], PSTORAGE->capacity);
+        if (!PSTORAGE->shmPool) {
+            Debug::log(ERR, "[screencopy] import_wl_shm_pool failed");
+            return nullptr;
+        }
+
+        PSTORAGE->wlBuffer = makeShared<CCWlBuffer>(PSTORAGE->shmPool->sendCreateBuffer(0, PSTORAGE->w, PSTORAGE->h, PSTORAGE->stride[0], wlSHMFromDrmFourcc(PSTORAGE->fmt)));
+        if (!PSTORAGE->wlBuffer) {
+            Debug::log(ERR, "[screencopy] wl_shm_pool_create_buffer failed");
+            return nullptr;
+        }
+    }
+
+    return PSTORAGE;
+}
 
-    if (!PBUFFER)
-        return;
+bool CPipewireConnection::probeModifier(CPipewireConnection::SPWStream* pStream, const uint64_t* mods, uint32_t modCount, uint64_t* modifier) {
+    const auto&    INFO = pStream->pSession->sharingData.frameInfoDMA;
 
-    if (PSTREAM->currentPWBuffer == PBUFFER)
-        PSTREAM->currentPWBuffer = nullptr;
+    SModifierProbe probe;
+    probe.device  = pStream->gbm;
+    probe.fourcc  = INFO.fmt;
+    probe.wBucket = INFO.w / XDPH_MOD_PROBE_BUCKET;
+    probe.hBucket = INFO.h / XDPH_MOD_PROBE_BUCKET;
+    probe.mods    = {mods, mods + modCount};
 
-    if (PBUFFER->isDMABUF)
-        gbm_bo_destroy(PBUFFER->bo);
+    const auto IT = std::ranges::find_if(m_dModifierProbes, [&](const auto& other) {
+        return other.device == probe.device && other.fourcc == probe.fourcc && other.wBucket == probe.wBucket && other.hBucket == probe.hBucket && other.mods == probe.mods;
+    });
 
-    PBUFFER->wlBuffer.reset();
-    for (int plane = 0; plane < PBUFFER->planeCount; plane++) {
-        close(PBUFFER->fd[plane]);
+    if (IT != m_dModifierProbes.end()) {
+        Debug::log(TRACE, "[pw] probeModifier: cached modifier {} for format {}", IT->modifier, INFO.fmt);
+        *modifier = IT->modifier;
+        return true;
     }
 
-    for (uint32_t plane = 0; plane < buffer->buffer->n_datas; plane++) {
-        buffer->buffer->datas[plane].fd = -1;
+    // the allocator picks the modifier, the only way to learn it is a test allocation
+    uint32_t flags = GBM_BO_USE_RENDERING;
+    gbm_bo*  bo    = gbm_bo_create_with_modifiers2(probe.device, INFO.w, INFO.h, INFO.fmt, mods, modCount, flags);
+
+    if (!bo) {
+        Debug::log(TRACE, "[pw] unable to allocate a dmabuf with modifiers. Falling back to the old api");
+        for (uint32_t i = 0; i < modCount && !bo; i++) {
+            switch (mods[i]) {
+                case DRM_FORMAT_MOD_INVALID:
+                    flags = GBM_BO_USE_RENDERING; // ;cast->ctx->state->config->screencast_conf.force_mod_linear ? GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR : GBM_BO_USE_RENDERING;
+                    break;
+                case DRM_FORMAT_MOD_LINEAR: flags = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR; break;
+                default: continue;
+            }
+            bo = gbm_bo_create(probe.device, INFO.w, INFO.h, INFO.fmt, flags);
+        }
     }
 
-    std::erase_if(PSTREAM->buffers, [&](const auto& other) { return other.get() == PBUFFER; });
+    if (!bo)
+        return false;
 
-    buffer->user_data = nullptr;
-}
+    probe.modifier = gbm_bo_get_modifier(bo);
+    gbm_bo_destroy(bo);
 
-static const pw_stream_events pwStreamEvents = {
-    .version       = PW_VERSION_STREAM_EVENTS,
-    .state_changed = pwStreamStateChange,
-    .param_changed = pwStreamParamChanged,
-    .add_buffer    = pwStreamAddBuffer,
-    .remove_buffer = pwStreamRemoveBuffer,
-};
+    *modifier = probe.modifier;
 
-// ------------------------------------------------------- //
+    m_dModifierProbes.emplace_back(std::move(probe));
+    if (m_dModifierProbes.size() > XDPH_MOD_PROBE_CACHE_MAX)
+        m_dModifierProbes.pop_front();
 
-void CPipewireConnection::createStream(CScreencopyPortal::SSession* pSession) {
-    const auto PSTREAM = m_vStreams.emplace_back(std::make_unique<SPWStream>(pSession)).get();
+    return true;
+}
 
-    pw_loop_enter(g_pPortalManager->m_sPipewire.loop);
+void CPipewireConnection::forgetModifier(CPipewireConnection::SPWStream* pStream) {
+    const auto& INFO = pStream->pSession->sharingData.frameInfoDMA;
 
-    uint8_t                 buffer[2][1024];
-    spa_pod_dynamic_builder dynBuilder[2];
-    spa_pod_dynamic_builder_init(&dynBuilder[0], buffer[0], sizeof(buffer[0]), 2048);
-    spa_pod_dynamic_builder_init(&dynBuilder[1], buffer[1], sizeof(buffer[1]), 2048);
+    std::erase_if(m_dModifierProbes, [&](const auto& probe) {
+        return probe.device == pStream->gbm && probe.fourcc == INFO.fmt && probe.wBucket == INFO.w / XDPH_MOD_PROBE_BUCKET &&
+            probe.hBucket == INFO.h / XDPH_MOD_PROBE_BUCKET && probe.modifier == pStream->pwVideoInfo.modifier;
+    });
+}
 
-    const std::string NAME = getRandName("xdph-streaming-");
+SP<SBufferStorage> CPipewireConnection::takePooledStorage(CPipewireConnection::SPWStream* pStream, bool dmabuf) {
+    const auto& DMA = pStream->pSession->sharingData.frameInfoDMA;
+    const auto& SHM = pStream->pSession->sharingData.frameInfoSHM;
 
-    PSTREAM->stream = pw_stream_new(m_pCore, NAME.c_str(), pw_properties_new(PW_KEY_MEDIA_CLASS, "Video/Source", nullptr));
+    auto        IT = m_sBufferPool.idle.end();
 
-    Debug::log(TRACE, "[pw] New stream name {}", NAME);
+    if (dmabuf) {
+        IT = std::ranges::find_if(m_sBufferPool.idle, [&](const auto& storage) {
+            return storage->isDMABUF && storage->w == DMA.w && storage->h == DMA.h && storage->fmt == DMA.fmt && storage->modifier == pStream->pwVideoInfo.modifier &&
+                gbm_bo_get_device(storage->bo) == pStream->gbm;
+        });
+    } else {
+        // the same layout keeps its wl_buffer, otherwise take the smallest memfd the frame fits in
+        for (auto it = m_sBufferPool.idle.begin(); it != m_sBufferPool.idle.end(); ++it) {
+            const auto& STORAGE = *it;
 
-    if (!PSTREAM->stream) {
-        Debug::log(ERR, "[pipewire] refused to create stream");
-        g_pPortalManager->terminate();
-        return;
-    }
+            if (STORAGE->isDMABUF || STORAGE->capacity < SHM.size)
+                continue;
 
-    spa_pod_builder* builder[2] = {&dynBuilder[0].b, &dynBuilder[1].b};
-    const spa_pod*   params[2];
-    const auto       PARAMCOUNT = buildFormatsFor(builder, params, PSTREAM);
+            if (STORAGE->w == SHM.w && STORAGE->h == SHM.h && STORAGE->fmt == SHM.fmt && STORAGE->stride[0] == SHM.stride) {
+                IT = it;
+                break;
+            }
 
-    spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-    spa_pod_dynamic_builder_clean(&dynBuilder[1]);
+            if (IT == m_sBufferPool.idle.end() || STORAGE->capacity < (*IT)->capacity)
+                IT = it;
+        }
+    }
 
-    pw_stream_add_listener(PSTREAM->stream, &PSTREAM->streamListener, &pwStreamEvents, PSTREAM);
+    if (IT == m_sBufferPool.idle.end()) {
+        m_sBufferPool.misses++;
+        return nullptr;
+    }
 
-    pw_stream_connect(PSTREAM->stream, PW_DIRECTION_OUTPUT, PW_ID_ANY, (pw_stream_flags)(PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_ALLOC_BUFFERS), params, PARAMCOUNT);
+    const auto STORAGE = *IT;
+    m_sBufferPool.idle.erase(IT);
+    m_sBufferPool.hits++;
+
+    if (!dmabuf && (STORAGE->w != SHM.w || STORAGE->h != SHM.h || STORAGE->fmt != SHM.fmt || STORAGE->stride[0] != SHM.stride)) {
+        STORAGE->w         = SHM.w;
+        STORAGE->h         = SHM.h;
+        STORAGE->fmt       = SHM.fmt;
+        STORAGE->size[0]   = SHM.size;
+        STORAGE->stride[0] = SHM.stride;
+        STORAGE->wlBuffer  = makeShared<CCWlBuffer>(STORAGE->shmPool->sendCreateBuffer(0, SHM.w, SHM.h, SHM.stride, wlSHMFromDrmFourcc(SHM.fmt)));
+    }
 
-    pSession->sharingData.nodeID         = pw_stream_get_node_id(PSTREAM->stream);
-    pSession->sharingData.pipewireSerial = readObjectSerial(PSTREAM->stream);
+    Debug::log(TRACE, "[pw] buffer pool: {} hits, {} misses, {} evictions, {} idle", m_sBufferPool.hits, m_sBufferPool.misses, m_sBufferPool.evictions,
+               m_sBufferPool.idle.size());
 
-    Debug::log(TRACE, "[pw] Stream got nodeid {} serial {}", pSession->sharingData.nodeID, pSession->sharingData.pipewireSerial);
+    return STORAGE;
 }
 
-void CPipewireConnection::destroyStream(CScreencopyPortal::SSession* pSession) {
-    // Disconnecting the stream can cause reentrance to this function.
-    if (pSession->sharingData.active == false)
+void CPipewireConnection::recycleStorage(SP<SBufferStorage> storage) {
+    if (!storage)
         return;
-    pSession->sharingData.active = false;
-
-    const auto PSTREAM = streamFromSession(pSession);
 
-    if (!PSTREAM || !PSTREAM->stream)
-        return;
+    m_sBufferPool.idle.emplace_front(storage);
 
-    if (!PSTREAM->buffers.empty()) {
-        std::vector<SBuffer*> bufs;
+    if (m_sBufferPool.idle.size() > XDPH_BO_POOL_MAX) {
+        m_sBufferPool.idle.pop_back();
+        m_sBufferPool.evictions++;
+    }
 
-        for (auto& b : PSTREAM->buffers) {
-            bufs.push_back(b.get());
+    // the most recently released shm storages stay within the budget, older ones go
+    size_t shmBytes = 0;
+    for (auto it = m_sBufferPool.idle.begin(); it != m_sBufferPool.idle.end();) {
+        if ((*it)->isDMABUF || shmBytes + (*it)->capacity <= XDPH_SHM_POOL_MAX_BYTES) {
+            shmBytes += (*it)->isDMABUF ? 0 : (*it)->capacity;
+            ++it;
+            continue;
         }
 
-        for (auto& b : bufs) {
-            pwStreamRemoveBuffer(PSTREAM, b->pwBuffer);
-        }
+        it = m_sBufferPool.idle.erase(it);
+        m_sBufferPool.evictions++;
     }
+}
 
-    pw_stream_flush(PSTREAM->stream, false);
-    pw_stream_disconnect(PSTREAM->stream);
-    pw_stream_destroy(PSTREAM->stream);
+CPipewireConnection::SBufferUsage CPipewireConnection::bufferUsage() {
+    SBufferUsage                        usage;
+    std::unordered_set<SBufferStorage*> counted;
 
-    std::erase_if(m_vStreams, [&](const auto& other) { return other.get() == PSTREAM; });
-}
+    for (auto& stream : m_vStreams) {
+        auto& streamBytes = usage.byStream[stream.get()];
 
-static bool wlr_query_dmabuf_modifiers(uint32_t drm_format, uint32_t num_modifiers, uint64_t* modifiers, uint32_t* max_modifiers) {
-    if (g_pPortalManager->m_vDMABUFMods.empty())
-        return false;
+        for (auto& b : stream->buffers) {
+            // the processed copies are the stream's own, the storage may be another one's
+            uint64_t bytes = b->scaleSize + b->convertSize;
+            usage.byDevice[0] += bytes;
 
-    if (num_modifiers == 0) {
-        *max_modifiers = 0;
-        for (auto& mod : g_pPortalManager->m_vDMABUFMods) {
-            if (mod.fourcc == drm_format &&
-                (mod.mod == DRM_FORMAT_MOD_INVALID || gbm_device_get_format_modifier_plane_count(g_pPortalManager->m_sWaylandConnection.gbmDevice, mod.fourcc, mod.mod) > 0))
-                (*max_modifiers)++;
+            if (b->storage && counted.emplace(b->storage.get()).second) {
+                bytes += b->storage->bytes;
+                usage.byDevice[b->storage->isDMABUF ? b->storage->device : 0] += b->storage->bytes;
+            }
+
+            streamBytes += bytes;
+            usage.total += bytes;
         }
-        return true;
     }
 
-    size_t i = 0;
-    for (const auto& mod : g_pPortalManager->m_vDMABUFMods) {
-        if (i >= num_modifiers)
-            break;
-
-        if (mod.fourcc == drm_format &&
-            (mod.mod == DRM_FORMAT_MOD_INVALID || gbm_device_get_format_modifier_plane_count(g_pPortalManager->m_sWaylandConnection.gbmDevice, mod.fourcc, mod.mod) > 0)) {
-            modifiers[i] = mod.mod;
-            ++i;
-        }
+    for (auto& storage : m_sBufferPool.idle) {
+        usage.pooled += storage->bytes;
+        usage.byDevice[storage->isDMABUF ? storage->device : 0] += storage->bytes;
     }
 
-    *max_modifiers = num_modifiers;
-    return true;
-}
+    usage.total += usage.pooled;
 
-static bool build_modifierlist(CPipewireConnection::SPWStream* stream, uint32_t drm_format, uint64_t** modifiers, uint32_t* modifier_count) {
-    if (!wlr_query_dmabuf_modifiers(drm_format, 0, nullptr, modifier_count)) {
-        *modifiers      = NULL;
-        *modifier_count = 0;
-        return false;
-    }
-    if (*modifier_count == 0) {
-        Debug::log(ERR, "[pw] build_modifierlist: no mods");
-        *modifiers = NULL;
-        return true;
-    }
-    *modifiers = (uint64_t*)calloc(*modifier_count, sizeof(uint64_t));
-    bool ret   = wlr_query_dmabuf_modifiers(drm_format, *modifier_count, *modifiers, modifier_count);
-    Debug::log(TRACE, "[pw] build_modifierlist: count {}", *modifier_count);
-    return ret;
+    return usage;
 }
 
-uint32_t CPipewireConnection::buildFormatsFor(spa_pod_builder* b[2], const spa_pod* params[2], CPipewireConnection::SPWStream* stream) {
-    uint32_t            paramCount = 0;
-    uint32_t            modCount   = 0;
-    uint64_t*           modifiers  = nullptr;
+void CPipewireConnection::scheduleBudgetCheck() {
+    static auto* const* PBUDGET = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:buffer_budget_mb")->getDataStaticPtr();
 
-    static auto* const* PFORCESHM = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:force_shm")->getDataStaticPtr();
-    const bool          forceSHM  = **PFORCESHM || stream->dmaBufFailed;
+    if (**PBUDGET <= 0 || m_pBudgetTimer)
+        return;
 
-    if (!forceSHM && build_modifierlist(stream, stream->pSession->sharingData.frameInfoDMA.fmt, &modifiers, &modCount) && modCount > 0) {
-        Debug::log(LOG, "[pw] Building modifiers for dma");
+    // pw is usually in the middle of (re)allocating a stream's buffers when this gets called, renegotiating from there isn't safe
+    m_pBudgetTimer = g_pPortalManager->addTimer({0, [this]() {
+        m_pBudgetTimer.reset();
+        enforceBudget();
+    }});
+}
 
-        paramCount = 2;
-        params[0]  = build_format(b[0], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoDMA.fmt), stream->pSession->sharingData.frameInfoDMA.w,
-                                  stream->pSession->sharingData.frameInfoDMA.h, stream->pSession->sharingData.framerate, modifiers, modCount);
-        assert(params[0] != NULL);
-        params[1] = build_format(b[1], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoSHM.fmt), stream->pSession->sharingData.frameInfoSHM.w,
-                                 stream->pSession->sharingData.frameInfoSHM.h, stream->pSession->sharingData.framerate, NULL, 0);
-        assert(params[1] != NULL);
-    } else {
-        if (stream->dmaBufFailed)
-            Debug::log(WARN, "[pw] DMA-BUF allocation failed, falling back to SHM");
-        else if (forceSHM)
-            Debug::log(LOG, "[pw] DMA-BUF disabled (force_shm), using SHM only");
-        else
-            Debug::log(LOG, "[pw] Building modifiers for shm");
+void CPipewireConnection::enforceBudget() {
+    static auto* const* PBUDGET = (Hyprlang::INT* const*)g_pPortalManager->m_sConfig.config->getConfigValuePtr("screencopy:buffer_budget_mb")->getDataStaticPtr();
+
+    if (**PBUDGET <= 0)
+        return;
+
+    const uint64_t BUDGET = (uint64_t)**PBUDGET * 1024 * 1024;
+    auto           usage  = bufferUsage();
 
-        paramCount = 1;
-        params[0]  = build_format(b[0], pwFromDrmFourcc(stream->pSession->sharingData.frameInfoSHM.fmt), stream->pSession->sharingData.frameInfoSHM.w,
-                                  stream->pSession->sharingData.frameInfoSHM.h, stream->pSession->sharingData.framerate, NULL, 0);
+    if (usage.total > BUDGET && usage.pooled > 0) {
+        Debug::log(LOG, "[pw] buffer budget: {} MiB over {} MiB, dropping {} MiB of pooled buffers", usage.total >> 20, BUDGET >> 20, usage.pooled >> 20);
+        m_sBufferPool.evictions += m_sBufferPool.idle.size();
+        m_sBufferPool.idle.clear();
+        usage = bufferUsage();
     }
 
-    if (modifiers)
-        free(modifiers);
+    if (usage.total > BUDGET) {
+        SPWStream* heaviest = nullptr;
 
-    return paramCount;
-}
+        for (auto& stream : m_vStreams) {
+            if (stream->buffers.size() <= XDPH_PWR_BUFFERS_MIN)
+                continue;
 
-bool CPipewireConnection::buildModListFor(CPipewireConnection::SPWStream* stream, uint32_t drmFmt, uint64_t** mods, uint32_t* modCount) {
-    return true;
-}
+            if (!heaviest || usage.byStream[stream.get()] > usage.byStream[heaviest])
+                heaviest = stream.get();
+        }
 
-CPipewireConnection::SPWStream* CPipewireConnection::streamFromSession(CScreencopyPortal::SSession* pSession) {
-    for (auto& s : m_vStreams) {
-        if (s->pSession == pSession)
-            return s.get();
-    }
-    return nullptr;
-}
+        if (!heaviest) {
+            if (!m_bBudgetExhausted)
+                Debug::log(WARN, "[pw] buffer budget: {} MiB over {} MiB, but every stream is down to {} buffers already", usage.total >> 20, BUDGET >> 20, XDPH_PWR_BUFFERS_MIN);
+            m_bBudgetExhausted = true;
+            return;
+        }
 
-void CPipewireConnection::enqueue(CScreencopyPortal::SSession* pSession) {
-    const auto PSTREAM = streamFromSession(pSession);
+        heaviest->maxBuffers = heaviest->buffers.size() - 1;
 
-    if (!PSTREAM) {
-        Debug::log(ERR, "[pw] Attempted enqueue on invalid session??");
+        Debug::log(LOG, "[pw] buffer budget: {} MiB over {} MiB, stream {} goes down to {} buffers", usage.total >> 20, BUDGET >> 20, (void*)heaviest, heaviest->maxBuffers);
+
+        updateStreamParam(heaviest);
         return;
     }
 
-    Debug::log(TRACE, "[pw] enqueue on {}", (void*)PSTREAM);
+    m_bBudgetExhausted = false;
 
-    if (!PSTREAM->currentPWBuffer) {
-        Debug::log(ERR, "[pipewire] no buffer in enqueue");
-        return;
-    }
+    for (auto& stream : m_vStreams) {
+        if (stream->maxBuffers == XDPH_PWR_BUFFERS_MAX || stream->buffers.empty())
+            continue;
 
-    spa_buffer* spaBuf  = PSTREAM->currentPWBuffer->pwBuffer->buffer;
-    const bool  CORRUPT = PSTREAM->pSession->sharingData.status != FRAME_READY;
-    if (CORRUPT)
-        Debug::log(TRACE, "[pw] buffer corrupt");
+        const uint64_t PERBUFFER = usage.byStream[stream.get()] / stream->buffers.size();
+        const uint64_t MISSING   = stream->sizing.wanted > stream->buffers.size() ? stream->sizing.wanted - stream->buffers.size() : 0;
 
-    Debug::log(TRACE, "[pw] Enqueue data:");
+        if (usage.total + PERBUFFER * MISSING > BUDGET / 4 * 3)
+            continue;
 
-    spa_meta_header* header = (spa_meta_header*)spa_buffer_find_meta_data(spaBuf, SPA_META_Header, sizeof(*header));
-    if (header) {
-        header->pts        = PSTREAM->pSession->sharingData.tvTimestampNs;
-        header->flags      = CORRUPT ? SPA_META_HEADER_FLAG_CORRUPTED : 0;
-        header->seq        = PSTREAM->seq++;
-        header->dts_offset = 0;
-        Debug::log(TRACE, "[pw]  | seq {}", header->seq);
-        Debug::log(TRACE, "[pw]  | pts {}", header->pts);
-    }
+        Debug::log(LOG, "[pw] buffer budget: {} MiB of {} MiB, stream {} is no longer capped", usage.total >> 20, BUDGET >> 20, (void*)stream.get());
 
-    spa_meta_videotransform* vt = (spa_meta_videotransform*)spa_buffer_find_meta_data(spaBuf, SPA_META_VideoTransform, sizeof(*vt));
-    if (vt) {
-        vt->transform = pSession->sharingData.transform;
-        Debug::log(TRACE, "[pw]  | meta transform {}", vt->transform);
+        stream->maxBuffers = XDPH_PWR_BUFFERS_MAX;
+        updateStreamParam(stream.get());
+        return;
     }
+}
 
-    spa_meta* damage = spa_buffer_find_meta(spaBuf, SPA_META_VideoDamage);
-    if (damage) {
-        Debug::log(TRACE, "[pw]  | meta has damage");
+SP<SBufferStorage> CPipewireConnection::findSharedStorage(CPipewireConnection::SPWStream* pStream, bool dmabuf) {
+    const auto PSOURCE = pStream->pSession->captureSource.lock();
 
-        spa_region* damageRegion  = (spa_region*)spa_meta_first(damage);
-        uint32_t    damageCounter = 0;
-        do {
-            if (damageCounter >= pSession->sharingData.damageCount) {
-                *damageRegion = SPA_REGION(0, 0, 0, 0);
-                Debug::log(TRACE, "[pw]  | end damage @ {}: {} {} {} {}", damageCounter, damageRegion->position.x, damageRegion->position.y, damageRegion->size.width,
-                           damageRegion->size.height);
-                break;
-            }
+    if (!PSOURCE)
+        return nullptr;
 
-            *damageRegion = SPA_REGION(pSession->sharingData.damage[damageCounter].x, pSession->sharingData.damage[damageCounter].y, pSession->sharingData.damage[damageCounter].w,
-                                       pSession->sharingData.damage[damageCounter].h);
-            Debug::log(TRACE, "[pw]  | damage @ {}: {} {} {} {}", damageCounter, damageRegion->position.x, damageRegion->position.y, damageRegion->size.width,
-                       damageRegion->size.height);
-            damageCounter++;
-        } while (spa_meta_check(damageRegion + 1, damage) && damageRegion++);
+    const auto& INFO   = pStream->pSession->sharingData;
+    const auto  W      = dmabuf ? INFO.frameInfoDMA.w : INFO.frameInfoSHM.w;
+    const auto  H      = dmabuf ? INFO.frameInfoDMA.h : INFO.frameInfoSHM.h;
+    const auto  FMT    = dmabuf ? INFO.frameInfoDMA.fmt : INFO.frameInfoSHM.fmt;
 
-        if (damageCounter < pSession->sharingData.damageCount) {
-            // TODO: merge damage properly
-            *damageRegion = SPA_REGION(0, 0, pSession->sharingData.frameInfoDMA.w, pSession->sharingData.frameInfoDMA.h);
-            Debug::log(TRACE, "[pw]  | damage overflow, damaged whole");
-        }
-    }
+    for (auto& s : PSOURCE->sessions) {
+        const auto PSTREAM = s == pStream->pSession ? nullptr : streamFromSession(s);
 
-    spa_data* datas = spaBuf->datas;
+        if (!PSTREAM)
+            continue;
 
-    Debug::log(TRACE, "[pw]  | size {}x{}", PSTREAM->pSession->sharingData.frameInfoDMA.w, PSTREAM->pSession->sharingData.frameInfoDMA.h);
+        for (auto& b : PSTREAM->buffers) {
+            const auto& STORAGE = b->storage;
 
-    for (uint32_t plane = 0; plane < spaBuf->n_datas; plane++) {
-        datas[plane].chunk->flags = CORRUPT ? SPA_CHUNK_FLAG_CORRUPTED : SPA_CHUNK_FLAG_NONE;
+            if (!STORAGE || STORAGE->isDMABUF != dmabuf || STORAGE->w != W || STORAGE->h != H || STORAGE->fmt != FMT)
+                continue;
 
-        Debug::log(TRACE, "[pw]  | plane {}", plane);
-        Debug::log(TRACE, "[pw]     | fd {}", datas[plane].fd);
-        Debug::log(TRACE, "[pw]     | maxsize {}", datas[plane].maxsize);
-        Debug::log(TRACE, "[pw]     | size {}", datas[plane].chunk->size);
-        Debug::log(TRACE, "[pw]     | stride {}", datas[plane].chunk->stride);
-        Debug::log(TRACE, "[pw]     | offset {}", datas[plane].chunk->offset);
-        Debug::log(TRACE, "[pw]     | flags {}", datas[plane].chunk->flags);
-    }
+            if (dmabuf && (STORAGE->modifier != pStream->pwVideoInfo.modifier || gbm_bo_get_device(STORAGE->bo) != pStream->gbm))
+                continue;
 
-    Debug::log(TRACE, "[pw] --------------------------------- End enqueue");
+            if (!dmabuf && (STORAGE->stride[0] != INFO.frameInfoSHM.stride || STORAGE->size[0] != INFO.frameInfoSHM.size))
+                continue;
+
+            // at most one alias per stream, a single copy can't land in two of its buffers
+            if (std::ranges::any_of(pStream->buffers, [&](const auto& other) { return other->storage == STORAGE; }))
+                continue;
 
-    pw_stream_queue_buffer(PSTREAM->stream, PSTREAM->currentPWBuffer->pwBuffer);
+            return STORAGE;
+        }
+    }
 
-    PSTREAM->currentPWBuffer = nullptr;
+    return nullptr;
 }
 
-void CPipewireConnection::dequeue(CScreencopyPortal::SSession* pSession) {
-    const auto PSTREAM = streamFromSession(pSession);
+std::unique_ptr<SBuffer> CPipewireConnection::createBuffer(CPipewireConnection::SPWStream* pStream, bool dmabuf) {
+    Debug::log(TRACE, "[pw] createBuffer: type {}", dmabuf ? "dma" : "shm");
 
-    if (!PSTREAM) {
-        Debug::log(ERR, "[pw] Attempted dequeue on invalid session??");
-        return;
-    }
+    auto storage = findSharedStorage(pStream, dmabuf);
+    if (storage)
+        Debug::log(TRACE, "[pw] createBuffer: aliasing storage {} of another stream on the same capture source", (void*)storage.get());
+    else if ((storage = takePooledStorage(pStream, dmabuf)))
+        Debug::log(TRACE, "[pw] createBuffer: reusing pooled storage {}", (void*)storage.get());
+    else
+        storage = createStorage(pStream, dmabuf);
 
-    Debug::log(TRACE, "[pw] dequeue on {}", (void*)PSTREAM);
+    if (!storage)
+        return nullptr;
 
-    const auto PWBUF = pw_stream_dequeue_buffer(PSTREAM->stream);
+    std::unique_ptr<SBuffer> pBuffer = std::make_unique<SBuffer>();
 
-    if (!PWBUF) {
-        Debug::log(TRACE, "[pw] dequeue failed");
-        PSTREAM->currentPWBuffer = nullptr;
-        return;
+    pBuffer->isDMABUF   = dmabuf;
+    pBuffer->w          = storage->w;
+    pBuffer->h          = storage->h;
+    pBuffer->fmt        = storage->fmt;
+    pBuffer->planeCount = storage->planeCount;
+    pBuffer->storage    = storage;
+
+    if (!dmabuf && (pStream->convertFormat != SPA_VIDEO_FORMAT_UNKNOWN || pStream->scale > 1))
+        return initProcessedBuffer(pStream, pBuffer.get()) ? std::move(pBuffer) : nullptr;
+
+    for (int plane = 0; plane < storage->planeCount; plane++) {
+        pBuffer->size[plane]   = storage->size[plane];
+        pBuffer->stride[plane] = storage->stride[plane];
+        pBuffer->offset[plane] = storage->offset[plane];
+        pBuffer->fd[plane]     = fcntl(storage->fd[plane], F_DUPFD_CLOEXEC, 0);
+
+        if (pBuffer->fd[plane] < 0) {
+            Debug::log(ERR, "[pw] createBuffer: dup failed");
+            for (int plane_tmp = 0; plane_tmp < plane; plane_tmp++) {
+                close(pBuffer->fd[plane_tmp]);
+            }
+            return nullptr;
+        }
     }
 
-    const auto PBUF = (SBuffer*)PWBUF->user_data;
-
-    PSTREAM->currentPWBuffer = PBUF;
+    return pBuffer;
 }
 
-std::unique_ptr<SBuffer> CPipewireConnection::createBuffer(CPipewireConnection::SPWStream* pStream, bool dmabuf) {
-    std::unique_ptr<SBuffer> pBuffer = std::make_unique<SBuffer>();
+// a memfd of at least size, mapped. size is updated to what was mapped, the fd is the caller's to close.
+static uint8_t* mapMemfd(uint32_t* size, int* fd) {
+    const auto ALLOC = anonymous_shm_alloc(*size, shmHugepages());
 
-    pBuffer->isDMABUF = dmabuf;
+    *fd = ALLOC.fd;
+    if (*fd == -1) {
+        Debug::log(ERR, "[pw] mapMemfd: anonymous_shm_alloc failed");
+        return nullptr;
+    }
 
-    Debug::log(TRACE, "[pw] createBuffer: type {}", dmabuf ? "dma" : "shm");
+    *size = ALLOC.capacity;
+    return ALLOC.map;
+}
 
-    if (dmabuf) {
-        pBuffer->w   = pStream->pSession->sharingData.frameInfoDMA.w;
-        pBuffer->h   = pStream->pSession->sharingData.frameInfoDMA.h;
-        pBuffer->fmt = pStream->pSession->sharingData.frameInfoDMA.fmt;
+bool CPipewireConnection::initProcessedBuffer(CPipewireConnection::SPWStream* pStream, SBuffer* pBuffer) {
+    pBuffer->w          = pBuffer->storage->w / pStream->scale;
+    pBuffer->h          = pBuffer->storage->h / pStream->scale;
+    pBuffer->planeCount = 0;
 
-        uint32_t flags = GBM_BO_USE_RENDERING;
+    SYUVLayout layout;
+    int        scaleFD = -1, convertFD = -1;
 
-        if (pStream->pwVideoInfo.modifier != DRM_FORMAT_MOD_INVALID) {
-            uint64_t* mods = (uint64_t*)&pStream->pwVideoInfo.modifier;
-            pBuffer->bo    = gbm_bo_create_with_modifiers2(g_pPortalManager->m_sWaylandConnection.gbmDevice, pBuffer->w, pBuffer->h, pBuffer->fmt, mods, 1, flags);
-        } else {
-            pBuffer->bo = gbm_bo_create(g_pPortalManager->m_sWaylandConnection.gbmDevice, pBuffer->w, pBuffer->h, pBuffer->fmt, flags);
-        }
+    if (pStream->scale > 1) {
+        layout.planes    = 1;
+        layout.stride[0] = pBuffer->w * 4;
+        layout.size[0] = layout.total = layout.stride[0] * pBuffer->h;
 
-        if (!pBuffer->bo) {
-            Debug::log(ERR, "[pw] Couldn't create a drm buffer");
-            return nullptr;
-        }
+        pBuffer->scaleSize = layout.total;
+        if (!(pBuffer->scaleMap = mapMemfd(&pBuffer->scaleSize, &scaleFD)))
+            return false;
+    }
 
-        pBuffer->planeCount = gbm_bo_get_plane_count(pBuffer->bo);
+    if (pStream->convertFormat != SPA_VIDEO_FORMAT_UNKNOWN) {
+        layout = yuvLayoutFor(pStream->convertFormat == SPA_VIDEO_FORMAT_NV12, pBuffer->w, pBuffer->h);
 
-        auto params = makeShared<CCZwpLinuxBufferParamsV1>(g_pPortalManager->m_sWaylandConnection.linuxDmabuf->sendCreateParams());
-        if (!params) {
-            Debug::log(ERR, "[pw] zwp_linux_dmabuf_v1_create_params failed");
-            gbm_bo_destroy(pBuffer->bo);
-            return nullptr;
+        pBuffer->convertSize = layout.total;
+        if (!(pBuffer->convertMap = mapMemfd(&pBuffer->convertSize, &convertFD))) {
+            if (scaleFD >= 0)
+                close(scaleFD);
+            return false;
         }
+    }
 
-        for (size_t plane = 0; plane < (size_t)pBuffer->planeCount; plane++) {
-            pBuffer->size[plane]   = 0;
-            pBuffer->stride[plane] = gbm_bo_get_stride_for_plane(pBuffer->bo, plane);
-            pBuffer->offset[plane] = gbm_bo_get_offset(pBuffer->bo, plane);
-            uint64_t mod           = gbm_bo_get_modifier(pBuffer->bo);
-            pBuffer->fd[plane]     = gbm_bo_get_fd_for_plane(pBuffer->bo, plane);
+    // pw gets the last stage, every plane its own fd as pw closes them one by one
+    const int FD = convertFD >= 0 ? convertFD : scaleFD;
+    bool      ok = true;
 
-            if (pBuffer->fd[plane] < 0) {
-                Debug::log(ERR, "[pw] gbm_bo_get_fd_for_plane failed");
-                params.reset();
-                gbm_bo_destroy(pBuffer->bo);
-                for (size_t plane_tmp = 0; plane_tmp < plane; plane_tmp++) {
-                    close(pBuffer->fd[plane_tmp]);
-                }
-                return NULL;
-            }
+    for (uint32_t plane = 0; plane < layout.planes; plane++) {
+        pBuffer->size[plane]   = layout.size[plane];
+        pBuffer->stride[plane] = layout.stride[plane];
+        pBuffer->offset[plane] = layout.offset[plane];
+        pBuffer->fd[plane]     = fcntl(FD, F_DUPFD_CLOEXEC, 0);
 
-            params->sendAdd(pBuffer->fd[plane], plane, pBuffer->offset[plane], pBuffer->stride[plane], mod >> 32, mod & 0xffffffff);
+        if (pBuffer->fd[plane] < 0) {
+            Debug::log(ERR, "[pw] initProcessedBuffer: dup failed");
+            for (int plane_tmp = 0; plane_tmp < pBuffer->planeCount; plane_tmp++) {
+                close(pBuffer->fd[plane_tmp]);
+            }
+            pBuffer->planeCount = 0;
+            ok                  = false;
+            break;
         }
 
-        pBuffer->wlBuffer = makeShared<CCWlBuffer>(params->sendCreateImmed(pBuffer->w, pBuffer->h, pBuffer->fmt, /* flags */ (zwpLinuxBufferParamsV1Flags)0));
-        params.reset();
+        pBuffer->planeCount = plane + 1;
+    }
 
-        if (!pBuffer->wlBuffer) {
-            Debug::log(ERR, "[pw] zwp_linux_buffer_params_v1_create_immed failed");
-            gbm_bo_destroy(pBuffer->bo);
-            for (size_t plane = 0; plane < (size_t)pBuffer->planeCount; plane++) {
-                close(pBuffer->fd[plane]);
-            }
+    if (scaleFD >= 0)
+        close(scaleFD);
+    if (convertFD >= 0)
+        close(convertFD);
 
-            return nullptr;
-        }
-    } else {
+    return ok;
+}
 
-        pBuffer->w   = pStream->pSession->sharingData.frameInfoSHM.w;
-        pBuffer->h   = pStream->pSession->sharingData.frameInfoSHM.h;
-        pBuffer->fmt = pStream->pSession->sharingData.frameInfoSHM.fmt;
+void CPipewireConnection::processFrame(CPipewireConnection::SPWStream* pStream, SBuffer* pBuffer, const CRegion& damage, uint32_t srcStride) {
+    const auto& STORAGE = pBuffer->storage;
 
-        pBuffer->planeCount = 1;
-        pBuffer->size[0]    = pStream->pSession->sharingData.frameInfoSHM.size;
-        pBuffer->stride[0]  = pStream->pSession->sharingData.frameInfoSHM.stride;
-        pBuffer->offset[0]  = 0;
-        pBuffer->fd[0]      = anonymous_shm_open();
+    if (!m_pConverter)
+        m_pConverter = std::make_unique<CColorConverter>();
 
-        if (pBuffer->fd[0] == -1) {
-            Debug::log(ERR, "[screencopy] anonymous_shm_open failed");
-            return nullptr;
-        }
+    // every stage feeds the next, and only redoes what the damage covers
+    const uint8_t* src = STORAGE->map;
 
-        if (ftruncate(pBuffer->fd[0], pBuffer->size[0]) < 0) {
-            Debug::log(ERR, "[screencopy] ftruncate failed");
-            return nullptr;
-        }
+    if (pBuffer->scaleMap) {
+        const SDownscaleJob JOB = {
+            .src       = src,
+            .srcStride = srcStride,
+            .dst       = pBuffer->scaleMap,
+            .dstStride = pBuffer->w * 4,
+            .factor    = pStream->scale,
+            .w         = pBuffer->w,
+            .h         = pBuffer->h,
+        };
 
-        pBuffer->wlBuffer = import_wl_shm_buffer(pBuffer->fd[0], wlSHMFromDrmFourcc(pStream->pSession->sharingData.frameInfoSHM.fmt), pStream->pSession->sharingData.frameInfoSHM.w,
-                                                 pStream->pSession->sharingData.frameInfoSHM.h, pStream->pSession->sharingData.frameInfoSHM.stride);
-        if (!pBuffer->wlBuffer) {
-            Debug::log(ERR, "[screencopy] import_wl_shm_buffer failed");
-            return nullptr;
-        }
+        m_pConverter->downscale(JOB, damage);
+
+        src       = pBuffer->scaleMap;
+        srcStride = pBuffer->w * 4;
     }
 
-    return pBuffer;
+    if (pBuffer->convertMap) {
+        const SConvertJob JOB = {
+            .src       = src,
+            .srcStride = srcStride,
+            .srcFourcc = STORAGE->fmt,
+            .dst       = pBuffer->convertMap,
+            .layout    = yuvLayoutFor(pStream->convertFormat == SPA_VIDEO_FORMAT_NV12, pBuffer->w, pBuffer->h),
+            .nv12      = pStream->convertFormat == SPA_VIDEO_FORMAT_NV12,
+            .w         = pBuffer->w,
+            .h         = pBuffer->h,
+            .matrix    = pStream->convertMatrix,
+            .fullRange = pStream->convertFullRange,
+        };
+
+        m_pConverter->convert(JOB, pBuffer->scaleMap ? damage.scaledDown(pStream->scale) : damage);
+    }
 }
 
 void CPipewireConnection::updateStreamParam(SPWStream* pStream) {
     Debug::log(TRACE, "[pw] update stream params");
 
-    uint8_t                 paramsBuf[2][1024];
-    spa_pod_dynamic_builder dynBuilder[2];
-    spa_pod_dynamic_builder_init(&dynBuilder[0], paramsBuf[0], sizeof(paramsBuf[0]), 2048);
-    spa_pod_dynamic_builder_init(&dynBuilder[1], paramsBuf[1], sizeof(paramsBuf[1]), 2048);
-    const spa_pod*   params[2];
-
-    spa_pod_builder* builder[2] = {&dynBuilder[0].b, &dynBuilder[1].b};
-    uint32_t         n_params   = buildFormatsFor(builder, params, pStream);
+    SFormatBuilders builders;
+    const spa_pod*  params[6];
+    uint32_t        n_params = buildFormatsFor(builders.b, params, pStream);
 
     pw_stream_update_params(pStream->stream, params, n_params);
-    spa_pod_dynamic_builder_clean(&dynBuilder[0]);
-    spa_pod_dynamic_builder_clean(&dynBuilder[1]);
 }
@@ -11,6 +11,12 @@
 #include "../shared/Session.hpp"
 #include "../dbusDefines.hpp"
 #include <chrono>
+#include <deque>
+#include "../helpers/Timer.hpp"
+#include "../helpers/Region.hpp"
+#include "../shared/StreamProfiles.hpp"
+#include "../shared/ColorConvert.hpp"
+#include "../shared/CursorCapture.hpp"
 
 enum cursorModes {
     HIDDEN   = 1,
@@ -32,23 +38,94 @@ enum frameStatus {
     FRAME_RENEG,
 };
 
+// what paces captures, see screencopy:capture_clock
+enum eCaptureClock {
+    CAPTURE_CLOCK_TIMER = 0, // we drive the graph and capture on our own timer
+    CAPTURE_CLOCK_FOLLOW,    // we follow the graph's driver and capture whenever it asks for a frame
+    CAPTURE_CLOCK_TRIGGER,   // we drive the graph, but only capture once the consumer has a buffer for us
+};
+
 struct pw_context;
 struct pw_core;
 struct pw_stream;
 struct pw_buffer;
 
+// the memory behind a pw buffer. Buffers of streams fed by the same capture source alias the same storage,
+// so one compositor copy fills all of them.
+struct SBufferStorage {
+    ~SBufferStorage();
+
+    bool            isDMABUF = false;
+    uint32_t        w = 0, h = 0, fmt = 0;
+    uint64_t        modifier   = 0;
+    int             planeCount = 0;
+
+    int             fd[4];
+    uint32_t        size[4], stride[4], offset[4];
+
+    gbm_bo*         bo     = nullptr;
+    dev_t           device = 0; // dmabuf only
+
+    // what it takes up in memory, counted against screencopy:buffer_budget_mb
+    uint64_t        bytes = 0;
+
+    SP<CCWlBuffer>  wlBuffer      = nullptr;
+    // see CPipewireConnection::contentBufferFor
+    SP<CCWlBuffer>  contentBuffer = nullptr;
+    uint32_t        contentW      = 0, contentH = 0, contentStride = 0;
+
+    // shm only: the whole memfd, pre-faulted, and the pool a pooled storage makes its next wl_buffer from
+    SP<CCWlShmPool> shmPool  = nullptr;
+    uint8_t*        map      = nullptr;
+    size_t          capacity = 0;
+};
+
 struct SBuffer {
-    bool           isDMABUF = false;
-    uint32_t       w = 0, h = 0, fmt = 0;
-    int            planeCount = 0;
+    ~SBuffer();
+
+    bool                                  isDMABUF = false;
+    uint32_t                              w = 0, h = 0, fmt = 0;
+    int                                   planeCount = 0;
 
-    int            fd[4];
-    uint32_t       size[4], stride[4], offset[4];
+    int                                   fd[4]; // our own dups of the storage's fds, handed to pw
+    uint32_t                              size[4], stride[4], offset[4];
 
-    gbm_bo*        bo = nullptr;
+    SP<SBufferStorage>                    storage  = nullptr;
+    pw_buffer*                            pwBuffer = nullptr;
 
-    SP<CCWlBuffer> wlBuffer = nullptr;
-    pw_buffer*     pwBuffer = nullptr;
+    // damageSeq of the capture whose contents this buffer holds, 0 if unknown
+    uint64_t                              damageSeq = 0;
+
+    // when it was last handed to pw, numbered by the stream's queued frames. 0 once it's back.
+    uint64_t                              queuedSeq = 0;
+    std::chrono::steady_clock::time_point queuedAt;
+
+    // set when the stream downscales or converts, the storage then only holds the compositor's copy.
+    // fd[] point at the last stage: the yuv frame if there is one, else the downscaled one.
+    uint8_t*                              scaleMap    = nullptr;
+    uint32_t                              scaleSize   = 0;
+    uint8_t*                              convertMap  = nullptr;
+    uint32_t                              convertSize = 0;
+};
+
+// a single capture request to the compositor. A session can have several of these in flight,
+// each bound to its own dequeued pw buffer.
+struct SCaptureFrame {
+    SP<CCZwlrScreencopyFrameV1>         frameCallback        = nullptr;
+    SP<CCHyprlandToplevelExportFrameV1> windowFrameCallback  = nullptr;
+    frameStatus                         status               = FRAME_NONE;
+    SBuffer*                            buffer               = nullptr;
+    uint64_t                            tvSec                = 0;
+    uint32_t                            tvNsec               = 0;
+    uint64_t                            tvTimestampNs        = 0;
+    uint64_t                            targetPresentationNs = 0; // predicted vblank it was requested for, 0 if it wasn't aligned
+    CRegion                             damage;
+
+    // window frames copied into a bigger buffer, see screencopy:window_headroom. What the compositor actually fills.
+    uint32_t                            contentW = 0, contentH = 0, contentStride = 0;
+
+    // set on frames a capture source fans out to its other sessions: the frame that is actually being captured
+    WP<SCaptureFrame>                   fanoutOf;
 };
 
 class CPipewireConnection;
@@ -64,6 +141,23 @@ class CScreencopyPortal {
     dbUasv onStart(sdbus::ObjectPath requestHandle, sdbus::ObjectPath sessionHandle, std::string appID, std::string parentWindow,
                    std::unordered_map<std::string, sdbus::Variant> opts);
 
+    struct SSession;
+
+    // one compositor capture feeding every session that shares an output, cursor mode and region.
+    // The first session captures for everyone, the others follow as long as their streams are compatible.
+    struct SCaptureSource {
+        eSelectionType         type = TYPE_INVALID;
+        std::string            output;
+        uint32_t               cursorMode = HIDDEN;
+        uint32_t               x = 0, y = 0, w = 0, h = 0;
+
+        std::vector<SSession*> sessions;
+
+        uint64_t               captures  = 0; // copies requested from the compositor
+        uint64_t               fannedOut = 0; // frames handed to followers
+        uint64_t               missed    = 0; // frames a follower had no free buffer for
+    };
+
     struct SSession {
         std::string                               appid;
         sdbus::ObjectPath                         requestHandle, sessionHandle;
@@ -74,24 +168,38 @@ class CScreencopyPortal {
         std::unique_ptr<SDBusSession>             session;
         SSelectionData                            selection;
         Hyprutils::Memory::CWeakPointer<SSession> self;
+        WP<SCaptureSource>                        captureSource;
 
         void                                      startCopy();
-        void                                      initCallbacks();
+        void                                      initCallbacks(SP<SCaptureFrame> frame);
+        void                                      enqueueReadyFrames();
+        void                                      dropFrame(SCaptureFrame* pFrame);
+        void                                      deliverFrame(SP<SCaptureFrame> frame);
+        void                                      flushMailbox();
+        void                                      deliverHeldFrame();
+        SBuffer*                                  bindBuffer(SP<SCaptureFrame> frame);
+        void                                      fanOutFrame(SCaptureFrame* pFrame);
+        bool                                      followsCaptureSource();
+        std::vector<SSession*>                    captureFollowers();
+        void                                      trackPresentation(SCaptureFrame* pFrame);
+        void                                      updateIdleState(bool damaged);
+        uint32_t                                  captureFramerate();
+        void                                      initCursorCapture();
+        void                                      pollCursor();
+        // swaps the window's size for its bucket's in frameInfo*. pFrame, if any, keeps the window's.
+        void                                      applyWindowHeadroom(SCaptureFrame* pFrame);
 
         struct {
-            bool                                  active              = false;
-            SP<CCZwlrScreencopyFrameV1>           frameCallback       = nullptr;
-            SP<CCHyprlandToplevelExportFrameV1>   windowFrameCallback = nullptr;
-            frameStatus                           status              = FRAME_NONE;
-            uint64_t                              tvSec               = 0;
-            uint32_t                              tvNsec              = 0;
-            uint64_t                              tvTimestampNs       = 0;
-            uint32_t                              nodeID              = 0;
-            uint64_t                              pipewireSerial      = 0;
-            uint32_t                              framerate           = 60;
-            wl_output_transform                   transform           = WL_OUTPUT_TRANSFORM_NORMAL;
-            std::chrono::system_clock::time_point begunFrame          = std::chrono::system_clock::now();
-            uint32_t                              copyRetries         = 0;
+            bool                                  active          = false;
+            std::vector<SP<SCaptureFrame>>        frames; // in flight, oldest first
+            SP<CTimer>                            nextFrameTimer; // pending capture, cancelled when the session goes away
+            uint64_t                              lastTimestampNs = 0;
+            uint32_t                              nodeID          = 0;
+            uint64_t                              pipewireSerial  = 0;
+            uint32_t                              framerate       = 60;
+            wl_output_transform                   transform       = WL_OUTPUT_TRANSFORM_NORMAL;
+            std::chrono::steady_clock::time_point begunFrame      = std::chrono::steady_clock::now();
+            uint32_t                              copyRetries     = 0;
 
             struct {
                 uint32_t w = 0, h = 0, size = 0, stride = 0, fmt = 0;
@@ -102,9 +210,45 @@ class CScreencopyPortal {
             } frameInfoDMA;
 
             struct {
+                uint64_t nextTargetNs = 0; // for the next frame started, set once its capture is due
+                uint64_t lastTargetNs = 0; // predicted vblank the last scheduled capture aims at
+                int64_t  phaseErrorNs = 0; // smoothed distance of presented timestamps from target + phase_offset_us
+            } presentation;
+
+            // region served as a crop of the whole output, see screencopy:region_crop, or a window served as a crop
+            // of its bucket, see headroom. In buffer pixels.
+            struct {
+                bool     enabled = false;
                 uint32_t x = 0, y = 0, w = 0, h = 0;
-            } damage[4];
-            uint32_t damageCount = 0;
+            } crop;
+
+            // window streams negotiated at a bucket bigger than the window, see screencopy:window_headroom.
+            // The window can resize within it without renegotiating.
+            struct {
+                bool     enabled = false;
+                uint32_t w = 0, h = 0;
+            } headroom;
+
+            // latest-frame-wins queueing, see screencopy:mailbox
+            struct {
+                SP<SCaptureFrame> held; // captured, waiting for the consumer to return a buffer
+                uint64_t          droppedFrames = 0;
+            } mailbox;
+
+            // static scene backoff, see screencopy:idle_min_fps
+            struct {
+                uint32_t staticFrames      = 0; // consecutive captures without damage
+                bool     idle              = false;
+                uint64_t idleTransitions   = 0;
+                uint64_t activeTransitions = 0;
+                uint64_t skippedFrames     = 0;
+            } idle;
+
+            // METADATA sessions, polled once a frame period whether frames flow or not
+            struct {
+                std::unique_ptr<CCursorCapture> capture;
+                SP<CTimer>                      pollTimer;
+            } cursor;
         } sharingData;
 
         void onCloseRequest(sdbus::MethodCall&);
@@ -112,7 +256,9 @@ class CScreencopyPortal {
     };
 
     void                                 startFrameCopy(SSession* pSession);
+    void                                 requestFrame(SSession* pSession);
     void                                 queueNextShareFrame(SSession* pSession);
+    void                                 disableRegionCrop(SSession* pSession);
     bool                                 hasToplevelCapabilities();
 
     std::unique_ptr<CPipewireConnection> m_pPipewire;
@@ -122,16 +268,21 @@ class CScreencopyPortal {
 
     std::vector<Hyprutils::Memory::CUniquePointer<SSession>> m_vSessions;
 
+    std::vector<SP<SCaptureSource>>                          m_vCaptureSources;
+
     SSession*                                                getSession(sdbus::ObjectPath& path);
     void                                                     startSharing(SSession* pSession);
+    void                                                     subscribeCaptureSource(SSession* pSession);
+    void                                                     unsubscribeCaptureSource(SSession* pSession);
 
     struct {
         SP<CCZwlrScreencopyManagerV1>         screencopy = nullptr;
         SP<CCHyprlandToplevelExportManagerV1> toplevel   = nullptr;
     } m_sState;
 
-    const sdbus::InterfaceName INTERFACE_NAME = sdbus::InterfaceName{"org.freedesktop.impl.portal.ScreenCast"};
-    const sdbus::ObjectPath    OBJECT_PATH    = sdbus::ObjectPath{"/org/freedesktop/portal/desktop"};
+    const sdbus::InterfaceName INTERFACE_NAME        = sdbus::InterfaceName{"org.freedesktop.impl.portal.ScreenCast"};
+    const sdbus::InterfaceName BUFFERS_INTERFACE_NAME = sdbus::InterfaceName{"org.hyprland.xdph.ScreenCastBuffers"};
+    const sdbus::ObjectPath    OBJECT_PATH           = sdbus::ObjectPath{"/org/freedesktop/portal/desktop"};
 
     friend struct SSession;
 };
@@ -146,33 +297,149 @@ class CPipewireConnection {
     void createStream(CScreencopyPortal::SSession* pSession);
     void destroyStream(CScreencopyPortal::SSession* pSession);
 
-    void enqueue(CScreencopyPortal::SSession* pSession);
-    void dequeue(CScreencopyPortal::SSession* pSession);
+    void     enqueue(CScreencopyPortal::SSession* pSession, SCaptureFrame* pFrame);
+    SBuffer* dequeue(CScreencopyPortal::SSession* pSession);
+    // a buffer with just the cursor meta, if the cursor changed and no frame is going to carry it soon
+    void     enqueueCursor(CScreencopyPortal::SSession* pSession);
 
     struct SPWStream {
         CScreencopyPortal::SSession*          pSession    = nullptr;
         pw_stream*                            stream      = nullptr;
         bool                                  streamState = false;
         spa_hook                              streamListener;
-        SBuffer*                              currentPWBuffer = nullptr;
+        std::vector<SBuffer*>                 freeBuffers; // dequeued from pw, but not bound to a frame
         spa_video_info_raw                    pwVideoInfo;
         uint32_t                              seq           = 0;
         bool                                  isDMA         = false;
         uint32_t                              dmaBufRetries = 0;
         bool                                  dmaBufFailed  = false;
+        eCaptureClock                         clock         = CAPTURE_CLOCK_TIMER;
+        bool                                  mailbox       = false;
+        uint64_t                              starvedCycles = 0; // process cycles skipped because the consumer held every buffer
+        uint64_t                              outOfBuffers  = 0; // captures that found no buffer to go into
+        std::chrono::steady_clock::time_point lastQueued;
+
+        // what the consumer last got in SPA_META_Cursor
+        struct {
+            bool     visible = false;
+            int32_t  x = 0, y = 0;
+            uint64_t serial = 0;
+        } cursorSent;
+
+        // see screencopy:adaptive_buffers and adaptBufferCount
+        struct {
+            bool     enabled = false;
+            uint32_t wanted  = XDPH_PWR_BUFFERS; // the count offered to pw
+            uint64_t queued  = 0;                // frames handed to pw so far
+
+            // this window's
+            uint32_t frames       = 0;
+            uint32_t peakHeld     = 0; // most frames queued after a buffer before the consumer gave it back
+            float    holdMsSum    = 0;
+            uint32_t returns      = 0;
+            uint64_t outOfBuffers = 0; // the stream's count when it started
+
+            uint32_t quietWindows = 0; // in a row that would've done with fewer buffers
+        } sizing;
+
+        // the gpu dmabufs are allocated on, whichever scans the stream's format out if the feedback says so
+        dev_t                                 device = 0;
+        gbm_device*                           gbm    = nullptr;
+
+        // see screencopy:shm_convert. convertFormat is set once the consumer took a yuv format.
+        bool                                  convert          = false;
+        eYUVMatrix                            convertMatrix    = YUV_MATRIX_BT709;
+        bool                                  convertFullRange = false;
+        spa_video_format                      convertFormat    = SPA_VIDEO_FORMAT_UNKNOWN;
+        // by how much shm frames are downscaled, see screencopy:downscale_height. Set by the negotiated size.
+        uint32_t                              scale = 1;
+
+        // the most buffers pw may allocate, lowered while over screencopy:buffer_budget_mb. Wins over sizing.wanted.
+        uint32_t                              maxBuffers = XDPH_PWR_BUFFERS_MAX;
+
+        // what this app negotiated for this target last time, offered before anything else
+        std::string                           profileKey;
+        std::optional<SStreamProfile>         profile;
+
+        // damage of each capture relative to the one before, newest first. Buffers are reused round-robin,
+        // so the damage reported for one is everything since it was last filled.
+        std::deque<CRegion>                   damageHistory;
+        uint64_t                              damageSeq = 0;
+        CRegion                               carriedDamage; // from captures that never made it to pw
 
         std::vector<std::unique_ptr<SBuffer>> buffers;
     };
 
     std::unique_ptr<SBuffer> createBuffer(SPWStream* pStream, bool dmabuf);
+    SP<SBufferStorage>       createStorage(SPWStream* pStream, bool dmabuf);
+    SP<SBufferStorage>       findSharedStorage(SPWStream* pStream, bool dmabuf);
+    SP<SBufferStorage>       takePooledStorage(SPWStream* pStream, bool dmabuf);
+    bool                     probeModifier(SPWStream* pStream, const uint64_t* mods, uint32_t modCount, uint64_t* modifier);
+    void                     forgetModifier(SPWStream* pStream);
+    void                     recycleStorage(SP<SBufferStorage> storage);
     SPWStream*               streamFromSession(CScreencopyPortal::SSession* pSession);
     void                     removeSessionFrameCallbacks(CScreencopyPortal::SSession* pSession);
-    uint32_t                 buildFormatsFor(spa_pod_builder* b[2], const spa_pod* params[2], SPWStream* stream);
+    void                     releaseBuffer(SPWStream* pStream, SBuffer* pBuffer);
+    void                     reclaimBuffers(SPWStream* pStream);
+    uint32_t                 buildFormatsFor(spa_pod_builder* b[6], const spa_pod* params[6], SPWStream* stream);
+    void                     pickDevice(SPWStream* pStream);
+    void                     storeProfile(SPWStream* pStream);
+    void                     onDMABUFFeedbackChanged(const std::vector<uint32_t>& formats);
     void                     updateStreamParam(SPWStream* pStream);
+    bool                     initProcessedBuffer(SPWStream* pStream, SBuffer* pBuffer);
+    void                     processFrame(SPWStream* pStream, SBuffer* pBuffer, const CRegion& damage, uint32_t srcStride);
+    // a wl_buffer over the top left of the storage, for compositors that only copy into buffers of the exact size
+    SP<CCWlBuffer>           contentBufferFor(SP<SBufferStorage> storage, uint32_t w, uint32_t h, uint32_t stride);
+
+    // bytes held by stream buffers and the idle pool. A storage several streams alias counts once, toward the first.
+    struct SBufferUsage {
+        uint64_t                                 total  = 0;
+        uint64_t                                 pooled = 0;
+        std::unordered_map<dev_t, uint64_t>      byDevice; // 0 for shm
+        std::unordered_map<SPWStream*, uint64_t> byStream;
+    };
+    SBufferUsage             bufferUsage();
+    // checks usage against screencopy:buffer_budget_mb once the current pw callbacks are done
+    void                     scheduleBudgetCheck();
+    void                     adaptBufferCount(SPWStream* pStream);
+    void                     onBufferReturned(SPWStream* pStream, SBuffer* pBuffer);
+    // returns whether the consumer gets anything it didn't have yet
+    bool                     fillCursorMeta(SPWStream* pStream, spa_buffer* spaBuf);
 
   private:
     std::vector<std::unique_ptr<SPWStream>> m_vStreams;
 
+    std::unique_ptr<CStreamProfiles>        m_pProfiles;
+
+    // created with the first stream that downscales or converts
+    std::unique_ptr<CColorConverter>        m_pConverter;
+
+    // the modifier the allocator picked for a format, size and offered modifier list, oldest first
+    struct SModifierProbe {
+        gbm_device*           device  = nullptr;
+        uint32_t              fourcc  = 0;
+        uint32_t              wBucket = 0, hBucket = 0;
+        std::vector<uint64_t> mods;
+        uint64_t              modifier = 0;
+    };
+    std::deque<SModifierProbe> m_dModifierProbes;
+
+    // storages no stream uses anymore, most recently released first. Renegotiating to the same size, format
+    // and modifier picks a dmabuf back up instead of allocating and importing a new one. Shm ones are picked
+    // up by anything that fits in their memfd, see takePooledStorage.
+    struct {
+        std::deque<SP<SBufferStorage>> idle;
+        uint64_t                       hits      = 0;
+        uint64_t                       misses    = 0;
+        uint64_t                       evictions = 0;
+    } m_sBufferPool;
+
+    // one step at a time: drop the pool, then take a buffer from the heaviest stream, renegotiating it.
+    // Capped streams get their buffers back once that fits with a quarter of the budget to spare.
+    void                                    enforceBudget();
+    SP<CTimer>                              m_pBudgetTimer;
+    bool                                    m_bBudgetExhausted = false; // every stream is down to XDPH_PWR_BUFFERS_MIN
+
     bool                                    buildModListFor(SPWStream* stream, uint32_t drmFmt, uint64_t** mods, uint32_t* modCount);
 
     pw_context*                             m_pContext = nullptr;
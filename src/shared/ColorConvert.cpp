@@ -0,0 +1,345 @@
+#include "ColorConvert.hpp"
+#include "../helpers/Log.hpp"
+#include "ScreencopyShared.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <libdrm/drm_fourcc.h>
+
+// the row kernels are plain loops, written so the compiler can vectorize them. On x86 we build them for
+// avx2 and sse4.1 as well and pick at load time, aarch64 always has neon.
+#if defined(__x86_64__)
+#define XDPH_CONVERT_CLONES __attribute__((target_clones("avx2", "sse4.1", "default")))
+#else
+#define XDPH_CONVERT_CLONES
+#endif
+
+static constexpr int SHIFT = 16;
+
+static uint32_t      alignUp(uint32_t v, uint32_t a) {
+    return (v + a - 1) / a * a;
+}
+
+SYUVLayout yuvLayoutFor(bool nv12, uint32_t w, uint32_t h) {
+    SYUVLayout layout;
+
+    const uint32_t CW = (w + 1) / 2, CH = (h + 1) / 2;
+
+    layout.stride[0] = alignUp(w, XDPH_PWR_ALIGN);
+    layout.size[0]   = layout.stride[0] * h;
+
+    if (nv12) {
+        layout.planes    = 2;
+        layout.stride[1] = alignUp(CW * 2, XDPH_PWR_ALIGN);
+        layout.size[1]   = layout.stride[1] * CH;
+    } else {
+        layout.planes    = 3;
+        layout.stride[1] = layout.stride[2] = alignUp(CW, XDPH_PWR_ALIGN);
+        layout.size[1] = layout.size[2] = layout.stride[1] * CH;
+    }
+
+    for (uint32_t i = 0; i < layout.planes; ++i) {
+        layout.offset[i] = layout.total;
+        layout.total += alignUp(layout.size[i], XDPH_PWR_ALIGN);
+    }
+
+    return layout;
+}
+
+bool CColorConverter::canConvert(uint32_t fourcc) {
+    switch (fourcc) {
+        case DRM_FORMAT_XRGB8888:
+        case DRM_FORMAT_ARGB8888:
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_ABGR8888: return true;
+        default: return false;
+    }
+}
+
+// one or two rows of luma, and the chroma of the pair. R and B are at byte R and B of each pixel,
+// row1 is row0 again for the last row of an odd height frame.
+template <int R, int B>
+__attribute__((always_inline)) static inline void convertRowPair(const uint8_t* __restrict row0, const uint8_t* __restrict row1, uint8_t* __restrict y0,
+                                                                 uint8_t* __restrict y1, uint8_t* __restrict u, uint8_t* __restrict v, uint32_t uvStep,
+                                                                 uint32_t pixels, const CColorConverter::SCoefficients& c) {
+    const int32_t YR = c.yr, YG = c.yg, YB = c.yb, YADD = c.yAdd;
+    const int32_t UR = c.ur, UG = c.ug, UB = c.ub;
+    const int32_t VR = c.vr, VG = c.vg, VB = c.vb, CADD = c.cAdd;
+
+    for (uint32_t i = 0; i < pixels; ++i) {
+        const uint8_t* p = row0 + i * 4;
+        y0[i]            = std::min((YR * p[R] + YG * p[1] + YB * p[B] + YADD) >> SHIFT, 255);
+    }
+
+    if (y1) {
+        for (uint32_t i = 0; i < pixels; ++i) {
+            const uint8_t* p = row1 + i * 4;
+            y1[i]            = std::min((YR * p[R] + YG * p[1] + YB * p[B] + YADD) >> SHIFT, 255);
+        }
+    }
+
+    // 2x2 sums go in, hence the extra 2 bits of shift
+    const uint32_t PAIRS = pixels / 2;
+    for (uint32_t i = 0; i < PAIRS; ++i) {
+        const uint8_t* a = row0 + i * 8;
+        const uint8_t* b = row1 + i * 8;
+        const int32_t  r = a[R] + a[4 + R] + b[R] + b[4 + R];
+        const int32_t  g = a[1] + a[5] + b[1] + b[5];
+        const int32_t  l = a[B] + a[4 + B] + b[B] + b[4 + B];
+
+        u[i * uvStep] = std::min((UR * r + UG * g + UB * l + CADD) >> (SHIFT + 2), 255);
+        v[i * uvStep] = std::min((VR * r + VG * g + VB * l + CADD) >> (SHIFT + 2), 255);
+    }
+
+    // an odd width leaves one column, it only has itself to average with
+    if (pixels % 2) {
+        const uint8_t* a = row0 + PAIRS * 8;
+        const uint8_t* b = row1 + PAIRS * 8;
+        const int32_t  r = (a[R] + b[R]) * 2;
+        const int32_t  g = (a[1] + b[1]) * 2;
+        const int32_t  l = (a[B] + b[B]) * 2;
+
+        u[PAIRS * uvStep] = std::min((UR * r + UG * g + UB * l + CADD) >> (SHIFT + 2), 255);
+        v[PAIRS * uvStep] = std::min((VR * r + VG * g + VB * l + CADD) >> (SHIFT + 2), 255);
+    }
+}
+
+XDPH_CONVERT_CLONES static void convertRowPairRGB(const uint8_t* row0, const uint8_t* row1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, uint32_t uvStep, uint32_t pixels,
+                                                  const CColorConverter::SCoefficients& c) {
+    convertRowPair<0, 2>(row0, row1, y0, y1, u, v, uvStep, pixels, c);
+}
+
+XDPH_CONVERT_CLONES static void convertRowPairBGR(const uint8_t* row0, const uint8_t* row1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, uint32_t uvStep, uint32_t pixels,
+                                                  const CColorConverter::SCoefficients& c) {
+    convertRowPair<2, 0>(row0, row1, y0, y1, u, v, uvStep, pixels, c);
+}
+
+// a box filter over factor x factor blocks of 32bpp pixels, every channel alike. Rows are summed into acc first,
+// which keeps both passes over contiguous memory. K is the factor if it's known at compile time.
+template <uint32_t K>
+__attribute__((always_inline)) static inline void downscaleRow(const uint8_t* __restrict src, uint32_t srcStride, uint8_t* __restrict dst, uint32_t pixels, uint32_t factor,
+                                                               uint16_t* __restrict acc) {
+    const uint32_t F     = K ? K : factor;
+    const uint32_t AREA  = F * F;
+    const uint32_t BYTES = pixels * F * 4;
+
+    for (uint32_t x = 0; x < BYTES; ++x) {
+        acc[x] = src[x];
+    }
+
+    for (uint32_t dy = 1; dy < F; ++dy) {
+        const uint8_t* row = src + (size_t)dy * srcStride;
+        for (uint32_t x = 0; x < BYTES; ++x) {
+            acc[x] += row[x];
+        }
+    }
+
+    for (uint32_t i = 0; i < pixels; ++i) {
+        for (uint32_t c = 0; c < 4; ++c) {
+            uint32_t sum = 0;
+            for (uint32_t dx = 0; dx < F; ++dx) {
+                sum += acc[(i * F + dx) * 4 + c];
+            }
+            dst[i * 4 + c] = (sum + AREA / 2) / AREA;
+        }
+    }
+}
+
+XDPH_CONVERT_CLONES static void downscaleRow2(const uint8_t* src, uint32_t srcStride, uint8_t* dst, uint32_t pixels, uint32_t factor, uint16_t* acc) {
+    downscaleRow<2>(src, srcStride, dst, pixels, factor, acc);
+}
+
+XDPH_CONVERT_CLONES static void downscaleRow3(const uint8_t* src, uint32_t srcStride, uint8_t* dst, uint32_t pixels, uint32_t factor, uint16_t* acc) {
+    downscaleRow<3>(src, srcStride, dst, pixels, factor, acc);
+}
+
+XDPH_CONVERT_CLONES static void downscaleRowN(const uint8_t* src, uint32_t srcStride, uint8_t* dst, uint32_t pixels, uint32_t factor, uint16_t* acc) {
+    downscaleRow<0>(src, srcStride, dst, pixels, factor, acc);
+}
+
+CColorConverter::CColorConverter() {
+    const auto THREADS = std::clamp<uint32_t>(std::thread::hardware_concurrency(), 1, XDPH_CONVERT_THREADS_MAX);
+
+    // the calling thread takes stripes too
+    for (uint32_t i = 1; i < THREADS; ++i) {
+        m_vWorkers.emplace_back([this] { work(); });
+    }
+
+    Debug::log(LOG, "[convert] Color converter with {} threads", THREADS);
+}
+
+CColorConverter::~CColorConverter() {
+    {
+        std::lock_guard lock(m_mutex);
+        m_bExit = true;
+    }
+    m_cvWork.notify_all();
+
+    for (auto& t : m_vWorkers) {
+        t.join();
+    }
+}
+
+void CColorConverter::work() {
+    uint64_t seen = 0;
+
+    while (true) {
+        {
+            std::unique_lock lock(m_mutex);
+            m_cvWork.wait(lock, [&] { return m_bExit || m_iGeneration != seen; });
+
+            if (m_bExit)
+                return;
+
+            seen = m_iGeneration;
+        }
+
+        runStripes();
+
+        {
+            std::lock_guard lock(m_mutex);
+            if (--m_iBusy == 0)
+                m_cvDone.notify_one();
+        }
+    }
+}
+
+void CColorConverter::runStripes() {
+    for (size_t i = m_iNextStripe++; i < m_vStripes.size(); i = m_iNextStripe++) {
+        m_fnStripe(m_vStripes[i]);
+    }
+}
+
+uint64_t CColorConverter::buildStripes(const CRegion& damage, uint32_t w, uint32_t h) {
+    // mark the dirty tiles, then cut every tile row into runs of them. Tiles don't overlap, so neither do stripes.
+    const uint32_t       COLS = (w + XDPH_CONVERT_TILE - 1) / XDPH_CONVERT_TILE, ROWS = (h + XDPH_CONVERT_TILE - 1) / XDPH_CONVERT_TILE;
+    std::vector<uint8_t> dirty(COLS * ROWS, 0);
+
+    for (const auto& RECT : damage.rects()) {
+        if (RECT.empty() || RECT.x >= w || RECT.y >= h)
+            continue;
+
+        const uint32_t X1 = std::min(RECT.x + RECT.w, w), Y1 = std::min(RECT.y + RECT.h, h);
+
+        for (uint32_t row = RECT.y / XDPH_CONVERT_TILE; row * XDPH_CONVERT_TILE < Y1; ++row) {
+            std::fill(dirty.begin() + row * COLS + RECT.x / XDPH_CONVERT_TILE, dirty.begin() + row * COLS + (X1 + XDPH_CONVERT_TILE - 1) / XDPH_CONVERT_TILE, 1);
+        }
+    }
+
+    m_vStripes.clear();
+    uint64_t pixels = 0;
+
+    for (uint32_t row = 0; row < ROWS; ++row) {
+        for (uint32_t col = 0; col < COLS; ++col) {
+            if (!dirty[row * COLS + col])
+                continue;
+
+            const uint32_t START = col;
+            while (col < COLS && dirty[row * COLS + col]) {
+                col++;
+            }
+
+            const auto& STRIPE = m_vStripes.emplace_back(SStripe{
+                .y0 = row * XDPH_CONVERT_TILE,
+                .y1 = std::min((row + 1) * XDPH_CONVERT_TILE, h),
+                .x0 = START * XDPH_CONVERT_TILE,
+                .x1 = std::min(col * XDPH_CONVERT_TILE, w),
+            });
+
+            pixels += (uint64_t)(STRIPE.y1 - STRIPE.y0) * (STRIPE.x1 - STRIPE.x0);
+        }
+    }
+
+    return pixels;
+}
+
+void CColorConverter::dispatch(uint64_t pixels, std::function<void(const SStripe&)> fn) {
+    m_fnStripe    = std::move(fn);
+    m_iNextStripe = 0;
+
+    // waking the workers costs more than doing a few tiles
+    if (m_vWorkers.empty() || pixels < XDPH_CONVERT_INLINE_PIXELS) {
+        runStripes();
+        m_fnStripe = nullptr;
+        return;
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+        m_iBusy = m_vWorkers.size();
+        m_iGeneration++;
+    }
+    m_cvWork.notify_all();
+
+    runStripes();
+
+    std::unique_lock lock(m_mutex);
+    m_cvDone.wait(lock, [this] { return m_iBusy == 0; });
+
+    m_fnStripe = nullptr;
+}
+
+void CColorConverter::convert(const SConvertJob& job, const CRegion& damage) {
+    const auto PIXELS = buildStripes(damage, job.w, job.h);
+
+    if (m_vStripes.empty())
+        return;
+
+    // full range is plain kr/kb math, limited squeezes luma into 16-235 and chroma into 16-240
+    const double KR = job.matrix == YUV_MATRIX_BT709 ? 0.2126 : 0.299;
+    const double KB = job.matrix == YUV_MATRIX_BT709 ? 0.0722 : 0.114;
+    const double KG = 1.0 - KR - KB;
+    const double YS = job.fullRange ? 1.0 : 219.0 / 255.0;
+    const double CS = job.fullRange ? 1.0 : 224.0 / 255.0;
+    const auto   FP = [](double v) { return (int32_t)std::lround(v * (1 << SHIFT)); };
+
+    const SCoefficients COEFFICIENTS = {
+        .yr   = FP(KR * YS),
+        .yg   = FP(KG * YS),
+        .yb   = FP(KB * YS),
+        .yAdd = ((job.fullRange ? 0 : 16) << SHIFT) + (1 << (SHIFT - 1)),
+        .ur   = FP(-KR / (1.0 - KB) / 2.0 * CS),
+        .ug   = FP(-KG / (1.0 - KB) / 2.0 * CS),
+        .ub   = FP(0.5 * CS),
+        .vr   = FP(0.5 * CS),
+        .vg   = FP(-KG / (1.0 - KR) / 2.0 * CS),
+        .vb   = FP(-KB / (1.0 - KR) / 2.0 * CS),
+        .cAdd = (128 << (SHIFT + 2)) + (1 << (SHIFT + 1)),
+    };
+
+    const auto KERNEL = job.srcFourcc == DRM_FORMAT_XBGR8888 || job.srcFourcc == DRM_FORMAT_ABGR8888 ? convertRowPairRGB : convertRowPairBGR;
+    const auto UVSTEP = job.nv12 ? 2 : 1;
+
+    dispatch(PIXELS, [&](const SStripe& stripe) {
+        for (uint32_t y = stripe.y0; y < stripe.y1; y += 2) {
+            const bool     LASTROW = y + 1 >= job.h;
+            const uint8_t* row0    = job.src + (size_t)y * job.srcStride + stripe.x0 * 4;
+            const uint8_t* row1    = LASTROW ? row0 : row0 + job.srcStride;
+            uint8_t*       y0      = job.dst + job.layout.offset[0] + (size_t)y * job.layout.stride[0] + stripe.x0;
+            uint8_t*       y1      = LASTROW ? nullptr : y0 + job.layout.stride[0];
+            uint8_t*       u       = job.dst + job.layout.offset[1] + (size_t)(y / 2) * job.layout.stride[1] + stripe.x0 / 2 * UVSTEP;
+            uint8_t*       v       = job.nv12 ? u + 1 : job.dst + job.layout.offset[2] + (size_t)(y / 2) * job.layout.stride[2] + stripe.x0 / 2;
+
+            KERNEL(row0, row1, y0, y1, u, v, UVSTEP, stripe.x1 - stripe.x0, COEFFICIENTS);
+        }
+    });
+}
+
+void CColorConverter::downscale(const SDownscaleJob& job, const CRegion& damage) {
+    // every output pixel is a whole factor x factor block, so a damaged source pixel dirties the block it's in
+    const auto PIXELS = buildStripes(damage.scaledDown(job.factor), job.w, job.h);
+
+    if (m_vStripes.empty())
+        return;
+
+    const auto KERNEL = job.factor == 2 ? downscaleRow2 : job.factor == 3 ? downscaleRow3 : downscaleRowN;
+
+    dispatch(PIXELS * job.factor * job.factor, [&](const SStripe& stripe) {
+        std::vector<uint16_t> acc((size_t)(stripe.x1 - stripe.x0) * job.factor * 4);
+
+        for (uint32_t y = stripe.y0; y < stripe.y1; ++y) {
+            KERNEL(job.src + (size_t)y * job.factor * job.srcStride + (size_t)stripe.x0 * job.factor * 4, job.srcStride,
+                   job.dst + (size_t)y * job.dstStride + (size_t)stripe.x0 * 4, stripe.x1 - stripe.x0, job.factor, acc.data());
+        }
+    });
+}
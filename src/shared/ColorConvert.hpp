@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../helpers/Region.hpp"
+
+enum eYUVMatrix {
+    YUV_MATRIX_BT601 = 0,
+    YUV_MATRIX_BT709,
+};
+
+// where the planes of a 4:2:0 frame live in its memfd
+struct SYUVLayout {
+    uint32_t planes = 0;
+    uint32_t offset[3] = {0}, stride[3] = {0}, size[3] = {0};
+    uint32_t total = 0;
+};
+
+// nv12 has one interleaved chroma plane, i420 a plane each for u and v
+SYUVLayout yuvLayoutFor(bool nv12, uint32_t w, uint32_t h);
+
+struct SConvertJob {
+    const uint8_t* src       = nullptr;
+    uint32_t       srcStride = 0;
+    uint32_t       srcFourcc = 0;
+
+    uint8_t*       dst = nullptr;
+    SYUVLayout     layout;
+    bool           nv12 = true;
+
+    uint32_t       w = 0, h = 0;
+    eYUVMatrix     matrix    = YUV_MATRIX_BT709;
+    bool           fullRange = false;
+};
+
+struct SDownscaleJob {
+    const uint8_t* src       = nullptr;
+    uint32_t       srcStride = 0;
+
+    uint8_t*       dst       = nullptr;
+    uint32_t       dstStride = 0;
+
+    uint32_t       factor = 2;
+    uint32_t       w = 0, h = 0; // of dst
+};
+
+// pixel work on shm frames, for consumers that would otherwise all do the same to the same frames themselves:
+// 32bpp rgb to 4:2:0 yuv, and box filtering down by a whole factor. Damage is snapped to tiles of the output,
+// and runs of dirty tiles are spread over a few worker threads.
+class CColorConverter {
+  public:
+    CColorConverter();
+    ~CColorConverter();
+
+    static bool canConvert(uint32_t fourcc);
+
+    // both block until every dirty tile is done. Damage is in source pixels.
+    void        convert(const SConvertJob& job, const CRegion& damage);
+    void        downscale(const SDownscaleJob& job, const CRegion& damage);
+
+    // fixed point, see SHIFT in the implementation
+    struct SCoefficients {
+        int32_t yr = 0, yg = 0, yb = 0, yAdd = 0;
+        int32_t ur = 0, ug = 0, ub = 0;
+        int32_t vr = 0, vg = 0, vb = 0, cAdd = 0;
+    };
+
+  private:
+    // rows [y0, y1) and columns [x0, x1) of a tile row, y0 and x0 even
+    struct SStripe {
+        uint32_t y0 = 0, y1 = 0, x0 = 0, x1 = 0;
+    };
+
+    void                                work();
+    void                                runStripes();
+    // returns the pixels covered
+    uint64_t                            buildStripes(const CRegion& damage, uint32_t w, uint32_t h);
+    void                                dispatch(uint64_t pixels, std::function<void(const SStripe&)> fn);
+
+    std::vector<std::thread>            m_vWorkers;
+    std::mutex                          m_mutex;
+    std::condition_variable             m_cvWork, m_cvDone;
+    bool                                m_bExit       = false;
+    uint64_t                            m_iGeneration = 0;
+    size_t                              m_iBusy       = 0; // workers that haven't finished the current job yet
+
+    // the job in flight
+    std::function<void(const SStripe&)> m_fnStripe;
+    std::vector<SStripe>                m_vStripes;
+    std::atomic<size_t>                 m_iNextStripe = 0;
+};
@@ -0,0 +1,43 @@
+#include "CursorBitmap.hpp"
+
+#include <algorithm>
+
+SCursorBitmap cursorBitmapFromDiff(const uint8_t* with, const uint8_t* without, uint32_t w, uint32_t h, uint32_t stride, bool swapRB, int32_t hotspotX, int32_t hotspotY,
+                                   uint32_t maxSize) {
+    // antialiased edges come out as whatever they blended to
+    std::vector<uint32_t> diff(w * h, 0);
+    uint32_t              minX = w, minY = h, maxX = 0, maxY = 0;
+    for (uint32_t y = 0; y < h; ++y) {
+        const uint32_t* A = (const uint32_t*)(with + y * stride);
+        const uint32_t* B = (const uint32_t*)(without + y * stride);
+        for (uint32_t x = 0; x < w; ++x) {
+            uint32_t px = A[x] & 0xFFFFFF;
+            if (px == (B[x] & 0xFFFFFF))
+                continue;
+
+            if (swapRB)
+                px = (px & 0x00FF00) | ((px & 0xFF) << 16) | ((px >> 16) & 0xFF);
+
+            diff[y * w + x] = 0xFF000000 | px;
+            minX            = std::min(minX, x);
+            minY            = std::min(minY, y);
+            maxX            = std::max(maxX, x);
+            maxY            = std::max(maxY, y);
+        }
+    }
+
+    SCursorBitmap bitmap;
+    if (minX > maxX || minY > maxY)
+        return bitmap;
+
+    bitmap.w        = std::min<uint32_t>(maxX - minX + 1, maxSize);
+    bitmap.h        = std::min<uint32_t>(maxY - minY + 1, maxSize);
+    bitmap.hotspotX = hotspotX - (int32_t)minX;
+    bitmap.hotspotY = hotspotY - (int32_t)minY;
+    bitmap.pixels.resize(bitmap.w * bitmap.h);
+    for (uint32_t y = 0; y < bitmap.h; ++y) {
+        std::copy_n(diff.begin() + (minY + y) * w + minX, bitmap.w, bitmap.pixels.begin() + y * bitmap.w);
+    }
+
+    return bitmap;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+struct SCursorBitmap {
+    uint32_t              w = 0, h = 0;
+    int32_t               hotspotX = 0, hotspotY = 0;
+    std::vector<uint32_t> pixels; // argb8888, w * h. Empty when there's no cursor.
+};
+
+// the cursor out of two 32-bit captures of the same box, with and without it: whatever differs, opaque, cropped to
+// where it differs and capped at maxSize a side. swapRB for the xbgr formats. hotspot is where the pointer was in the
+// box, in its pixels.
+SCursorBitmap cursorBitmapFromDiff(const uint8_t* with, const uint8_t* without, uint32_t w, uint32_t h, uint32_t stride, bool swapRB, int32_t hotspotX, int32_t hotspotY,
+                                   uint32_t maxSize);
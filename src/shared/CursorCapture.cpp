@@ -0,0 +1,332 @@
+#include "CursorCapture.hpp"
+#include "CursorBitmap.hpp"
+#include "../helpers/Log.hpp"
+#include "../helpers/MiscFunctions.hpp"
+#include "../core/PortalManager.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <libdrm/drm_fourcc.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+CCursorCapture::CCursorCapture(SP<CCZwlrScreencopyManagerV1> manager, const std::string& output, uint32_t areaX, uint32_t areaY, uint32_t areaW, uint32_t areaH,
+                               std::function<void()> onUpdate) :
+    m_pManager(manager), m_szOutput(output), m_iAreaX(areaX), m_iAreaY(areaY), m_iAreaW(areaW), m_iAreaH(areaH), m_fnOnUpdate(onUpdate) {
+    ;
+}
+
+CCursorCapture::~CCursorCapture() {
+    finishRequest();
+    releaseShots();
+}
+
+const CCursorCapture::SState& CCursorCapture::state() const {
+    return m_sState;
+}
+
+bool CCursorCapture::idle() const {
+    return std::chrono::steady_clock::now() - m_lastMoved >= std::chrono::milliseconds(XDPH_CURSOR_IDLE_AFTER_MS);
+}
+
+void CCursorCapture::poll() {
+    m_vRetiredFrames.clear();
+
+    const auto NOW = std::chrono::steady_clock::now();
+
+    // a stuck compositor gets one request, not one per poll
+    if (m_sRequest.fd >= 0) {
+        if (NOW - m_sRequest.sent < std::chrono::milliseconds(XDPH_CURSOR_IPC_TIMEOUT_MS))
+            return;
+
+        finishRequest();
+        onIPCFailed();
+    }
+
+    if (m_sOutput.valid && NOW - m_sOutput.queried < std::chrono::milliseconds(XDPH_CURSOR_OUTPUT_QUERY_MS))
+        sendRequest("cursorpos");
+    else
+        sendRequest("monitors");
+}
+
+void CCursorCapture::sendRequest(const std::string& request) {
+    m_sRequest.fd = hyprlandRequestAsync(request);
+
+    if (m_sRequest.fd < 0 || !g_pPortalManager->addFD(m_sRequest.fd, [this]() { onReadable(); })) {
+        if (m_sRequest.fd >= 0)
+            close(m_sRequest.fd);
+        m_sRequest.fd = -1;
+        onIPCFailed();
+        return;
+    }
+
+    m_sRequest.monitors = request == "monitors";
+    m_sRequest.sent     = std::chrono::steady_clock::now();
+    m_sRequest.reply.clear();
+}
+
+void CCursorCapture::finishRequest() {
+    if (m_sRequest.fd < 0)
+        return;
+
+    g_pPortalManager->removeFD(m_sRequest.fd);
+    close(m_sRequest.fd);
+    m_sRequest.fd = -1;
+}
+
+void CCursorCapture::onReadable() {
+    char    buffer[8192];
+    ssize_t len = 0;
+    while ((len = read(m_sRequest.fd, buffer, sizeof(buffer))) > 0) {
+        m_sRequest.reply.append(buffer, len);
+    }
+
+    // Hyprland closes the socket once it's said everything
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    finishRequest();
+
+    if (len < 0) {
+        onIPCFailed();
+        return;
+    }
+
+    if (!m_sRequest.monitors) {
+        updatePosition(m_sRequest.reply);
+        return;
+    }
+
+    m_sOutput.queried = std::chrono::steady_clock::now();
+    m_sOutput.valid   = parseOutput(m_sRequest.reply);
+
+    if (!m_sOutput.valid) {
+        onIPCFailed();
+        return;
+    }
+
+    sendRequest("cursorpos");
+}
+
+void CCursorCapture::onIPCFailed() {
+    if (!m_bIPCFailed)
+        Debug::log(WARN, "[screencopy] couldn't get the cursor position from Hyprland, cursor metadata won't be sent");
+    m_bIPCFailed = true;
+
+    if (!m_sState.visible)
+        return;
+
+    m_sState.visible = false;
+    m_fnOnUpdate();
+}
+
+bool CCursorCapture::parseOutput(const std::string& reply) {
+    // Monitor DP-1 (ID 0):
+    //     2560x1440@143.97200 at 0x0
+    //     ...
+    //     scale: 1.25
+    //     transform: 0
+    std::istringstream stream(reply);
+    std::string        line;
+    bool               inOutput = false, gotMode = false, gotScale = false, gotTransform = false;
+    uint32_t           pixelW = 0, pixelH = 0;
+    while (std::getline(stream, line)) {
+        if (line.starts_with("Monitor ")) {
+            if (inOutput)
+                break;
+            inOutput = line.starts_with("Monitor " + m_szOutput + " (");
+            continue;
+        }
+
+        if (!inOutput)
+            continue;
+
+        float   refresh = 0, scale = 0;
+        int32_t x = 0, y = 0, transform = 0;
+        if (!gotMode && sscanf(line.c_str(), " %ux%u@%f at %dx%d", &pixelW, &pixelH, &refresh, &x, &y) == 5) {
+            m_sOutput.x = x;
+            m_sOutput.y = y;
+            gotMode     = true;
+        } else if (sscanf(line.c_str(), " scale: %f", &scale) == 1 && scale > 0) {
+            // printed with two decimals, but scales are always in 120ths
+            m_sOutput.scale = std::round(scale * 120.0) / 120.0;
+            gotScale        = true;
+        } else if (sscanf(line.c_str(), " transform: %d", &transform) == 1) {
+            m_sOutput.transform = transform;
+            gotTransform        = true;
+        }
+    }
+
+    if (!gotMode || !gotScale || !gotTransform)
+        return false;
+
+    m_sOutput.w = std::round(pixelW / m_sOutput.scale);
+    m_sOutput.h = std::round(pixelH / m_sOutput.scale);
+    return true;
+}
+
+void CCursorCapture::updatePosition(const std::string& reply) {
+    int32_t globalX = 0, globalY = 0;
+
+    if (sscanf(reply.c_str(), "%d, %d", &globalX, &globalY) != 2) {
+        onIPCFailed();
+        return;
+    }
+
+    m_bIPCFailed = false;
+
+    const auto     PREVIOUS = m_sState;
+    const uint32_t AREAW    = m_iAreaW ? m_iAreaW : m_sOutput.w;
+    const uint32_t AREAH    = m_iAreaH ? m_iAreaH : m_sOutput.h;
+    // relative to the output, logical
+    const double   LOCALX = globalX - m_sOutput.x;
+    const double   LOCALY = globalY - m_sOutput.y;
+
+    // the rotated cases would need the bitmap and hotspot turned too, skip them
+    m_sState.visible = m_sOutput.transform == 0 && LOCALX >= m_iAreaX && LOCALY >= m_iAreaY && LOCALX < m_iAreaX + AREAW && LOCALY < m_iAreaY + AREAH;
+    m_sState.x       = std::lround((LOCALX - m_iAreaX) * m_sOutput.scale);
+    m_sState.y       = std::lround((LOCALY - m_iAreaY) * m_sOutput.scale);
+
+    const bool MOVED = m_sState.visible != PREVIOUS.visible || (m_sState.visible && (m_sState.x != PREVIOUS.x || m_sState.y != PREVIOUS.y));
+    m_bMoved         = m_bMoved || MOVED;
+
+    if (MOVED)
+        m_lastMoved = std::chrono::steady_clock::now();
+
+    if (m_sState.visible && !m_bCapturing) {
+        const auto SINCEBITMAP = std::chrono::steady_clock::now() - m_lastBitmap;
+        if ((m_bMoved && SINCEBITMAP >= std::chrono::milliseconds(XDPH_CURSOR_REFRESH_MS)) || SINCEBITMAP >= std::chrono::milliseconds(XDPH_CURSOR_IDLE_REFRESH_MS))
+            captureBitmap(LOCALX, LOCALY);
+    }
+
+    m_fnOnUpdate();
+}
+
+void CCursorCapture::captureBitmap(double x, double y) {
+    const auto POUTPUT = g_pPortalManager->getOutputFromName(m_szOutput);
+    if (!POUTPUT || !m_pManager)
+        return;
+
+    // the box stays on the output, the pointer just ends up further into it near the edges
+    const int32_t BOXW = std::min<int32_t>(XDPH_CURSOR_BOX, m_sOutput.w);
+    const int32_t BOXH = std::min<int32_t>(XDPH_CURSOR_BOX, m_sOutput.h);
+    const int32_t BOXX = std::clamp<int32_t>((int32_t)x - XDPH_CURSOR_BOX_HOTSPOT, 0, m_sOutput.w - BOXW);
+    const int32_t BOXY = std::clamp<int32_t>((int32_t)y - XDPH_CURSOR_BOX_HOTSPOT, 0, m_sOutput.h - BOXH);
+
+    if (BOXW <= 0 || BOXH <= 0)
+        return;
+
+    m_fBoxHotspotX = x - BOXX;
+    m_fBoxHotspotY = y - BOXY;
+    m_bCapturing   = true;
+    m_bMoved       = false;
+    m_lastBitmap   = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < 2; ++i) {
+        m_sShots[i].frame = makeShared<CCZwlrScreencopyFrameV1>(m_pManager->sendCaptureOutputRegion(i == 0 ? 1 : 0, POUTPUT->output->resource(), BOXX, BOXY, BOXW, BOXH));
+        initShot(m_sShots[i], i == 0);
+    }
+}
+
+void CCursorCapture::initShot(SShot& shot, bool withCursor) {
+    // the frames go away with us, so nothing fires after we're gone. Retired ones can still fire until the next poll.
+    shot.frame->setBuffer([this, &shot](CCZwlrScreencopyFrameV1* r, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+        if (shot.frame.get() != r)
+            return;
+
+        shot.fmt    = drmFourccFromSHM((wl_shm_format)format);
+        shot.w      = width;
+        shot.h      = height;
+        shot.stride = stride;
+    });
+    shot.frame->setBufferDone([this, &shot](CCZwlrScreencopyFrameV1* r) {
+        if (shot.frame.get() != r || shot.buffer)
+            return;
+
+        shot.memory = anonymous_shm_alloc((size_t)shot.stride * shot.h, SHM_HUGEPAGES_NONE);
+        shot.pool   = import_wl_shm_pool(shot.memory.fd, shot.memory.capacity);
+        if (!shot.pool) {
+            Debug::log(ERR, "[screencopy] couldn't allocate a buffer for the cursor");
+            releaseShots();
+            return;
+        }
+
+        shot.buffer = makeShared<CCWlBuffer>(shot.pool->sendCreateBuffer(0, shot.w, shot.h, shot.stride, wlSHMFromDrmFourcc(shot.fmt)));
+        shot.frame->sendCopy(shot.buffer->resource());
+    });
+    shot.frame->setReady([this, &shot](CCZwlrScreencopyFrameV1* r, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+        if (shot.frame.get() != r)
+            return;
+
+        shot.ready = true;
+
+        if (m_sShots[0].ready && m_sShots[1].ready)
+            finishBitmap();
+    });
+    shot.frame->setFailed([this, &shot, withCursor](CCZwlrScreencopyFrameV1* r) {
+        if (shot.frame.get() != r)
+            return;
+
+        Debug::log(TRACE, "[screencopy] cursor capture {} the cursor failed", withCursor ? "with" : "without");
+        releaseShots();
+    });
+}
+
+void CCursorCapture::finishBitmap() {
+    const auto& WITH    = m_sShots[0];
+    const auto& WITHOUT = m_sShots[1];
+
+    const bool  SWAPRB   = WITH.fmt == DRM_FORMAT_XBGR8888 || WITH.fmt == DRM_FORMAT_ABGR8888;
+    const bool  USABLE32 = SWAPRB || WITH.fmt == DRM_FORMAT_XRGB8888 || WITH.fmt == DRM_FORMAT_ARGB8888;
+
+    if (!USABLE32 || WITH.fmt != WITHOUT.fmt || WITH.w != WITHOUT.w || WITH.h != WITHOUT.h || WITH.stride != WITHOUT.stride) {
+        Debug::log(TRACE, "[screencopy] cursor capture came back in {} / {}, can't diff", WITH.fmt, WITHOUT.fmt);
+        releaseShots();
+        return;
+    }
+
+    // the box was logical, the shots are in output pixels
+    const double SCALEX = (double)WITH.w / std::min<int32_t>(XDPH_CURSOR_BOX, m_sOutput.w);
+    const double SCALEY = (double)WITH.h / std::min<int32_t>(XDPH_CURSOR_BOX, m_sOutput.h);
+
+    auto         bitmap = cursorBitmapFromDiff(WITH.memory.map, WITHOUT.memory.map, WITH.w, WITH.h, WITH.stride, SWAPRB, std::lround(m_fBoxHotspotX * SCALEX),
+                                               std::lround(m_fBoxHotspotY * SCALEY), XDPH_CURSOR_BITMAP_MAX);
+
+    releaseShots();
+
+    if (bitmap.w == m_sState.w && bitmap.h == m_sState.h && bitmap.hotspotX == m_sState.hotspotX && bitmap.hotspotY == m_sState.hotspotY && bitmap.pixels == m_sState.pixels &&
+        m_sState.serial)
+        return;
+
+    m_sState.w        = bitmap.w;
+    m_sState.h        = bitmap.h;
+    m_sState.hotspotX = bitmap.hotspotX;
+    m_sState.hotspotY = bitmap.hotspotY;
+    m_sState.pixels   = std::move(bitmap.pixels);
+    m_sState.serial++;
+
+    Debug::log(TRACE, "[screencopy] cursor bitmap {} is {}x{}, hotspot {}x{}", m_sState.serial, m_sState.w, m_sState.h, m_sState.hotspotX, m_sState.hotspotY);
+}
+
+void CCursorCapture::releaseShots() {
+    for (auto& shot : m_sShots) {
+        // this runs from the frames' own events, they're dropped on the next poll
+        if (shot.frame)
+            m_vRetiredFrames.emplace_back(shot.frame);
+
+        shot.buffer.reset();
+        shot.pool.reset();
+
+        if (shot.memory.map)
+            munmap(shot.memory.map, shot.memory.capacity);
+        if (shot.memory.fd >= 0)
+            close(shot.memory.fd);
+
+        shot = SShot{};
+    }
+
+    m_bCapturing = false;
+}
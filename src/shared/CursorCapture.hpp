@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "ScreencopyShared.hpp"
+#include "wlr-screencopy-unstable-v1.hpp"
+
+// where the pointer is and what it looks like, for sessions in cursor metadata mode. The position comes from
+// Hyprland's socket. Nothing hands out the cursor image, so it's worked out by capturing a small box around the
+// pointer with and without the cursor: whatever differs between the two is cursor.
+class CCursorCapture {
+  public:
+    // area is the part of the output the session captures, in logical pixels. Empty for all of it. onUpdate runs
+    // whenever a poll has come back, from the event loop.
+    CCursorCapture(SP<CCZwlrScreencopyManagerV1> manager, const std::string& output, uint32_t areaX, uint32_t areaY, uint32_t areaW, uint32_t areaH,
+                   std::function<void()> onUpdate);
+    ~CCursorCapture();
+
+    struct SState {
+        bool                  visible = false; // over the area of an untransformed output
+        int32_t               x = 0, y = 0;    // in buffer pixels of the area
+
+        // bumped every time the bitmap changes. A hidden cursor has an empty one.
+        uint64_t              serial = 0;
+        uint32_t              w = 0, h = 0;
+        int32_t               hotspotX = 0, hotspotY = 0;
+        std::vector<uint32_t> pixels; // argb8888, w * h
+    };
+
+    // asks Hyprland where the pointer is without waiting for it. Once it answers, a new bitmap is started on if one is
+    // due and onUpdate runs. Does nothing while the last poll is still out.
+    void          poll();
+    // the pointer hasn't moved in a while
+    bool          idle() const;
+    const SState& state() const;
+
+  private:
+    // one of the two captures of the box
+    struct SShot {
+        SP<CCZwlrScreencopyFrameV1> frame;
+        SP<CCWlShmPool>             pool;
+        SP<CCWlBuffer>              buffer;
+        SSHMAllocation              memory;
+        uint32_t                    w = 0, h = 0, stride = 0, fmt = 0;
+        bool                        ready = false;
+    };
+
+    void                                     sendRequest(const std::string& request);
+    void                                     onReadable();
+    void                                     finishRequest();
+    void                                     onIPCFailed();
+    bool                                     parseOutput(const std::string& reply);
+    void                                     updatePosition(const std::string& reply);
+    void                                     captureBitmap(double x, double y);
+    void                                     initShot(SShot& shot, bool withCursor);
+    void                                     finishBitmap();
+    void                                     releaseShots();
+
+    SP<CCZwlrScreencopyManagerV1>            m_pManager;
+    std::string                              m_szOutput;
+    uint32_t                                 m_iAreaX = 0, m_iAreaY = 0, m_iAreaW = 0, m_iAreaH = 0;
+
+    // from Hyprland, in the global layout
+    struct {
+        bool                                  valid = false;
+        int32_t                               x = 0, y = 0;
+        uint32_t                              w = 0, h = 0; // logical
+        double                                scale     = 1.0;
+        int32_t                               transform = 0;
+        std::chrono::steady_clock::time_point queried;
+    } m_sOutput;
+
+    // one request to Hyprland's socket at a time
+    struct {
+        int                                   fd       = -1;
+        bool                                  monitors = false; // the cursor position is asked for once this is in
+        std::string                           reply;
+        std::chrono::steady_clock::time_point sent;
+    } m_sRequest;
+
+    std::function<void()>                    m_fnOnUpdate;
+    SState                                   m_sState;
+    bool                                     m_bIPCFailed = false;
+    std::chrono::steady_clock::time_point    m_lastMoved;
+
+    SShot                                    m_sShots[2]; // with the cursor, and without
+    std::vector<SP<CCZwlrScreencopyFrameV1>> m_vRetiredFrames;
+    bool                                     m_bCapturing = false;
+    bool                                     m_bMoved     = false; // since the last bitmap
+    double                                   m_fBoxHotspotX = 0, m_fBoxHotspotY = 0; // where the pointer was in the box, logical
+    std::chrono::steady_clock::time_point    m_lastBitmap;
+};
@@ -0,0 +1,215 @@
+#include "DMABUFFeedback.hpp"
+#include "../helpers/Log.hpp"
+
+#include <algorithm>
+#include <gbm.h>
+#include <libdrm/drm_fourcc.h>
+#include <sys/mman.h>
+#include <wayland-client.h>
+#include "linux-dmabuf-v1.hpp"
+
+CDMABUFFeedback::~CDMABUFFeedback() {
+    unmapFormatTable();
+}
+
+void CDMABUFFeedback::unmapFormatTable() {
+    if (m_pFormatTable)
+        munmap(m_pFormatTable, m_iFormatTableSize);
+
+    m_pFormatTable     = nullptr;
+    m_iFormatTableSize = 0;
+}
+
+void CDMABUFFeedback::mainDevice(dev_t device) {
+    m_mainDevice = device;
+}
+
+void CDMABUFFeedback::formatTable(int fd, uint32_t size) {
+    unmapFormatTable();
+
+    m_pFormatTable = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (m_pFormatTable == MAP_FAILED) {
+        Debug::log(ERR, "[dmabuf] format table failed to mmap");
+        m_pFormatTable = nullptr;
+        return;
+    }
+
+    m_iFormatTableSize = size;
+}
+
+void CDMABUFFeedback::trancheTargetDevice(dev_t device, bool usable) {
+    m_pendingTranche.device = device;
+    m_pendingTranche.usable = usable;
+}
+
+void CDMABUFFeedback::trancheFlags(uint32_t flags) {
+    m_pendingTranche.scanout = flags & ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT;
+}
+
+void CDMABUFFeedback::trancheFormats(wl_array* indices) {
+    if (!m_pFormatTable)
+        return;
+
+    struct fm_entry {
+        uint32_t format;
+        uint32_t padding;
+        uint64_t modifier;
+    };
+    // An entry in the table has to be 16 bytes long
+    static_assert(sizeof(struct fm_entry) == 16);
+
+    const uint32_t ENTRIES = m_iFormatTableSize / sizeof(fm_entry);
+    const auto     TABLE   = (const fm_entry*)m_pFormatTable;
+
+    for (uint16_t* idx = (uint16_t*)indices->data; (const char*)idx < (const char*)indices->data + indices->size; idx++) {
+        if (*idx >= ENTRIES)
+            continue;
+
+        m_pendingTranche.formats.push_back({TABLE[*idx].format, TABLE[*idx].modifier});
+    }
+}
+
+void CDMABUFFeedback::trancheDone() {
+    m_vPendingTranches.emplace_back(std::move(m_pendingTranche));
+    m_pendingTranche = {};
+}
+
+std::vector<uint32_t> CDMABUFFeedback::done(const std::function<gbm_device*(dev_t)>& allocatorFor) {
+    unmapFormatTable();
+
+    m_vTranches = std::move(m_vPendingTranches);
+    m_vPendingTranches.clear();
+
+    // group every usable modifier by device and format. Tranches come in preference order, so walking them in order
+    // leaves each format's modifiers sorted by priority, and makes the first device seen for a format its preferred one.
+    std::unordered_map<dev_t, std::unordered_map<uint32_t, std::vector<uint64_t>>> byDevice;
+    std::vector<std::pair<dev_t, uint32_t>>                                        formatOrder;
+    std::unordered_map<uint32_t, dev_t>                                            preferred, preferredScanout;
+
+    for (const auto& tranche : m_vTranches) {
+        if (!tranche.usable)
+            continue;
+
+        const auto ALLOCATOR = allocatorFor(tranche.device);
+
+        for (const auto& fmt : tranche.formats) {
+            if (fmt.mod != DRM_FORMAT_MOD_INVALID && (!ALLOCATOR || gbm_device_get_format_modifier_plane_count(ALLOCATOR, fmt.fourcc, fmt.mod) <= 0))
+                continue;
+
+            auto& mods = byDevice[tranche.device][fmt.fourcc];
+            if (mods.empty())
+                formatOrder.emplace_back(tranche.device, fmt.fourcc);
+
+            if (std::ranges::find(mods, fmt.mod) == mods.end())
+                mods.push_back(fmt.mod);
+
+            preferred.try_emplace(fmt.fourcc, tranche.device);
+            if (tranche.scanout)
+                preferredScanout.try_emplace(fmt.fourcc, tranche.device);
+        }
+    }
+
+    // a device that can scan a format out is the one driving the output, allocating there saves the compositor a cross-gpu copy
+    for (const auto& [FOURCC, DEVICE] : preferredScanout) {
+        preferred[FOURCC] = DEVICE;
+    }
+
+    const auto OLDMODIFIERS = std::move(m_vModifiers);
+    const auto OLDINDEX     = std::move(m_mFormatIndex);
+    const auto OLDPREFERRED = std::move(m_mPreferredDevice);
+    m_vModifiers.clear();
+    m_mFormatIndex.clear();
+    m_mPreferredDevice = std::move(preferred);
+
+    // FNV-1a, stable across runs so persisted stream profiles can tell whether they're still valid
+    m_iHash        = 14695981039346656037ULL;
+    const auto MIX = [this](uint64_t v) {
+        for (int i = 0; i < 8; ++i) {
+            m_iHash ^= (v >> (i * 8)) & 0xFF;
+            m_iHash *= 1099511628211ULL;
+        }
+    };
+
+    MIX(m_mainDevice);
+
+    for (const auto& [DEVICE, FOURCC] : formatOrder) {
+        const auto& MODS               = byDevice[DEVICE][FOURCC];
+        m_mFormatIndex[DEVICE][FOURCC] = {(uint32_t)m_vModifiers.size(), (uint32_t)MODS.size()};
+        m_vModifiers.insert(m_vModifiers.end(), MODS.begin(), MODS.end());
+
+        MIX(DEVICE);
+        MIX(FOURCC);
+        for (const auto MOD : MODS) {
+            MIX(MOD);
+        }
+    }
+
+    // a format changed if it moved to another device, or its modifiers on the preferred one did
+    std::vector<uint32_t> changed;
+
+    for (const auto& [FOURCC, DEVICE] : m_mPreferredDevice) {
+        const auto OLD = OLDPREFERRED.find(FOURCC);
+        if (OLD == OLDPREFERRED.end() || OLD->second != DEVICE) {
+            changed.push_back(FOURCC);
+            continue;
+        }
+
+        const auto SPAN   = m_mFormatIndex.at(DEVICE).at(FOURCC);
+        const auto OLDDEV = OLDINDEX.find(DEVICE);
+        if (OLDDEV == OLDINDEX.end() || !OLDDEV->second.contains(FOURCC)) {
+            changed.push_back(FOURCC);
+            continue;
+        }
+
+        const auto OLDSPAN = OLDDEV->second.at(FOURCC);
+        if (!std::ranges::equal(std::span{m_vModifiers}.subspan(SPAN.first, SPAN.second), std::span{OLDMODIFIERS}.subspan(OLDSPAN.first, OLDSPAN.second)))
+            changed.push_back(FOURCC);
+    }
+
+    for (const auto& [FOURCC, DEVICE] : OLDPREFERRED) {
+        if (!m_mPreferredDevice.contains(FOURCC))
+            changed.push_back(FOURCC);
+    }
+
+    Debug::log(LOG, "[dmabuf] Feedback: {} tranches, {} devices, {} formats, {} modifiers, {} formats changed", m_vTranches.size(), m_mFormatIndex.size(),
+               m_mPreferredDevice.size(), m_vModifiers.size(), changed.size());
+
+    return changed;
+}
+
+std::span<const uint64_t> CDMABUFFeedback::modifiersFor(uint32_t fourcc, dev_t device) const {
+    const auto DEV = m_mFormatIndex.find(device);
+
+    if (DEV == m_mFormatIndex.end())
+        return {};
+
+    const auto IT = DEV->second.find(fourcc);
+
+    if (IT == DEV->second.end())
+        return {};
+
+    return {m_vModifiers.data() + IT->second.first, IT->second.second};
+}
+
+dev_t CDMABUFFeedback::deviceFor(uint32_t fourcc) const {
+    const auto IT = m_mPreferredDevice.find(fourcc);
+
+    return IT == m_mPreferredDevice.end() ? m_mainDevice : IT->second;
+}
+
+bool CDMABUFFeedback::empty() const {
+    return m_vModifiers.empty();
+}
+
+uint64_t CDMABUFFeedback::hash() const {
+    return m_iHash;
+}
+
+dev_t CDMABUFFeedback::getMainDevice() const {
+    return m_mainDevice;
+}
+
+const std::vector<SDMABUFTranche>& CDMABUFFeedback::tranches() const {
+    return m_vTranches;
+}
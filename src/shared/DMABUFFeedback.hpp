@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+struct wl_array;
+struct gbm_device;
+
+struct SDMABUFModifier {
+    uint32_t fourcc = 0;
+    uint64_t mod    = 0;
+};
+
+struct SDMABUFTranche {
+    dev_t                        device  = 0;
+    bool                         scanout = false;
+    bool                         usable  = false; // targets a device we can allocate on
+    std::vector<SDMABUFModifier> formats;         // in the compositor's order
+};
+
+// zwp_linux_dmabuf_feedback_v1, with tranches kept in preference order. Once done, modifiers are indexed
+// by device and fourcc: each pair maps to a contiguous span, the highest priority tranche's modifiers first.
+class CDMABUFFeedback {
+  public:
+    ~CDMABUFFeedback();
+
+    // fed from the feedback object's events
+    void                               mainDevice(dev_t device);
+    void                               formatTable(int fd, uint32_t size);
+    void                               trancheTargetDevice(dev_t device, bool usable);
+    void                               trancheFlags(uint32_t flags);
+    void                               trancheFormats(wl_array* indices);
+    void                               trancheDone();
+    // returns the formats whose preferred device or modifiers changed since the last feedback
+    std::vector<uint32_t>              done(const std::function<gbm_device*(dev_t)>& allocatorFor);
+
+    // empty if the format can't be allocated on the device and shared
+    std::span<const uint64_t>          modifiersFor(uint32_t fourcc, dev_t device) const;
+    // the device of the most preferred scanout tranche listing the format, else of any tranche, else the main one
+    dev_t                              deviceFor(uint32_t fourcc) const;
+    bool                               empty() const;
+
+    // of the main device and usable formats, stable across runs
+    uint64_t                           hash() const;
+
+    dev_t                              getMainDevice() const;
+    const std::vector<SDMABUFTranche>& tranches() const;
+
+  private:
+    void                                                                                   unmapFormatTable();
+
+    dev_t                                                                                  m_mainDevice = 0;
+
+    // only mapped while a feedback is coming in
+    void*                                                                                  m_pFormatTable     = nullptr;
+    size_t                                                                                 m_iFormatTableSize = 0;
+
+    SDMABUFTranche                                                                         m_pendingTranche;
+    std::vector<SDMABUFTranche>                                                            m_vPendingTranches;
+    std::vector<SDMABUFTranche>                                                            m_vTranches;
+
+    std::vector<uint64_t>                                                                  m_vModifiers;
+    // device -> fourcc -> offset, count in m_vModifiers
+    std::unordered_map<dev_t, std::unordered_map<uint32_t, std::pair<uint32_t, uint32_t>>> m_mFormatIndex;
+    std::unordered_map<uint32_t, dev_t>                                                    m_mPreferredDevice;
+    uint64_t                                                                               m_iHash = 0;
+};
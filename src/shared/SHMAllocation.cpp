@@ -0,0 +1,73 @@
+#include "SHMAllocation.hpp"
+#include "../helpers/Log.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// a sealed memfd of size, or -1
+static int sealed_memfd(size_t size, unsigned int flags) {
+    int fd = memfd_create("xdph-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+    if (fd < 0)
+        return -1;
+
+    // nobody mapping it has to worry about it shrinking under them
+    if (ftruncate(fd, size) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+SSHMAllocation anonymous_shm_alloc(size_t size, eSHMHugepages hugepages) {
+    SSHMAllocation alloc;
+
+    if (hugepages == SHM_HUGEPAGES_HUGETLB) {
+        // these come out of vm.nr_hugepages, and mapping is where the reservation fails if there aren't enough
+        alloc.capacity = (size + XDPH_HUGEPAGE_SIZE - 1) / XDPH_HUGEPAGE_SIZE * XDPH_HUGEPAGE_SIZE;
+        alloc.fd       = sealed_memfd(alloc.capacity, MFD_HUGETLB);
+
+        if (alloc.fd >= 0) {
+            void* map = mmap(nullptr, alloc.capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, alloc.fd, 0);
+            if (map != MAP_FAILED) {
+                alloc.map = (uint8_t*)map;
+                return alloc;
+            }
+
+            close(alloc.fd);
+        }
+
+        Debug::log(WARN, "[screencopy] no hugetlb pages for {} bytes, falling back to transparent hugepages", alloc.capacity);
+        hugepages = SHM_HUGEPAGES_TRANSPARENT;
+    }
+
+    const size_t SMALLPAGE = sysconf(_SC_PAGESIZE);
+    const size_t PAGE      = hugepages == SHM_HUGEPAGES_TRANSPARENT ? XDPH_HUGEPAGE_SIZE : SMALLPAGE;
+
+    alloc.capacity = (size + PAGE - 1) / PAGE * PAGE;
+    alloc.fd       = sealed_memfd(alloc.capacity, 0);
+
+    if (alloc.fd < 0)
+        return {};
+
+    // populating has to wait for the advice with thp, or every page would already be a small one
+    void* map = mmap(nullptr, alloc.capacity, PROT_READ | PROT_WRITE, MAP_SHARED | (hugepages == SHM_HUGEPAGES_NONE ? MAP_POPULATE : 0), alloc.fd, 0);
+    if (map == MAP_FAILED) {
+        close(alloc.fd);
+        return {};
+    }
+
+    alloc.map = (uint8_t*)map;
+
+    if (hugepages == SHM_HUGEPAGES_TRANSPARENT) {
+        // only honored with shmem_enabled set to advise or within_size, harmless otherwise
+        madvise(alloc.map, alloc.capacity, MADV_HUGEPAGE);
+
+        for (size_t off = 0; off < alloc.capacity; off += SMALLPAGE) {
+            alloc.map[off] = 0;
+        }
+    }
+
+    return alloc;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// shm memfds backed by huge pages are sized in multiples of this, see screencopy:shm_hugepages
+#define XDPH_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+enum eSHMHugepages {
+    SHM_HUGEPAGES_NONE = 0,
+    SHM_HUGEPAGES_TRANSPARENT,
+    SHM_HUGEPAGES_HUGETLB,
+};
+
+// a sealed memfd, mapped read-write and pre-faulted. capacity is the size of both, size rounded up to whole pages.
+struct SSHMAllocation {
+    int      fd       = -1;
+    uint8_t* map      = nullptr;
+    size_t   capacity = 0;
+};
+
+// an empty allocation if it failed. HUGETLB falls back to TRANSPARENT when there aren't enough huge pages reserved.
+SSHMAllocation anonymous_shm_alloc(size_t size, eSHMHugepages hugepages);
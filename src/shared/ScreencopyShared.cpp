@@ -8,6 +8,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <hyprutils/os/Process.hpp>
 using namespace Hyprutils::OS;
@@ -150,6 +151,14 @@ wl_shm_format wlSHMFromDrmFourcc(uint32_t format) {
     }
 }
 
+uint32_t drmFourccBytesPerPixel(uint32_t format) {
+    switch (format) {
+        case DRM_FORMAT_BGR888: return 3;
+        case DRM_FORMAT_NV12: return 1;
+        default: return 4;
+    }
+}
+
 uint32_t drmFourccFromSHM(wl_shm_format format) {
     switch (format) {
         case WL_SHM_FORMAT_ARGB8888: return DRM_FORMAT_ARGB8888;
@@ -219,13 +228,14 @@ spa_video_format pwStripAlpha(spa_video_format format) {
     }
 }
 
-spa_pod* build_buffer(spa_pod_builder* b, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype) {
+spa_pod* build_buffer(spa_pod_builder* b, uint32_t buffers, uint32_t maxBuffers, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype) {
     assert(blocks > 0);
     assert(datatype > 0);
+    assert(maxBuffers >= XDPH_PWR_BUFFERS_MIN);
     spa_pod_frame f[1];
 
     spa_pod_builder_push_object(b, &f[0], SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers);
-    spa_pod_builder_add(b, SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(XDPH_PWR_BUFFERS, XDPH_PWR_BUFFERS_MIN, 32), 0);
+    spa_pod_builder_add(b, SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(std::clamp<uint32_t>(buffers, XDPH_PWR_BUFFERS_MIN, maxBuffers), XDPH_PWR_BUFFERS_MIN, maxBuffers), 0);
     spa_pod_builder_add(b, SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(blocks), 0);
     if (size > 0) {
         spa_pod_builder_add(b, SPA_PARAM_BUFFERS_size, SPA_POD_Int(size), 0);
@@ -302,44 +312,26 @@ spa_pod* build_format(spa_pod_builder* b, spa_video_format format, uint32_t widt
     return (spa_pod*)spa_pod_builder_pop(b, &f[0]);
 }
 
-void randname(char* buf) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    long r = ts.tv_nsec;
-    for (int i = 0; i < 6; ++i) {
-        assert(buf[i] == 'X');
-        buf[i] = 'A' + (r & 15) + (r & 16) * 2;
-        r >>= 5;
-    }
-}
-
-int anonymous_shm_open() {
-    char name[]  = "/xdph-shm-XXXXXX";
-    int  retries = 100;
-
-    do {
-        randname(name + strlen(name) - 6);
-
-        --retries;
-        // shm_open guarantees that O_CLOEXEC is set
-        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-        if (fd >= 0) {
-            shm_unlink(name);
-            return fd;
-        }
-    } while (retries > 0 && errno == EEXIST);
+spa_pod* build_yuv_format(spa_pod_builder* b, uint32_t width, uint32_t height, uint32_t framerate, spa_video_color_matrix matrix, spa_video_color_range range) {
+    spa_pod_frame f[1];
 
-    return -1;
+    spa_pod_builder_push_object(b, &f[0], SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+    spa_pod_builder_add(b, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
+    spa_pod_builder_add(b, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
+    /* format, converted from the capture by us */
+    spa_pod_builder_add(b, SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id(3, SPA_VIDEO_FORMAT_NV12, SPA_VIDEO_FORMAT_NV12, SPA_VIDEO_FORMAT_I420), 0);
+    spa_pod_builder_add(b, SPA_FORMAT_VIDEO_colorMatrix, SPA_POD_Id(matrix), 0);
+    spa_pod_builder_add(b, SPA_FORMAT_VIDEO_colorRange, SPA_POD_Id(range), 0);
+    spa_pod_builder_add(b, SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&SPA_RECTANGLE(width, height)), 0);
+    // variable framerate
+    spa_pod_builder_add(b, SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&SPA_FRACTION(0, 1)), 0);
+    spa_pod_builder_add(b, SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&SPA_FRACTION(framerate, 1), &SPA_FRACTION(1, 1), &SPA_FRACTION(framerate, 1)), 0);
+    return (spa_pod*)spa_pod_builder_pop(b, &f[0]);
 }
 
-SP<CCWlBuffer> import_wl_shm_buffer(int fd, wl_shm_format fmt, int width, int height, int stride) {
-    int size = stride * height;
-
+SP<CCWlShmPool> import_wl_shm_pool(int fd, int size) {
     if (fd < 0)
         return nullptr;
 
-    auto pool = makeShared<CCWlShmPool>(g_pPortalManager->m_sWaylandConnection.shm->sendCreatePool(fd, size));
-    auto buf  = makeShared<CCWlBuffer>(pool->sendCreateBuffer(0, width, height, stride, fmt));
-
-    return buf;
+    return makeShared<CCWlShmPool>(g_pPortalManager->m_sWaylandConnection.shm->sendCreatePool(fd, size));
 }
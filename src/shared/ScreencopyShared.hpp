@@ -15,10 +15,61 @@ extern "C" {
 #include "wayland.hpp"
 #include "wlr-foreign-toplevel-management-unstable-v1.hpp"
 #include "../includes.hpp"
+#include "SHMAllocation.hpp"
 
-#define XDPH_PWR_BUFFERS     4
-#define XDPH_PWR_BUFFERS_MIN 2
-#define XDPH_PWR_ALIGN       16
+#define XDPH_PWR_BUFFERS      4
+#define XDPH_PWR_BUFFERS_MIN  2
+#define XDPH_PWR_BUFFERS_MAX  32
+#define XDPH_PWR_ALIGN        16
+#define XDPH_PWR_DAMAGE_RECTS 16
+
+// with screencopy:adaptive_buffers, how many buffers a stream asks for follows how long its consumer holds them,
+// judged over windows of this many queued frames. Giving one back takes this many windows in a row that didn't need it.
+#define XDPH_ADAPT_WINDOW_FRAMES  120
+#define XDPH_ADAPT_SHRINK_WINDOWS 3
+
+// static captures before a session is considered idle, see screencopy:idle_min_fps
+#define XDPH_IDLE_GRACE_FRAMES 3
+
+// idle storages kept around for the next negotiation, across all streams. Shm ones stay mapped and
+// pre-faulted, so they're also capped by size.
+#define XDPH_BO_POOL_MAX        16
+#define XDPH_SHM_POOL_MAX_BYTES (256 * 1024 * 1024)
+
+// modifier probes are cached per size bucket, in pixels
+#define XDPH_MOD_PROBE_BUCKET    256
+#define XDPH_MOD_PROBE_CACHE_MAX 64
+
+// negotiated stream profiles kept on disk, see CStreamProfiles. One that pins shm after dmabuf failed is dropped after
+// XDPH_STREAM_PROFILE_SHM_TTL_S, so dmabuf gets another go.
+#define XDPH_STREAM_PROFILES_MAX      64
+#define XDPH_STREAM_PROFILE_SHM_TTL_S (24 * 60 * 60)
+
+// shm rgb -> yuv conversion, see CColorConverter. Damage is converted in tiles of this many pixels square,
+// jobs smaller than XDPH_CONVERT_INLINE_PIXELS don't wake the workers.
+#define XDPH_CONVERT_TILE          16
+#define XDPH_CONVERT_THREADS_MAX   8
+#define XDPH_CONVERT_INLINE_PIXELS (256 * 256)
+
+// the largest factor screencopy:downscale_height may pick
+#define XDPH_DOWNSCALE_MAX 4
+
+// cursor metadata, see CCursorCapture. The bitmap is cut out of a box this big around the pointer, in logical pixels,
+// with the pointer this far in. While the pointer moves it's refreshed at most every XDPH_CURSOR_REFRESH_MS, and
+// every XDPH_CURSOR_IDLE_REFRESH_MS regardless, to catch shape changes. A pointer that hasn't moved for
+// XDPH_CURSOR_IDLE_AFTER_MS is polled every XDPH_CURSOR_IDLE_POLL_MS instead of every frame.
+#define XDPH_CURSOR_BOX             96
+#define XDPH_CURSOR_BOX_HOTSPOT     32
+#define XDPH_CURSOR_BITMAP_MAX      128
+#define XDPH_CURSOR_REFRESH_MS      100
+#define XDPH_CURSOR_IDLE_REFRESH_MS 1000
+#define XDPH_CURSOR_OUTPUT_QUERY_MS 1000
+#define XDPH_CURSOR_IPC_TIMEOUT_MS  1000
+#define XDPH_CURSOR_IDLE_AFTER_MS   500
+#define XDPH_CURSOR_IDLE_POLL_MS    100
+
+// with screencopy:window_headroom, window streams are sized a quarter bigger than the window, rounded up to this
+#define XDPH_WINDOW_BUCKET 256
 
 enum eSelectionType {
     TYPE_INVALID = -1,
@@ -47,10 +98,11 @@ SSelectionData   promptForScreencopySelection();
 uint32_t         drmFourccFromSHM(wl_shm_format format);
 spa_video_format pwFromDrmFourcc(uint32_t format);
 wl_shm_format    wlSHMFromDrmFourcc(uint32_t format);
+uint32_t         drmFourccBytesPerPixel(uint32_t format); // of the first plane
 spa_video_format pwStripAlpha(spa_video_format format);
 std::string      getRandName(std::string prefix);
 spa_pod*         build_format(spa_pod_builder* b, spa_video_format format, uint32_t width, uint32_t height, uint32_t framerate, uint64_t* modifiers, int modifier_count);
+spa_pod*         build_yuv_format(spa_pod_builder* b, uint32_t width, uint32_t height, uint32_t framerate, spa_video_color_matrix matrix, spa_video_color_range range);
 spa_pod*         fixate_format(spa_pod_builder* b, spa_video_format format, uint32_t width, uint32_t height, uint32_t framerate, uint64_t* modifier);
-spa_pod*         build_buffer(spa_pod_builder* b, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype);
-int              anonymous_shm_open();
-SP<CCWlBuffer>   import_wl_shm_buffer(int fd, wl_shm_format fmt, int width, int height, int stride);
\ No newline at end of file
+spa_pod*         build_buffer(spa_pod_builder* b, uint32_t buffers, uint32_t maxBuffers, uint32_t blocks, uint32_t size, uint32_t stride, uint32_t datatype);
+SP<CCWlShmPool>  import_wl_shm_pool(int fd, int size);
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include "StreamProfiles.hpp"
+#include "../helpers/Log.hpp"
+#include "ScreencopyShared.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+static uint64_t unixNow() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+CStreamProfiles::CStreamProfiles() {
+    const auto XDG_STATE_HOME = getenv("XDG_STATE_HOME");
+    const auto HOME           = getenv("HOME");
+
+    if (!XDG_STATE_HOME && !HOME) {
+        Debug::log(WARN, "[profiles] neither $HOME nor $XDG_STATE_HOME is present in env, stream profiles won't persist");
+        return;
+    }
+
+    m_szPath = (XDG_STATE_HOME ? std::string{XDG_STATE_HOME} : std::string{HOME} + "/.local/state") + "/xdph/stream-profiles";
+
+    load();
+}
+
+std::optional<SStreamProfile> CStreamProfiles::get(const std::string& key, uint64_t feedbackHash) {
+    const auto IT = std::ranges::find_if(m_vProfiles, [&](const auto& other) { return other.first == key; });
+
+    if (IT == m_vProfiles.end())
+        return std::nullopt;
+
+    if (IT->second.feedbackHash != feedbackHash) {
+        Debug::log(LOG, "[profiles] dmabuf feedback changed since {} was negotiated, dropping its profile", key);
+        m_vProfiles.erase(IT);
+        save();
+        return std::nullopt;
+    }
+
+    if (!IT->second.dmabuf && unixNow() - IT->second.stored >= XDPH_STREAM_PROFILE_SHM_TTL_S) {
+        Debug::log(LOG, "[profiles] {} fell back to shm a while ago, trying dmabuf again", key);
+        m_vProfiles.erase(IT);
+        save();
+        return std::nullopt;
+    }
+
+    return IT->second;
+}
+
+void CStreamProfiles::store(const std::string& key, SStreamProfile profile) {
+    const auto IT = std::ranges::find_if(m_vProfiles, [&](const auto& other) { return other.first == key; });
+
+    profile.stored = unixNow();
+
+    if (IT != m_vProfiles.end()) {
+        if (IT->second.fourcc == profile.fourcc && IT->second.modifier == profile.modifier && IT->second.dmabuf == profile.dmabuf &&
+            IT->second.feedbackHash == profile.feedbackHash)
+            return;
+
+        m_vProfiles.erase(IT);
+    }
+
+    m_vProfiles.emplace_back(key, profile);
+    if (m_vProfiles.size() > XDPH_STREAM_PROFILES_MAX)
+        m_vProfiles.erase(m_vProfiles.begin());
+
+    Debug::log(LOG, "[profiles] {}: fourcc {:x} modifier {:x} {}", key, profile.fourcc, profile.modifier, profile.dmabuf ? "dmabuf" : "shm");
+
+    save();
+}
+
+void CStreamProfiles::remove(const std::string& key) {
+    if (!std::erase_if(m_vProfiles, [&](const auto& other) { return other.first == key; }))
+        return;
+
+    Debug::log(LOG, "[profiles] {}: dropped", key);
+
+    save();
+}
+
+void CStreamProfiles::load() {
+    std::ifstream file(m_szPath);
+
+    if (!file.good())
+        return;
+
+    // one profile per line: fourcc modifier dmabuf feedback stored key. The key goes last, it may contain spaces.
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream stream(line);
+        SStreamProfile     profile;
+        std::string        key;
+
+        if (!(stream >> std::hex >> profile.fourcc >> profile.modifier >> profile.dmabuf >> profile.feedbackHash >> profile.stored))
+            continue;
+
+        std::getline(stream >> std::ws, key);
+
+        if (key.empty())
+            continue;
+
+        m_vProfiles.emplace_back(key, profile);
+    }
+
+    Debug::log(LOG, "[profiles] Loaded {} stream profiles from {}", m_vProfiles.size(), m_szPath);
+}
+
+void CStreamProfiles::save() {
+    if (m_szPath.empty())
+        return;
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path{m_szPath}.parent_path(), ec);
+
+    std::ofstream file(m_szPath, std::ios::trunc);
+
+    if (!file.good()) {
+        Debug::log(WARN, "[profiles] Couldn't write {}", m_szPath);
+        return;
+    }
+
+    for (const auto& [key, profile] : m_vProfiles) {
+        file << std::hex << profile.fourcc << " " << profile.modifier << " " << profile.dmabuf << " " << profile.feedbackHash << " " << profile.stored << " " << key << "\n";
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// what a stream ended up negotiating last time, so the next session can offer it straight away
+struct SStreamProfile {
+    uint32_t fourcc       = 0;
+    uint64_t modifier     = 0;
+    bool     dmabuf       = false;
+    uint64_t feedbackHash = 0; // of the dmabuf feedback the profile was negotiated under
+    uint64_t stored       = 0; // unix time
+};
+
+// profiles per app and capture target, persisted in $XDG_STATE_HOME/xdph/stream-profiles
+class CStreamProfiles {
+  public:
+    CStreamProfiles();
+
+    // nullopt if there is none, it was negotiated under a different dmabuf feedback, or it's an expired shm one
+    std::optional<SStreamProfile> get(const std::string& key, uint64_t feedbackHash);
+    void                          store(const std::string& key, SStreamProfile profile);
+    void                          remove(const std::string& key);
+
+  private:
+    void                                                load();
+    void                                                save();
+
+    std::string                                         m_szPath;
+
+    // least recently stored first
+    std::vector<std::pair<std::string, SStreamProfile>> m_vProfiles;
+};